@@ -12,13 +12,20 @@
 #include <linux/delay.h>
 #include <linux/kobject.h>
 #include <linux/sysfs.h>
+#include <linux/rwsem.h>
+#include <linux/xarray.h>
+#include <linux/idr.h>
+#include <linux/bitmap.h>
+#include <linux/debugfs.h>
 
 #include "error.h"
 #include "amc_pci_core.h"
 #include "amc_pci_device.h"
 #include "dma_control.h"
+#include "dma_cache.h"
 #include "interrupts.h"
 #include "registers.h"
+#include "sampler.h"
 #include "memory.h"
 #include "prom_processing.h"
 #include "debug.h"
@@ -59,7 +66,8 @@ struct amc_pci {
     struct pci_dev *dev;
     int board;              // Index number for this board
     int major;              // Major device number
-    int minor;              // Associated minor number
+    int minor;              // First minor number of the board
+    unsigned int nminors;   // Number of minors reserved for the board
 
     /* Reference counting and completion to cope with lifetime management during
      * FPGA reload events. */
@@ -69,9 +77,15 @@ struct amc_pci {
     /* BAR2 memory mapped region, used for driver control. */
     void __iomem *ctrl_memory;
 
+    /* BAR0 register region, only used by the driver for streaming. */
+    void __iomem *reg_memory;
+
     /* Locking control for exclusive access to ctrl_memory. */
     struct register_locking locking;
 
+    /* Periodic sampling of BAR0 registers. */
+    struct sampler_control sampler;
+
     /* DMA controller. */
     struct dma_control *dma;
 
@@ -80,14 +94,29 @@ struct amc_pci {
 
     /* PROM data */
     struct prom_context *prom;
+
+    /* Caches of cacheable DMA areas by minor index, created on first open and
+     * protected by firmware_lock. */
+    struct xarray caches;
+
+    struct dentry *debugfs_dir;         // Per board debugfs directory
+
+    /* FPGA reload management.  File operations hold reload_sem for reading
+     * while they use the hardware and a reload holds it for writing. */
+    struct rw_semaphore reload_sem;
+    struct mutex handles_lock;
+    struct list_head handles;           // All open file handles
+    struct pci_saved_state *pci_state;  // Configuration saved at probe
+
+    /* Serialises changes to the firmware state between FPGA reload and PCIe
+     * error recovery.  Taken after reload_sem. */
+    struct mutex firmware_lock;
 };
 
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Basic file operations. */
 
-#define MAX_MINORS_PER_BOARD    16
-
 
 static ssize_t prom_used_read(struct file *filp, struct kobject *kobj,
     struct bin_attribute *attr, char *buff, loff_t off, size_t count)
@@ -97,8 +126,15 @@ static ssize_t prom_used_read(struct file *filp, struct kobject *kobj,
     size_t size = min(count, PROM_MAX_LENGTH - (size_t) off);
     struct pci_dev *pdev = to_pci_dev(kobj_to_dev(kobj));
     struct amc_pci *priv = pci_get_drvdata(pdev);
-    memcpy(buff, prom_get_buffer(priv->prom) + off, size);
-    return size;
+    ssize_t rc = -ENODEV;
+    down_read(&priv->reload_sem);
+    if (priv->prom)
+    {
+        memcpy(buff, prom_get_buffer(priv->prom) + off, size);
+        rc = size;
+    }
+    up_read(&priv->reload_sem);
+    return rc;
 }
 
 
@@ -107,7 +143,10 @@ static ssize_t prom_read(struct file *filp, struct kobject *kobj,
 {
     struct pci_dev *pdev = to_pci_dev(kobj_to_dev(kobj));
     struct amc_pci *priv = pci_get_drvdata(pdev);
-    return read_prom(priv->prom, buff, off, count);
+    down_read(&priv->reload_sem);
+    ssize_t rc = priv->prom ? read_prom(priv->prom, buff, off, count) : -ENODEV;
+    up_read(&priv->reload_sem);
+    return rc;
 }
 
 
@@ -125,6 +164,87 @@ void amc_pci_release(struct inode *inode)
 }
 
 
+void amc_pci_add_handle(
+    struct file *file, struct amc_pci_handle *handle,
+    void (*revoke)(struct amc_pci_handle *handle))
+{
+    struct cdev *cdev = file_inode(file)->i_cdev;
+    struct amc_pci *amc_priv = container_of(cdev, struct amc_pci, cdev);
+    *handle = (struct amc_pci_handle) {
+        .amc_priv = amc_priv,
+        .file = file,
+        .revoke = revoke,
+    };
+    mutex_lock(&amc_priv->handles_lock);
+    list_add_tail(&handle->list, &amc_priv->handles);
+    mutex_unlock(&amc_priv->handles_lock);
+}
+
+
+void amc_pci_remove_handle(struct amc_pci_handle *handle)
+{
+    struct amc_pci *amc_priv = handle->amc_priv;
+    mutex_lock(&amc_priv->handles_lock);
+    list_del(&handle->list);
+    mutex_unlock(&amc_priv->handles_lock);
+}
+
+
+int amc_pci_enter(struct amc_pci_handle *handle)
+{
+    down_read(&handle->amc_priv->reload_sem);
+    if (handle->revoked)
+    {
+        up_read(&handle->amc_priv->reload_sem);
+        return -ENODEV;
+    }
+    return 0;
+}
+
+
+int amc_pci_try_enter(struct amc_pci_handle *handle)
+{
+    if (!down_read_trylock(&handle->amc_priv->reload_sem))
+        return -EAGAIN;
+    if (handle->revoked)
+    {
+        up_read(&handle->amc_priv->reload_sem);
+        return -ENODEV;
+    }
+    return 0;
+}
+
+
+void amc_pci_leave(struct amc_pci_handle *handle)
+{
+    up_read(&handle->amc_priv->reload_sem);
+}
+
+
+bool amc_pci_revoked(struct amc_pci_handle *handle)
+{
+    return READ_ONCE(handle->revoked);
+}
+
+
+/* Must be called with reload_sem held for writing, so that no file operations
+ * are in progress. */
+static void revoke_handles(struct amc_pci *amc_priv)
+{
+    mutex_lock(&amc_priv->handles_lock);
+    struct amc_pci_handle *handle;
+    list_for_each_entry(handle, &amc_priv->handles, list)
+    {
+        if (!handle->revoked)
+        {
+            WRITE_ONCE(handle->revoked, true);
+            handle->revoke(handle);
+        }
+    }
+    mutex_unlock(&amc_priv->handles_lock);
+}
+
+
 static bool validate_file_permission(
     struct file *file, bool can_read, bool can_write)
 {
@@ -138,6 +258,92 @@ static bool validate_file_permission(
 }
 
 
+/* Returns the write pointer register for a DMA area marked for streaming in the
+ * PROM, or NULL if the area can't be streamed. */
+static void __iomem *find_write_pointer(
+    struct amc_pci *amc_priv, const char *name)
+{
+    union prom_entry *pentry;
+    prom_for_each_entry(pentry, amc_priv->prom)
+    {
+        if (pentry->tag == PROM_DMA_STREAM_TAG  &&
+            strcmp(pentry->dma_stream.name, name) == 0  &&
+            pentry->dma_stream.write_pointer + sizeof(u32) <=
+                pci_resource_len(amc_priv->dev, 0))
+            return amc_priv->reg_memory + pentry->dma_stream.write_pointer;
+    }
+    return NULL;
+}
+
+
+/* Returns the DMA controller if the PROM gives the address of the registers
+ * seen by the DMA engine, which is returned in *base, otherwise NULL. */
+static struct dma_control *find_register_dma(
+    struct amc_pci *amc_priv, size_t *base)
+{
+    union prom_entry *pentry =
+        prom_find_entry_by_tag(amc_priv->prom, PROM_REGISTERS_TAG);
+    if (!pentry  ||  !amc_priv->dma)
+        return NULL;
+    *base = pentry->registers.base;
+    return amc_priv->dma;
+}
+
+
+/* Returns the cache for the DMA area with the given minor, creating it on the
+ * first open.  Caches are kept until the firmware is reloaded. */
+static struct dma_cache *get_dma_cache(
+    struct amc_pci *amc_priv, int minor_index, size_t base, size_t length)
+{
+    mutex_lock(&amc_priv->firmware_lock);
+    struct dma_cache *cache = xa_load(&amc_priv->caches, minor_index);
+    if (!cache)
+    {
+        cache = create_dma_cache(amc_priv->dma, base, length);
+        if (!IS_ERR(cache))
+        {
+            int rc = xa_err(xa_store(
+                &amc_priv->caches, minor_index, cache, GFP_KERNEL));
+            if (rc < 0)
+            {
+                destroy_dma_cache(cache);
+                cache = ERR_PTR(rc);
+            }
+        }
+    }
+    mutex_unlock(&amc_priv->firmware_lock);
+    return cache;
+}
+
+
+static void destroy_dma_caches(struct amc_pci *amc_priv)
+{
+    struct dma_cache *cache;
+    unsigned long index;
+    xa_for_each(&amc_priv->caches, index, cache)
+        destroy_dma_cache(cache);
+    xa_destroy(&amc_priv->caches);
+}
+
+
+static int open_dma_area(
+    struct file *file, struct amc_pci *amc_priv, int minor_index,
+    size_t base, size_t length, u8 perm, const char *name)
+{
+    struct dma_cache *cache = NULL;
+    if (PROM_PERM_CACHEABLE(perm))
+    {
+        cache = get_dma_cache(amc_priv, minor_index, base, length);
+        if (IS_ERR(cache))
+            return PTR_ERR(cache);
+    }
+    file->f_op = &amc_pci_dma_fops;
+    return amc_pci_dma_open(
+        file, amc_priv->dma, amc_priv->interrupts, base, length,
+        find_write_pointer(amc_priv, name), cache);
+}
+
+
 static int amc_pci_open(struct inode *inode, struct file *file)
 {
     /* Recover our private data: the i_cdev lives inside our private structure,
@@ -150,23 +356,31 @@ static int amc_pci_open(struct inode *inode, struct file *file)
         return -ENXIO;
 
     /* Replace the file's f_ops with our own and perform any device specific
-     * initialisation. */
+     * initialisation.  The whole minor range of the board is registered, so
+     * minors not described by the current PROM are rejected here. */
     int minor_index = iminor(inode) - amc_priv->minor;
 
-    int rc = -EINVAL;
-    union prom_entry *pentry = prom_find_entry_with_minor(
-        amc_priv->prom, minor_index);
+    int rc = -ENODEV;
+    down_read(&amc_priv->reload_sem);
+    union prom_entry *pentry = amc_priv->prom ?
+        prom_find_entry_with_minor(amc_priv->prom, minor_index) : NULL;
 
     if (pentry)
     {
         switch (pentry->tag)
         {
             case PROM_DEVICE_TAG:
+            {
                 file->f_op = &amc_pci_reg_fops;
+                size_t dma_base = 0;
+                struct dma_control *dma =
+                    find_register_dma(amc_priv, &dma_base);
                 rc = amc_pci_reg_open(
                     file, amc_priv->dev, amc_priv->interrupts,
-                        &amc_priv->locking);
+                        &amc_priv->locking, &amc_priv->sampler,
+                        dma, dma_base);
                 break;
+            }
             case PROM_DMA_TAG:
             {
                 struct prom_dma_entry *dma_entry =
@@ -179,12 +393,12 @@ static int amc_pci_open(struct inode *inode, struct file *file)
                 }
                 else
                 {
-                    file->f_op = &amc_pci_dma_fops;
                     u64 base = (u64) dma_entry->base[0] |
                         (u64) dma_entry->base[1] << 16 |
                         (u64) dma_entry->base[2] << 32;
-                    rc = amc_pci_dma_open(
-                        file, amc_priv->dma, base, dma_entry->length);
+                    rc = open_dma_area(
+                        file, amc_priv, minor_index, base, dma_entry->length,
+                        dma_entry->perm, dma_entry->name);
                 }
                 break;
             }
@@ -200,15 +414,15 @@ static int amc_pci_open(struct inode *inode, struct file *file)
                 }
                 else
                 {
-                    file->f_op = &amc_pci_dma_fops;
-                    rc = amc_pci_dma_open(
-                        file, amc_priv->dma, dma_entry->base,
-                        dma_entry->length);
+                    rc = open_dma_area(
+                        file, amc_priv, minor_index, dma_entry->base,
+                        dma_entry->length, dma_entry->perm, dma_entry->name);
                 }
                 break;
             }
         }
     }
+    up_read(&amc_priv->reload_sem);
 
     if (rc < 0)
         amc_pci_release(inode);
@@ -222,6 +436,28 @@ static struct file_operations base_fops = {
 };
 
 
+/* The cdev covers the whole minor range of the board so that it can stay in
+ * place while the device nodes change across an FPGA reload. */
+static int add_board_cdev(struct amc_pci *amc_priv)
+{
+    cdev_init(&amc_priv->cdev, &base_fops);
+    amc_priv->cdev.owner = THIS_MODULE;
+    return cdev_add(&amc_priv->cdev,
+        MKDEV(amc_priv->major, amc_priv->minor), amc_priv->nminors);
+}
+
+
+static void destroy_device_nodes(
+    struct amc_pci *amc_priv, struct class *device_class)
+{
+    int major = amc_priv->major;
+    int minor = amc_priv->minor;
+
+    for (unsigned int i = 0; i < amc_priv->nminors; i ++)
+        device_destroy(device_class, MKDEV(major, minor + i));
+}
+
+
 static int create_device_nodes(
     struct pci_dev *pdev, struct amc_pci *amc_priv, struct class *device_class)
 {
@@ -229,13 +465,8 @@ static int create_device_nodes(
     int minor = amc_priv->minor;
     int rc = 0;
     size_t nentries_with_minor = prom_get_nentries_with_minor(amc_priv->prom);
-    TEST_OK(nentries_with_minor > 0, rc=-EINVAL, no_cdev,
+    TEST_OK(nentries_with_minor > 0, rc=-EINVAL, no_nodes,
         "Can't add devices with given PROM");
-    cdev_init(&amc_priv->cdev, &base_fops);
-    amc_priv->cdev.owner = THIS_MODULE;
-    rc = cdev_add(
-        &amc_priv->cdev, MKDEV(major, minor), nentries_with_minor);
-    TEST_RC(rc, no_cdev, "Unable to add device");
 
     size_t minor_off = 0;
     char *device_name = NULL;
@@ -288,57 +519,109 @@ static int create_device_nodes(
     return 0;
 
 prom_error:
-    cdev_del(&amc_priv->cdev);
-no_cdev:
+    destroy_device_nodes(amc_priv, device_class);
+no_nodes:
     return rc;
 }
 
 
-static void destroy_device_nodes(
-    struct amc_pci *amc_priv, struct class *device_class)
-{
-    int major = amc_priv->major;
-    int minor = amc_priv->minor;
-
-    for (int i = 0; i < prom_get_nentries(amc_priv->prom); i ++)
-        device_destroy(device_class, MKDEV(major, minor + i));
-    cdev_del(&amc_priv->cdev);
-}
-
-
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Device initialisation. */
 
-/* In principle there may be multiple boards installed, so we'll allow for this
- * when allocating the device nodes. */
+/* Any number of boards may be installed.  Each board is given a board number
+ * and a contiguous range of minors within our single major, sized from its
+ * PROM at probe time but no smaller than minors_per_board, so that a
+ * reloaded FPGA can describe a few more areas than the one found at probe.
+ * Minors are tracked in a bitmap so that a free range can be found and claimed
+ * in one step under minor_lock. */
 
-#define MAX_BOARDS          4
-#define MAX_MINORS          (MAX_BOARDS * MAX_MINORS_PER_BOARD)
+#define MAX_MINORS          (MINORMASK + 1)
+
+/* Minimum number of minors reserved for each board. */
+static int minors_per_board = 16;
+module_param(minors_per_board, int, S_IRUGO);
 
 static struct class *device_class;  // Device class
 static dev_t device_major;          // Major device number for our device
-static long device_boards;          // Bit mask of allocated boards
+static struct dentry *debugfs_root; // Top level debugfs directory
+static DEFINE_IDA(board_ida);       // Allocated board numbers
+static DECLARE_BITMAP(minor_map, MAX_MINORS);   // Allocated minors
+static DEFINE_MUTEX(minor_lock);    // Protects minor_map
 
 
-/* Searches for an unallocated board number. */
-static int get_free_board(unsigned int *board)
+static void release_minors(unsigned int minor, unsigned int count)
 {
-    for (int bit = 0; bit < MAX_BOARDS; bit ++)
+    mutex_lock(&minor_lock);
+    bitmap_clear(minor_map, minor, count);
+    mutex_unlock(&minor_lock);
+}
+
+
+/* Claims count consecutive minors, returning the first. */
+static int allocate_minors(unsigned int count)
+{
+    int rc = -ENOSPC;
+    mutex_lock(&minor_lock);
+    unsigned long minor =
+        bitmap_find_next_zero_area(minor_map, MAX_MINORS, 0, count, 0);
+    if (minor < MAX_MINORS)
     {
-        if (test_and_set_bit(bit, &device_boards) == 0)
-        {
-            *board = bit;
-            return 0;
-        }
+        bitmap_set(minor_map, minor, count);
+        rc = minor;
     }
-    printk(KERN_ERR "Unable to allocate minor for device\n");
-    return -EIO;
+    mutex_unlock(&minor_lock);
+    return rc;
 }
 
-static void release_board(unsigned int board)
+
+/* Returns true if board a comes before board b on the PCI bus. */
+static bool pci_position_before(struct pci_dev *a, struct pci_dev *b)
 {
-    test_and_clear_bit(board, &device_boards);
+    int domain_a = pci_domain_nr(a->bus);
+    int domain_b = pci_domain_nr(b->bus);
+    if (domain_a != domain_b)
+        return domain_a < domain_b;
+    else if (a->bus->number != b->bus->number)
+        return a->bus->number < b->bus->number;
+    else
+        return a->devfn < b->devfn;
+}
+
+
+/* Boards are probed asynchronously and so in no particular order.  To keep the
+ * device node names stable each board is numbered by its position on the bus
+ * among the boards present.  If that number is already taken, as can happen
+ * after boards have been hot plugged, the lowest free number is used. */
+static int allocate_board_number(struct pci_dev *pdev)
+{
+    int position = 0;
+    struct pci_dev *other = NULL;
+    while ((other = pci_get_subsys(
+            XILINX_VID, AMC525_DID, XILINX_VID, AMC525_SID, other)))
+        if (pci_position_before(other, pdev))
+            position += 1;
+
+    int board = ida_alloc_range(&board_ida, position, position, GFP_KERNEL);
+    if (board == -ENOSPC)
+        board = ida_alloc(&board_ida, GFP_KERNEL);
+    return board;
+}
+
+
+/* Reserves the range of minors for the board described by its PROM. */
+static int reserve_board_minors(struct amc_pci *amc_priv)
+{
+    unsigned int nminors = max_t(int, minors_per_board,
+        prom_get_nentries_with_minor(amc_priv->prom));
+    int rc = allocate_minors(nminors);
+    TEST_RC(rc, no_minors, "Unable to allocate minors for device");
+    amc_priv->minor = rc;
+    amc_priv->nminors = nminors;
+    return 0;
+
+no_minors:
+    return rc;
 }
 
 
@@ -378,17 +661,11 @@ static void disable_board(struct pci_dev *pdev)
 }
 
 
-static int initialise_board(struct pci_dev *pdev, struct amc_pci *amc_priv)
+/* Loads the PROM and initialises the DMA controller that it describes.  This
+ * is repeated each time the FPGA is reloaded. */
+static int initialise_firmware(struct pci_dev *pdev, struct amc_pci *amc_priv)
 {
     int rc = 0;
-
-    /* Map the control area bar. */
-    int bar2_length = pci_resource_len(pdev, 2);
-    TEST_OK(bar2_length >= BAR2_LENGTH, rc = -EINVAL, no_bar2,
-        "Invalid length for bar2");
-    amc_priv->ctrl_memory = pci_iomap(pdev, 2, BAR2_LENGTH);
-    TEST_PTR(amc_priv->ctrl_memory, rc, no_bar2, "Unable to map control BAR");
-
     struct prom_context *prom_context =
         load_prom(amc_priv->ctrl_memory + PROM_OFFSET);
     if (IS_ERR(prom_context))
@@ -399,9 +676,11 @@ static int initialise_board(struct pci_dev *pdev, struct amc_pci *amc_priv)
 
     amc_priv->prom = prom_context;
 
-    TEST_OK(
-        prom_get_nentries(amc_priv->prom) <= MAX_MINORS_PER_BOARD, rc = -E2BIG,
-        no_minor, "Device requires more minors than maximum allowed");
+    /* Until the board's minors are reserved at probe any number will do. */
+    TEST_OK(amc_priv->nminors == 0  ||
+            prom_get_nentries_with_minor(amc_priv->prom) <= amc_priv->nminors,
+        rc = -E2BIG, no_minor,
+        "Reloaded firmware needs more minors than reserved at probe");
 
     if (prom_get_dma_nentries(amc_priv->prom))
     {
@@ -417,22 +696,60 @@ static int initialise_board(struct pci_dev *pdev, struct amc_pci *amc_priv)
             mask, alignment_shift);
         if (rc < 0)  goto no_dma;
     }
+    return 0;
+
+no_dma:
+no_minor:
+    release_prom_context(prom_context);
+prom_error:
+    amc_priv->prom = NULL;
+    return rc;
+}
+
+
+static void terminate_firmware(struct amc_pci *amc_priv)
+{
+    destroy_dma_caches(amc_priv);
+    if (amc_priv->dma)
+        terminate_dma_control(amc_priv->dma);
+    amc_priv->dma = NULL;
+    release_prom_context(amc_priv->prom);
+    amc_priv->prom = NULL;
+}
+
+
+static int initialise_board(struct pci_dev *pdev, struct amc_pci *amc_priv)
+{
+    int rc = 0;
+
+    /* Map the control area bar. */
+    int bar2_length = pci_resource_len(pdev, 2);
+    TEST_OK(bar2_length >= BAR2_LENGTH, rc = -EINVAL, no_bar2,
+        "Invalid length for bar2");
+    amc_priv->ctrl_memory = pci_iomap(pdev, 2, BAR2_LENGTH);
+    TEST_PTR(amc_priv->ctrl_memory, rc, no_bar2, "Unable to map control BAR");
+    amc_priv->reg_memory = pci_iomap(pdev, 0, 0);
+    TEST_PTR(amc_priv->reg_memory, rc, no_bar0, "Unable to map register BAR");
+
+    rc = initialise_firmware(pdev, amc_priv);
+    if (rc < 0)  goto no_firmware;
 
     rc = initialise_interrupt_control(
         pdev, amc_priv->ctrl_memory + INTC_OFFSET, amc_priv->dma,
         &amc_priv->interrupts);
     if (rc < 0)  goto no_irq;
 
+    init_sampler_control(
+        &amc_priv->sampler, amc_priv->reg_memory, pci_resource_len(pdev, 0),
+        amc_priv->interrupts);
     return 0;
 
     terminate_interrupt_control(pdev, amc_priv->interrupts);
 no_irq:
-    if (prom_get_dma_nentries(amc_priv->prom))
-        terminate_dma_control(amc_priv->dma);
-no_minor:
-    release_prom_context(prom_context);
-no_dma:
-prom_error:
+    terminate_firmware(amc_priv);
+no_firmware:
+    pci_iounmap(pdev, amc_priv->reg_memory);
+no_bar0:
     pci_iounmap(pdev, amc_priv->ctrl_memory);
 no_bar2:
     return rc;
@@ -442,14 +759,240 @@ no_bar2:
 static void terminate_board(struct pci_dev *pdev)
 {
     struct amc_pci *amc_priv = pci_get_drvdata(pdev);
+    stop_sampler(&amc_priv->sampler);
     terminate_interrupt_control(pdev, amc_priv->interrupts);
-    if (prom_get_dma_nentries(amc_priv->prom))
-        terminate_dma_control(amc_priv->dma);
-    release_prom_context(amc_priv->prom);
+    /* The firmware is already gone if the last reload failed. */
+    if (amc_priv->prom)
+        terminate_firmware(amc_priv);
+    pci_iounmap(pdev, amc_priv->reg_memory);
     pci_iounmap(pdev, amc_priv->ctrl_memory);
 }
 
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* FPGA reload. */
+
+/* After the FPGA has been reprogrammed the board can be brought back without
+ * removing and rescanning the PCI bus.  All open file handles are revoked, the
+ * link is retrained by resetting the secondary bus of the upstream bridge, and
+ * the configuration saved at probe time is restored.  The PROM is then read
+ * again and the DMA controller rebuilt.  The board number, cdev and interrupt
+ * state are kept, so device nodes only change if the new PROM differs. */
+
+
+/* Restores the configuration saved at probe time after a reset. */
+static void restore_pci_state(struct amc_pci *amc_priv)
+{
+    pci_load_saved_state(amc_priv->dev, amc_priv->pci_state);
+    pci_restore_state(amc_priv->dev);
+}
+
+
+static void retrain_link(struct amc_pci *amc_priv)
+{
+    struct pci_dev *bridge = pci_upstream_bridge(amc_priv->dev);
+    if (bridge)
+        pci_bridge_secondary_bus_reset(bridge);
+    restore_pci_state(amc_priv);
+}
+
+
+static bool same_prom(struct prom_context *a, struct prom_context *b)
+{
+    return prom_get_length(a) == prom_get_length(b)  &&
+        memcmp(prom_get_buffer(a), prom_get_buffer(b),
+            prom_get_length(a)) == 0;
+}
+
+
+static int reload_board(struct amc_pci *amc_priv)
+{
+    struct pci_dev *pdev = amc_priv->dev;
+    printk(KERN_INFO "Reloading AMC525 board %d\n", amc_priv->board);
+
+    /* Wait for operations in progress to complete and revoke all handles.
+     * Revoking a stream waits for its work, which may itself be waiting for
+     * PCIe error recovery, so this is done before taking firmware_lock. */
+    down_write(&amc_priv->reload_sem);
+    revoke_handles(amc_priv);
+    mutex_lock(&amc_priv->firmware_lock);
+
+    /* Stop the hardware, but keep the old PROM until we know whether the
+     * device nodes need to change.  If the previous reload failed there is
+     * nothing left to stop.  The sampler is not restarted, as its registers
+     * may mean something else to the new firmware. */
+    stop_sampler(&amc_priv->sampler);
+    quiesce_interrupt_control(pdev, amc_priv->interrupts);
+    struct prom_context *old_prom = amc_priv->prom;
+    destroy_dma_caches(amc_priv);
+    if (amc_priv->dma)
+        terminate_dma_control(amc_priv->dma);
+    amc_priv->dma = NULL;
+
+    retrain_link(amc_priv);
+
+    int rc = initialise_firmware(pdev, amc_priv);
+    bool nodes_changed =
+        rc < 0  ||  !old_prom  ||  !same_prom(old_prom, amc_priv->prom);
+    if (old_prom)
+    {
+        if (nodes_changed)
+            destroy_device_nodes(amc_priv, device_class);
+        release_prom_context(old_prom);
+    }
+
+    /* Interrupts are only restarted once nothing can fail, as they are
+     * handed the new DMA controller. */
+    if (rc == 0  &&  nodes_changed)
+    {
+        rc = create_device_nodes(pdev, amc_priv, device_class);
+        if (rc < 0)
+            terminate_firmware(amc_priv);
+    }
+    if (rc == 0)
+        restart_interrupt_control(amc_priv->interrupts, amc_priv->dma);
+    else
+        printk(KERN_ERR CLASS_NAME ": Reload of board %d failed: %d\n",
+            amc_priv->board, rc);
+
+    mutex_unlock(&amc_priv->firmware_lock);
+    up_write(&amc_priv->reload_sem);
+    return rc;
+}
+
+
+static ssize_t reload_store(
+    struct device *dev, struct device_attribute *attr,
+    const char *buf, size_t count)
+{
+    bool reload;
+    int rc = kstrtobool(buf, &reload);
+    if (rc == 0  &&  reload)
+        rc = reload_board(pci_get_drvdata(to_pci_dev(dev)));
+    return rc < 0 ? rc : count;
+}
+
+static DEVICE_ATTR_WO(reload);
+
+
+/* Count of DMA transfers which have timed out since the DMA controller was last
+ * initialised. */
+static ssize_t dma_timeouts_show(
+    struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct amc_pci *amc_priv = pci_get_drvdata(to_pci_dev(dev));
+    mutex_lock(&amc_priv->firmware_lock);
+    unsigned long timeouts =
+        amc_priv->dma ? dma_get_timeouts(amc_priv->dma) : 0;
+    mutex_unlock(&amc_priv->firmware_lock);
+    return sysfs_emit(buf, "%lu\n", timeouts);
+}
+
+static DEVICE_ATTR_RO(dma_timeouts);
+
+
+/* Count of reads served by a DMA transfer made for another reader. */
+static ssize_t dma_merged_show(
+    struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct amc_pci *amc_priv = pci_get_drvdata(to_pci_dev(dev));
+    mutex_lock(&amc_priv->firmware_lock);
+    unsigned long merged = amc_priv->dma ? dma_get_merged(amc_priv->dma) : 0;
+    mutex_unlock(&amc_priv->firmware_lock);
+    return sysfs_emit(buf, "%lu\n", merged);
+}
+
+static DEVICE_ATTR_RO(dma_merged);
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* PCIe error recovery. */
+
+/* A PCIe error reported through AER stops the DMA controller and interrupts
+ * and pauses the register sampler.  Transfers in progress wait, still holding
+ * reload_sem, while the link is reset; the controller is then reset, the
+ * interrupted transfer replayed and the sampler resumed.  Nothing here waits
+ * for file operations, as they are waiting for us.  A non fatal error leaves
+ * the link working, and nothing is stopped. */
+
+
+static pci_ers_result_t amc_pci_error_detected(
+    struct pci_dev *pdev, pci_channel_state_t state)
+{
+    struct amc_pci *amc_priv = pci_get_drvdata(pdev);
+    bool failed = state == pci_channel_io_perm_failure;
+    dev_warn(&pdev->dev, "PCIe error detected (state %d)\n", state);
+    if (state == pci_channel_io_normal)
+        return PCI_ERS_RESULT_CAN_RECOVER;
+
+    mutex_lock(&amc_priv->firmware_lock);
+    /* The sampler only stops for good if the link is lost. */
+    if (failed)
+        stop_sampler(&amc_priv->sampler);
+    else
+        pause_sampler(&amc_priv->sampler);
+    quiesce_interrupt_control(pdev, amc_priv->interrupts);
+    if (amc_priv->dma)
+    {
+        if (failed)
+            dma_link_failed(amc_priv->dma);
+        else
+            dma_link_offline(amc_priv->dma);
+    }
+    mutex_unlock(&amc_priv->firmware_lock);
+
+    return failed ? PCI_ERS_RESULT_DISCONNECT : PCI_ERS_RESULT_NEED_RESET;
+}
+
+
+static pci_ers_result_t amc_pci_slot_reset(struct pci_dev *pdev)
+{
+    struct amc_pci *amc_priv = pci_get_drvdata(pdev);
+    int rc = 0;
+
+    mutex_lock(&amc_priv->firmware_lock);
+    restore_pci_state(amc_priv);
+    if (amc_priv->dma)
+    {
+        rc = dma_link_reset(amc_priv->dma);
+        if (rc < 0)
+            dma_link_failed(amc_priv->dma);
+    }
+    /* If the last reload failed there is no DMA controller, but interrupts are
+     * restarted anyway for user events. */
+    if (rc == 0)
+        restart_interrupt_control(amc_priv->interrupts, amc_priv->dma);
+    else
+        /* We won't be resumed, so let sampler readers see the end. */
+        stop_sampler(&amc_priv->sampler);
+    mutex_unlock(&amc_priv->firmware_lock);
+
+    if (rc < 0)
+        dev_err(&pdev->dev, "Unable to reset DMA after PCIe error\n");
+    return rc < 0 ? PCI_ERS_RESULT_DISCONNECT : PCI_ERS_RESULT_RECOVERED;
+}
+
+
+static void amc_pci_resume(struct pci_dev *pdev)
+{
+    struct amc_pci *amc_priv = pci_get_drvdata(pdev);
+    dev_info(&pdev->dev, "Recovered from PCIe error\n");
+
+    mutex_lock(&amc_priv->firmware_lock);
+    if (amc_priv->dma)
+        dma_link_resume(amc_priv->dma);
+    resume_sampler(&amc_priv->sampler);
+    mutex_unlock(&amc_priv->firmware_lock);
+}
+
+
+static const struct pci_error_handlers amc_pci_err_handler = {
+    .error_detected = amc_pci_error_detected,
+    .slot_reset = amc_pci_slot_reset,
+    .resume = amc_pci_resume,
+};
+
+
 /* Top level device probe method: called when AMC525 FPGA card with our firmware
  * detected. */
 static int amc_pci_probe(
@@ -458,12 +1001,11 @@ static int amc_pci_probe(
     printk(KERN_INFO "Detected AMC525\n");
     int rc = 0;
 
-    /* Ensure we can allocate a board number. */
-    unsigned int board;
-    rc = get_free_board(&board);
-    TEST_RC(rc, no_board, "Unable to allocate board number\n");
-    int major = MAJOR(device_major);
-    int minor = board * MAX_MINORS_PER_BOARD;
+    /* Ensure we can allocate a board number.  Minors are allocated once the
+     * PROM has been read. */
+    int board = allocate_board_number(pdev);
+    TEST_OK(board >= 0, rc = board, no_board,
+        "Unable to allocate board number");
 
     /* Allocate state for our board. */
     struct amc_pci *amc_priv = kmalloc(sizeof(struct amc_pci), GFP_KERNEL);
@@ -471,22 +1013,37 @@ static int amc_pci_probe(
     *amc_priv = (struct amc_pci) {
         .dev = pdev,
         .board = board,
-        .major = major,
-        .minor = minor,
+        .major = MAJOR(device_major),
     };
     pci_set_drvdata(pdev, amc_priv);
     mutex_init(&amc_priv->locking.mutex);
     atomic_set(&amc_priv->refcount, 1);
     init_completion(&amc_priv->completion);
+    init_rwsem(&amc_priv->reload_sem);
+    mutex_init(&amc_priv->handles_lock);
+    INIT_LIST_HEAD(&amc_priv->handles);
+    mutex_init(&amc_priv->firmware_lock);
+    xa_init(&amc_priv->caches);
 
     rc = enable_board(pdev);
     if (rc < 0)     goto no_enable;
 
+    /* Saved so that the configuration can be restored after a reload. */
+    pci_save_state(pdev);
+    amc_priv->pci_state = pci_store_saved_state(pdev);
+    TEST_PTR(amc_priv->pci_state, rc, no_state, "Unable to save PCI state");
+
     rc = initialise_board(pdev, amc_priv);
     if (rc < 0)     goto no_initialise;
 
+    rc = reserve_board_minors(amc_priv);
+    if (rc < 0)     goto no_minors;
+
+    rc = add_board_cdev(amc_priv);
+    TEST_RC(rc, no_cdev, "Unable to add device");
+
     rc = create_device_nodes(pdev, amc_priv, device_class);
-    if (rc < 0)     goto no_cdev;
+    if (rc < 0)     goto no_nodes;
 
     rc = sysfs_create_bin_file(&pdev->dev.kobj, &bin_attr_prom_used);
     if (rc < 0) goto sysfs_error;
@@ -494,18 +1051,41 @@ static int amc_pci_probe(
     rc = sysfs_create_bin_file(&pdev->dev.kobj, &bin_attr_prom);
     if (rc < 0) goto sysfs_error;
 
+    rc = device_create_file(&pdev->dev, &dev_attr_reload);
+    if (rc < 0) goto sysfs_error;
+
+    rc = device_create_file(&pdev->dev, &dev_attr_dma_timeouts);
+    if (rc < 0) goto sysfs_error;
+
+    rc = device_create_file(&pdev->dev, &dev_attr_dma_merged);
+    if (rc < 0) goto sysfs_error;
+
+    /* Failure to create debugfs entries is not an error. */
+    amc_priv->debugfs_dir = debugfs_create_dir(pci_name(pdev), debugfs_root);
+    interrupt_stats_debugfs(amc_priv->interrupts, amc_priv->debugfs_dir);
+
     return 0;
 
-    destroy_device_nodes(amc_priv, device_class);
 sysfs_error:
+    device_remove_file(&pdev->dev, &dev_attr_dma_timeouts);
+    device_remove_file(&pdev->dev, &dev_attr_reload);
+    sysfs_remove_bin_file(&pdev->dev.kobj, &bin_attr_prom_used);
+    sysfs_remove_bin_file(&pdev->dev.kobj, &bin_attr_prom);
+    destroy_device_nodes(amc_priv, device_class);
+no_nodes:
+    cdev_del(&amc_priv->cdev);
 no_cdev:
+    release_minors(amc_priv->minor, amc_priv->nminors);
+no_minors:
     terminate_board(pdev);
 no_initialise:
+    kfree(amc_priv->pci_state);
+no_state:
     disable_board(pdev);
 no_enable:
     kfree(amc_priv);
 no_memory:
-    release_board(board);
+    ida_free(&board_ida, board);
 no_board:
     return rc;
 }
@@ -526,14 +1106,28 @@ static void amc_pci_remove(struct pci_dev *pdev)
     printk(KERN_INFO "Removing AMC525 device\n");
     struct amc_pci *amc_priv = pci_get_drvdata(pdev);
 
+    /* Removing the reload attribute waits for any reload in progress. */
+    device_remove_file(&pdev->dev, &dev_attr_reload);
+    device_remove_file(&pdev->dev, &dev_attr_dma_merged);
+    device_remove_file(&pdev->dev, &dev_attr_dma_timeouts);
+    debugfs_remove_recursive(amc_priv->debugfs_dir);
+    sysfs_remove_bin_file(&pdev->dev.kobj, &bin_attr_prom_used);
+    sysfs_remove_bin_file(&pdev->dev.kobj, &bin_attr_prom);
     destroy_device_nodes(amc_priv, device_class);
+    cdev_del(&amc_priv->cdev);
+
+    /* Revoke open handles so that their users see that the board has gone,
+     * but we still have to wait for them to be closed. */
+    down_write(&amc_priv->reload_sem);
+    revoke_handles(amc_priv);
+    up_write(&amc_priv->reload_sem);
     wait_for_clients(amc_priv);
 
     terminate_board(pdev);
+    kfree(amc_priv->pci_state);
     disable_board(pdev);
-    release_board(amc_priv->board);
-    sysfs_remove_bin_file(&pdev->dev.kobj, &bin_attr_prom_used);
-    sysfs_remove_bin_file(&pdev->dev.kobj, &bin_attr_prom);
+    release_minors(amc_priv->minor, amc_priv->nminors);
+    ida_free(&board_ida, amc_priv->board);
 
     kfree(amc_priv);
 }
@@ -551,6 +1145,10 @@ static struct pci_driver amc_pci_driver = {
     .id_table = amc_pci_ids,
     .probe = amc_pci_probe,
     .remove = amc_pci_remove,
+    .err_handler = &amc_pci_err_handler,
+    /* Each card is probed independently, so a crate full of cards can be
+     * brought up in parallel. */
+    .driver.probe_type = PROBE_PREFER_ASYNCHRONOUS,
 };
 
 
@@ -575,12 +1173,15 @@ static int __init amc_pci_init(void)
 #endif
     TEST_PTR(device_class, rc, no_class, "Unable to create class");
 
+    debugfs_root = debugfs_create_dir(CLASS_NAME, NULL);
+
     rc = pci_register_driver(&amc_pci_driver);
     TEST_RC(rc, no_driver, "Unable to register driver\n");
     printk(KERN_INFO "Registered AMC525 driver\n");
     return rc;
 
 no_driver:
+    debugfs_remove_recursive(debugfs_root);
     class_destroy(device_class);
 no_class:
     unregister_chrdev_region(device_major, MAX_MINORS);
@@ -593,6 +1194,7 @@ static void __exit amc_pci_exit(void)
 {
     printk(KERN_INFO "Unloading AMC525 module\n");
     pci_unregister_driver(&amc_pci_driver);
+    debugfs_remove_recursive(debugfs_root);
     class_destroy(device_class);
     unregister_chrdev_region(device_major, MAX_MINORS);
 }
@@ -1,4 +1,38 @@
 /* Shared common operations. */
 
+struct amc_pci;
+
 /* This must be called whenever any file handle is released. */
 void amc_pci_release(struct inode *inode);
+
+
+/* Every open file handle is registered with its board so that it can be
+ * revoked when the FPGA is reloaded.  Once revoked all operations other than
+ * release fail with -ENODEV. */
+struct amc_pci_handle {
+    struct list_head list;
+    struct amc_pci *amc_priv;
+    struct file *file;
+    bool revoked;
+    /* Called during reload, when no file operations are in progress, to stop
+     * all activity tied to the hardware and wake any waiting readers. */
+    void (*revoke)(struct amc_pci_handle *handle);
+};
+
+void amc_pci_add_handle(
+    struct file *file, struct amc_pci_handle *handle,
+    void (*revoke)(struct amc_pci_handle *handle));
+void amc_pci_remove_handle(struct amc_pci_handle *handle);
+
+/* File operations which touch the hardware must be bracketed by these calls,
+ * which hold off any reload until the operation is complete.  If the handle
+ * has been revoked -ENODEV is returned and amc_pci_leave() must not be
+ * called. */
+int amc_pci_enter(struct amc_pci_handle *handle);
+/* Page faults can happen inside file operations, and so must not wait for a
+ * reload.  This fails with -EAGAIN if a reload is pending. */
+int amc_pci_try_enter(struct amc_pci_handle *handle);
+void amc_pci_leave(struct amc_pci_handle *handle);
+
+/* Operations which only wait for data use this check instead. */
+bool amc_pci_revoked(struct amc_pci_handle *handle);
@@ -1,8 +1,10 @@
 /* Header file for use from userspace. */
 
-/* Although our ioctls don't transfer any data, use the direction hint anyway:
- * this helps valgrind which otherwise complains about missing size hints, and
- * it doesn't seem to mind the zero size code. */
+#include <linux/types.h>
+
+/* Although the simple ioctls don't transfer any data, use the direction hint
+ * anyway: this helps valgrind which otherwise complains about missing size
+ * hints, and it doesn't seem to mind the zero size code. */
 #define AMC_IOCTL(n)        _IOC(_IOC_WRITE, 'L', n, 0)
 
 /* Returns size of register area as unsigned 32-bit integer. */
@@ -17,3 +19,204 @@
 
 /* Returns total size of DMA area. */
 #define AMC_DMA_AREA_SIZE   AMC_IOCTL(4)
+
+/* Exports a copy of the selected region of a DMA area as a dma-buf, returning
+ * the new file descriptor.  Both offset and length must be aligned to the DMA
+ * alignment.  Only O_CLOEXEC is recognised in flags. */
+struct amc_dma_export {
+    __u64 offset;                   // Offset into DMA area
+    __u64 length;                   // Number of bytes to export
+    __u32 flags;                    // Flags for returned file descriptor
+    __u32 reserved;                 // Must be zero
+};
+#define AMC_DMA_EXPORT      _IOW('L', 5, struct amc_dma_export)
+
+/* Selects how DMA completion is detected for transfers made through this file
+ * handle.  By default transfers of up to the dma_poll_threshold module
+ * parameter busy poll the DMA engine, falling back to the completion interrupt
+ * if the transfer takes too long. */
+#define AMC_DMA_COMPLETION  AMC_IOCTL(6)
+
+#define AMC_COMPLETION_AUTO         0   // Poll small transfers only
+#define AMC_COMPLETION_INTERRUPT    1   // Always wait for interrupt
+#define AMC_COMPLETION_POLL         2   // Always start by polling
+
+/* Switches a DMA file handle into streaming mode.  This is only available for
+ * areas which the PROM marks as circular buffers.  From then on read() returns
+ * a continuous stream of data following the FPGA write pointer, poll() reports
+ * when data is available, and if data is lost read() fails once with
+ * EOVERFLOW before the stream continues. */
+#define AMC_DMA_STREAM      AMC_IOCTL(7)
+
+/* Arms a one-shot capture of a region of a DMA area, to be started from the
+ * interrupt handler as soon as the given event bit (as returned by reading the
+ * register device) is seen.  The region is captured into kernel memory, so
+ * its length is limited by the capture_max_mb module parameter.  Any previous
+ * capture is discarded. */
+struct amc_capture_arm {
+    __u64 offset;                   // Offset into DMA area
+    __u64 length;                   // Number of bytes to capture
+    __u32 event;                    // Event bit number triggering capture
+    __u32 reserved;                 // Must be zero
+};
+#define AMC_CAPTURE_ARM     _IOW('L', 8, struct amc_capture_arm)
+
+/* Waits for an armed capture to complete and collects the captured data and
+ * the CLOCK_MONOTONIC time of the triggering interrupt.  Returns the number of
+ * bytes copied, or fails with ECANCELED if the capture is discarded by a new
+ * AMC_CAPTURE_ARM while waiting. */
+struct amc_capture_read {
+    __u64 data;                     // User buffer for captured data
+    __u64 length;                   // Length of user buffer
+    __u64 timestamp;                // Returned trigger time in ns
+};
+#define AMC_CAPTURE_READ    _IOWR('L', 9, struct amc_capture_read)
+
+/* Reads a list of regions of a DMA area in a single call.  Regions which lie
+ * close together are combined into a single DMA transfer.  Returns the total
+ * number of bytes read. */
+struct amc_dma_region {
+    __u64 offset;                   // Offset into DMA area
+    __u64 length;                   // Number of bytes to read
+    __u64 data;                     // User buffer for this region
+};
+struct amc_dma_gather {
+    __u64 regions;                  // Array of struct amc_dma_region
+    __u32 count;                    // Number of regions
+    __u32 reserved;                 // Must be zero
+};
+#define AMC_DMA_GATHER      _IOW('L', 10, struct amc_dma_gather)
+
+/* Enables (argument non zero) or disables computation of the CRC32C checksum
+ * of the data returned by each read of a DMA device.  The checksum is computed
+ * as the data is copied to user space.  AMC_DMA_LAST_CHECKSUM writes the
+ * checksum of the last complete read to its argument, as the checksum doesn't
+ * fit in the return value. */
+#define AMC_DMA_CHECKSUM        AMC_IOCTL(11)
+#define AMC_DMA_LAST_CHECKSUM   _IOR('L', 12, __u32)
+
+/* Selects the priority class for DMA through this file handle.  When the DMA
+ * engine is shared it goes to the highest class first, and transfers in the
+ * bulk class are broken into small pieces so that other users can interleave.
+ * The default is AMC_PRIORITY_RT if the opening task has a real time
+ * scheduling policy, otherwise AMC_PRIORITY_NORMAL.  Selecting AMC_PRIORITY_RT
+ * requires a real time task or CAP_SYS_NICE.  Streams and captures use the
+ * class in effect when they are started. */
+#define AMC_DMA_PRIORITY    AMC_IOCTL(13)
+
+#define AMC_PRIORITY_RT             0   // Latency critical access
+#define AMC_PRIORITY_NORMAL         1   // Default access
+#define AMC_PRIORITY_BULK           2   // Large background transfers
+
+/* Areas which the PROM marks as cacheable are read once into kernel memory and
+ * then served from there.  Writes through the device invalidate the cache, but
+ * if the FPGA changes the memory itself this must be called to discard the
+ * cached contents.  Fails with EINVAL if the area is not cacheable. */
+#define AMC_DMA_CACHE_INVALIDATE    AMC_IOCTL(14)
+
+/* Returns the times recorded by the last read() of events through this
+ * register device handle: the CLOCK_MONOTONIC time of entry to the interrupt
+ * handler which delivered the first of the events read, and the time at which
+ * the reader was woken.  The interrupt time is zero if it is not known, which
+ * happens when an event arrives while an earlier one is being read. */
+struct amc_event_times {
+    __u64 interrupt;                // Interrupt handler entry time in ns
+    __u64 wakeup;                   // Reader wakeup time in ns
+    __u32 events;                   // Events returned by the read
+    __u32 reserved;                 // Always zero
+};
+#define AMC_EVENT_TIMES     _IOR('L', 15, struct amc_event_times)
+
+/* Delivers the events in the argument mask to all readers and triggers as if
+ * they had been raised by the FPGA, for testing without hardware.  Requires
+ * CAP_SYS_ADMIN. */
+#define AMC_EVENT_INJECT    AMC_IOCTL(16)
+
+/* A DMA area can be mapped read only with mmap().  Pages are read from FPGA
+ * memory on first access, together with the rest of the block of
+ * 2^dma_map_block_shift bytes containing them, and are then kept until the
+ * file is closed.  Once the blocks read through one file handle exceed the
+ * dma_map_max_mb module parameter the oldest are discarded to make room.  This
+ * discards the pages covering the given range of the area from the mappings
+ * made through this file handle, so that the next access reads FPGA memory
+ * again.  Writes through the same handle do this automatically. */
+struct amc_dma_range {
+    __u64 offset;                   // Offset into DMA area
+    __u64 length;                   // Number of bytes to invalidate
+};
+#define AMC_DMA_MAP_INVALIDATE  _IOW('L', 17, struct amc_dma_range)
+
+/* A register sampler reads a list of BAR0 registers at a fixed period into a
+ * ring of timestamped entries, so that many monitoring clients can share one
+ * set of register reads.  Each board has at most one sampler, replaced by each
+ * AMC_SAMPLER_CONFIG on the register device, which requires CAP_SYS_ADMIN; a
+ * count of zero just stops it.  If change_event is not -1 the event with this
+ * number is delivered to all readers whenever a register value changes under
+ * its change_mask.  The sampler is stopped by FPGA reload. */
+struct amc_sampler_register {
+    __u32 offset;                   // Byte offset into BAR0, 4 byte aligned
+    __u32 change_mask;              // Bits which raise change_event
+};
+struct amc_sampler_config {
+    __u64 registers;                // Pointer to array of count registers
+    __u32 count;                    // Number of registers, at most 64
+    __u32 period_us;                // Sampling period, at least 100us
+    __u32 entries;                  // Number of entries in the ring
+    __s32 change_event;             // Event number 0 to 30, or -1 for none
+};
+#define AMC_SAMPLER_CONFIG  _IOW('L', 18, struct amc_sampler_config)
+
+/* Returns a new file descriptor for the current sampler, with the argument
+ * giving file flags, of which only O_CLOEXEC and O_NONBLOCK are used.  Each
+ * read() returns whole entries written since the last read through this
+ * descriptor, or since it was opened, failing once with EOVERFLOW if entries
+ * were overwritten before they could be read, and returns end of file once the
+ * sampler has stopped.  The ring can also be mapped read only with mmap(): it
+ * starts with the header below and entry n is at
+ * data_offset + (n % entries) * entry_size.  Each entry is a CLOCK_MONOTONIC
+ * time in ns followed by count 32-bit register values.  The sequence counts
+ * entries written and is updated after each entry is complete, so should be
+ * read with acquire ordering; an entry copied out of the mapping is only valid
+ * if the sequence is still less than n + entries after the copy. */
+struct amc_sampler_header {
+    __u64 sequence;                 // Number of entries written
+    __u32 count;                    // Number of registers in each entry
+    __u32 entry_size;               // Bytes in each entry
+    __u32 entries;                  // Number of entries in the ring
+    __u32 data_offset;              // Offset of first entry from header
+};
+#define AMC_SAMPLER_OPEN    AMC_IOCTL(19)
+
+/* Reads a range of BAR0 registers with the DMA engine into the user buffer
+ * given in the data field, with offset giving the byte offset into BAR0.  This
+ * is far faster than reading a large register bank word by word, but is only
+ * available when the PROM gives the address of the registers as seen by the
+ * DMA engine, and otherwise fails with EINVAL.  Both offset and length must be
+ * multiples of the DMA alignment, 32 bytes by default, so that no register
+ * outside the range is read.  Returns the number of bytes read. */
+#define AMC_REG_DMA_READ    _IOW('L', 20, struct amc_dma_region)
+
+/* Captures regions of DMA areas on several boards as nearly simultaneously as
+ * possible.  Each member names a DMA device file descriptor open for reading,
+ * which may be on any board, and a region of its area which must be aligned to
+ * the DMA alignment and fit into a single transfer.  This is the DMA buffer
+ * size, or less if every member on that board has bulk priority.  The DMA
+ * engines of all the boards are taken first, then one transfer per board is
+ * started back to back, and the call returns once every region has been
+ * copied to its buffer, with the CLOCK_MONOTONIC time at which each transfer
+ * was started written to its timestamp.  Further regions on the same board
+ * are captured in later rounds.  May be called through any DMA device. */
+struct amc_capture_member {
+    __s32 fd;                       // DMA device file descriptor
+    __u32 reserved;                 // Must be zero
+    __u64 offset;                   // Offset into DMA area
+    __u64 length;                   // Number of bytes to capture
+    __u64 data;                     // User buffer for captured data
+    __u64 timestamp;                // Returned transfer start time in ns
+};
+struct amc_capture_group {
+    __u64 members;                  // Array of struct amc_capture_member
+    __u32 count;                    // Number of members
+    __u32 reserved;                 // Must be zero
+};
+#define AMC_CAPTURE_GROUP   _IOW('L', 21, struct amc_capture_group)
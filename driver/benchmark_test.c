@@ -0,0 +1,264 @@
+/* Microbenchmarks of the driver hot paths.
+ *
+ * Each benchmark runs its operation in several rounds and reports the cycles
+ * and time per operation of the fastest round, so that a regression in the
+ * overhead per event or per transfer shows up in the test log.  The hardware
+ * is replaced by a fake register block. */
+
+#include <kunit/test.h>
+#include <linux/version.h>
+#include <linux/pci.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/timex.h>
+#include <linux/random.h>
+#include <linux/math64.h>
+
+#include "prom_processing.h"
+#include "utils.h"
+#include "dma_control.h"
+#include "interrupts.h"
+#include "test_assets/fake_cdma.c"
+
+
+#define BENCH_ROUNDS        5
+
+/* Number of DMA areas in the PROM used to benchmark entry lookup. */
+#define BENCH_DMA_AREAS     32
+
+
+struct bench_timer {
+    struct kunit *test;
+    unsigned int iterations;
+    unsigned int round;
+    cycles_t best_cycles;
+    u64 best_ns;
+    cycles_t start_cycles;
+    u64 start_ns;
+};
+
+
+static void bench_init(
+    struct bench_timer *timer, struct kunit *test, unsigned int iterations)
+{
+    *timer = (struct bench_timer) {
+        .test = test,
+        .iterations = iterations,
+        .best_cycles = ~(cycles_t) 0,
+        .best_ns = U64_MAX,
+    };
+}
+
+
+/* Use as
+ *      for (bench_init(...); bench_round(...); )
+ *          for (i = 0; i < iterations; i ++) ...
+ * to run BENCH_ROUNDS timed rounds. */
+static bool bench_round(struct bench_timer *timer)
+{
+    cycles_t cycles = get_cycles();
+    u64 ns = ktime_get_ns();
+    if (timer->round > 0)
+    {
+        timer->best_cycles = min(timer->best_cycles,
+            cycles - timer->start_cycles);
+        timer->best_ns = min(timer->best_ns, ns - timer->start_ns);
+        cond_resched();
+    }
+    if (timer->round++ >= BENCH_ROUNDS)
+        return false;
+
+    timer->start_cycles = get_cycles();
+    timer->start_ns = ktime_get_ns();
+    return true;
+}
+
+
+static void bench_report(struct bench_timer *timer, const char *name)
+{
+    kunit_info(timer->test, "%s: %llu cycles, %llu ns per operation\n",
+        name,
+        div_u64((u64) timer->best_cycles, timer->iterations),
+        div_u64(timer->best_ns, timer->iterations));
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* PROM processing. */
+
+
+static void bench_calc_checksum16(struct kunit *test)
+{
+    char *buffer = kunit_kmalloc(test, PROM_MAX_LENGTH, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, buffer);
+    get_random_bytes(buffer, PROM_MAX_LENGTH);
+
+    struct bench_timer timer;
+    u16 expected = calc_checksum16(buffer, PROM_MAX_LENGTH);
+    unsigned int errors = 0;
+    for (bench_init(&timer, test, 1000); bench_round(&timer); )
+        for (unsigned int i = 0; i < timer.iterations; i ++)
+            errors += calc_checksum16(buffer, PROM_MAX_LENGTH) != expected;
+    KUNIT_EXPECT_EQ(test, 0u, errors);
+    bench_report(&timer, "calc_checksum16 of full PROM");
+}
+
+
+/* Appends an entry with the given tag and body to the PROM at *offset. */
+static void add_prom_entry(
+    u8 *prom, size_t *offset, u8 tag, const void *body, u8 size)
+{
+    prom[(*offset)++] = tag;
+    prom[(*offset)++] = size;
+    memcpy(prom + *offset, body, size);
+    *offset += size;
+}
+
+
+/* Builds a PROM with a device entry followed by BENCH_DMA_AREAS DMA areas. */
+static void build_prom(u8 *prom)
+{
+    memcpy(prom, "DIAG\x01", 5);
+    size_t offset = 5;
+    add_prom_entry(prom, &offset, PROM_DEVICE_TAG, "bench", 6);
+    for (int i = 0; i < BENCH_DMA_AREAS; i ++)
+    {
+        struct __attribute__((packed)) {
+            u16 base[3];
+            u32 length;
+            u8 perm;
+            char name[8];
+        } dma = {
+            .base = { 0, (u16) i, 0 },
+            .length = 0x10000,
+            .perm = PROM_DMA_PERM_READ,
+        };
+        snprintf(dma.name, sizeof(dma.name), "mem%d", i);
+        add_prom_entry(prom, &offset, PROM_DMA_TAG, &dma,
+            offsetof(typeof(dma), name) + strlen(dma.name) + 1);
+    }
+
+    /* The checksum must be word aligned, so the end marker may be padded. */
+    prom[offset++] = PROM_END_TAG;
+    bool pad = offset % 2 == 0;
+    prom[offset++] = pad ? 3 : 2;
+    if (pad)
+        prom[offset++] = 0;
+    prom[offset] = prom[offset + 1] = 0;
+    u16 checksum = calc_checksum16((char *) prom, offset + 2);
+    memcpy(prom + offset, &checksum, 2);
+}
+
+
+static void bench_prom_find_entry_with_minor(struct kunit *test)
+{
+    u8 *prom = kunit_kzalloc(test, PROM_MAX_LENGTH, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, prom);
+    build_prom(prom);
+    struct prom_context *context = load_prom((void __force __iomem *) prom);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, context);
+
+    /* Looking up the last area is the worst case when opening a device. */
+    struct bench_timer timer;
+    unsigned int misses = 0;
+    for (bench_init(&timer, test, 10000); bench_round(&timer); )
+        for (unsigned int i = 0; i < timer.iterations; i ++)
+            misses += !prom_find_entry_with_minor(context, BENCH_DMA_AREAS);
+    KUNIT_EXPECT_EQ(test, 0u, misses);
+    bench_report(&timer, "prom_find_entry_with_minor of last area");
+
+    release_prom_context(context);
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Interrupt events. */
+
+
+/* Delivers a single event to a varying number of readers, each of which then
+ * collects it, as happens for each event raised by the FPGA. */
+static void bench_event_fan_out(struct kunit *test)
+{
+    for (int readers = 1; readers <= N_EVENT_READERS; readers *= 2)
+    {
+        struct interrupt_control *control =
+            create_interrupt_control(NULL, NULL);
+        KUNIT_ASSERT_NOT_ERR_OR_NULL(test, control);
+        int reader_numbers[N_EVENT_READERS];
+        for (int r = 0; r < readers; r ++)
+            KUNIT_ASSERT_TRUE(test,
+                assign_reader_number(control, &reader_numbers[r]));
+
+        struct bench_timer timer;
+        unsigned int missed = 0;
+        for (bench_init(&timer, test, 10000); bench_round(&timer); )
+            for (unsigned int i = 0; i < timer.iterations; i ++)
+            {
+                inject_interrupt_events(control, 1);
+                for (int r = 0; r < readers; r ++)
+                {
+                    uint32_t events;
+                    read_interrupt_events(
+                        control, true, &events, reader_numbers[r]);
+                    missed += events != 1;
+                }
+            }
+        KUNIT_EXPECT_EQ(test, 0u, missed);
+
+        char name[40];
+        snprintf(name, sizeof(name), "event fan out to %d readers", readers);
+        bench_report(&timer, name);
+
+        for (int r = 0; r < readers; r ++)
+            unassign_reader_number(control, reader_numbers[r]);
+        destroy_interrupt_control(control);
+    }
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* DMA transfers. */
+
+
+/* Each transfer takes the DMA lock, reads a block into the DMA buffer by
+ * polling for completion, and releases the lock, as a small read() does. */
+static void bench_dma_transfer(struct kunit *test)
+{
+    struct dma_control *dma = create_fake_dma(test);
+    if (!dma)
+        return;
+
+    struct bench_timer timer;
+    unsigned int errors = 0;
+    for (bench_init(&timer, test, 10000); bench_round(&timer); )
+        for (unsigned int i = 0; i < timer.iterations; i ++)
+        {
+            if (dma_memory_lock(dma, DMA_PRIORITY_NORMAL) < 0)
+                break;
+            errors += dma_operation_unlocked(
+                dma, 0, PAGE_SIZE, DMA_FROM_DEVICE) != PAGE_SIZE;
+            dma_memory_unlock(dma);
+        }
+    KUNIT_EXPECT_EQ(test, 0u, errors);
+    bench_report(&timer, "DMA transfer of one page");
+
+    destroy_fake_dma(dma);
+}
+
+
+static struct kunit_case benchmark_test_cases[] = {
+    KUNIT_CASE(bench_calc_checksum16),
+    KUNIT_CASE(bench_prom_find_entry_with_minor),
+    KUNIT_CASE(bench_event_fan_out),
+    KUNIT_CASE(bench_dma_transfer),
+    {}
+};
+
+
+static struct kunit_suite benchmark_test_suite = {
+    .name = "amc_pci_benchmark",
+    .test_cases = benchmark_test_cases,
+};
+
+
+kunit_test_suite(benchmark_test_suite);
@@ -0,0 +1,215 @@
+/* Event triggered capture of FPGA memory.
+ *
+ * When a trigger event is seen the interrupt handler records the time and
+ * immediately queues a high priority work item to DMA the selected region into
+ * a preallocated kernel buffer.  The DMA itself can't be run from the interrupt
+ * handler as the DMA engine is shared under a mutex, but this still removes
+ * the user space wakeup and system call from the capture path. */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/uaccess.h>
+#include <linux/fs.h>
+#include <linux/pci.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/kref.h>
+
+#include "error.h"
+#include "dma_control.h"
+#include "interrupts.h"
+
+#include "capture.h"
+
+
+/* Limit on the size of a single capture, which is held in kernel memory. */
+static unsigned int capture_max_mb = 16;
+module_param(capture_max_mb, uint, S_IRUGO | S_IWUSR);
+
+
+enum capture_state {
+    CAPTURE_ARMED,                  // Waiting for trigger event
+    CAPTURE_TRIGGERED,              // DMA queued or in progress
+    CAPTURE_DONE,                   // Data ready to be collected
+};
+
+
+struct event_capture {
+    struct kref kref;               // Held by owner and by each reader
+    struct event_trigger trigger;
+    struct dma_control *dma;
+    struct interrupt_control *interrupts;
+    size_t start;                   // Region of FPGA memory to capture
+    size_t length;
+    enum dma_priority priority;     // Scheduling class for the capture DMA
+    void *buffer;                   // Captured data
+
+    atomic_t state;
+    ktime_t timestamp;              // Time of trigger interrupt
+    int result;                     // Result of capture DMA
+    struct work_struct work;
+    wait_queue_head_t wait_queue;
+};
+
+
+static void capture_work(struct work_struct *work)
+{
+    struct event_capture *capture =
+        container_of(work, struct event_capture, work);
+    void *dma_buffer = dma_get_buffer(capture->dma);
+    int rc = dma_memory_lock(capture->dma, capture->priority);
+    if (rc < 0)
+        goto no_lock;
+    for (size_t done = 0; done < capture->length; )
+    {
+        ssize_t count = dma_operation_unlocked(
+            capture->dma, capture->start + done, capture->length - done,
+            DMA_FROM_DEVICE);
+        if (count <= 0)
+        {
+            rc = count ?: -EIO;
+            break;
+        }
+        memcpy(capture->buffer + done, dma_buffer, count);
+        done += count;
+        rc = dma_memory_yield(capture->dma);
+        if (rc < 0)
+            goto no_lock;
+    }
+    dma_memory_unlock(capture->dma);
+
+no_lock:
+    capture->result = rc;
+    atomic_set(&capture->state, CAPTURE_DONE);
+    wake_up_interruptible(&capture->wait_queue);
+}
+
+
+/* Called in interrupt context. */
+static void capture_fire(
+    struct event_trigger *trigger, uint32_t events, ktime_t timestamp)
+{
+    struct event_capture *capture =
+        container_of(trigger, struct event_capture, trigger);
+    if (atomic_cmpxchg(&capture->state, CAPTURE_ARMED, CAPTURE_TRIGGERED) ==
+            CAPTURE_ARMED)
+    {
+        capture->timestamp = timestamp;
+        queue_work(system_highpri_wq, &capture->work);
+    }
+}
+
+
+struct event_capture *arm_event_capture(
+    struct dma_control *dma, struct interrupt_control *interrupts,
+    size_t start, size_t length, unsigned int event,
+    enum dma_priority priority)
+{
+    size_t alignment = dma_get_alignment(dma);
+    if (length == 0  ||  length > (size_t) capture_max_mb << 20  ||
+        event >= 31  ||
+        !IS_ALIGNED(start, alignment)  ||  !IS_ALIGNED(length, alignment))
+        return ERR_PTR(-EINVAL);
+
+    int rc = 0;
+
+    struct event_capture *capture =
+        kzalloc(sizeof(struct event_capture), GFP_KERNEL);
+    TEST_PTR(capture, rc, no_capture, "Unable to allocate capture");
+    capture->buffer = kvmalloc(length, GFP_KERNEL);
+    TEST_PTR(capture->buffer, rc, no_buffer, "Unable to allocate capture");
+
+    kref_init(&capture->kref);
+    capture->trigger.mask = 1U << event;
+    capture->trigger.fire = capture_fire;
+    capture->dma = dma;
+    capture->interrupts = interrupts;
+    capture->start = start;
+    capture->length = length;
+    capture->priority = priority;
+    atomic_set(&capture->state, CAPTURE_ARMED);
+    INIT_WORK(&capture->work, capture_work);
+    init_waitqueue_head(&capture->wait_queue);
+
+    add_event_trigger(interrupts, &capture->trigger);
+    return capture;
+
+no_buffer:
+    kfree(capture);
+no_capture:
+    return ERR_PTR(rc);
+}
+
+
+/* Disarms the capture and completes it with the given error if it hasn't
+ * already completed. */
+static void stop_capture(struct event_capture *capture, int result)
+{
+    remove_event_trigger(capture->interrupts, &capture->trigger);
+    cancel_work_sync(&capture->work);
+    if (atomic_read(&capture->state) != CAPTURE_DONE)
+    {
+        capture->result = result;
+        atomic_set(&capture->state, CAPTURE_DONE);
+        wake_up_interruptible(&capture->wait_queue);
+    }
+}
+
+
+static void free_capture(struct kref *kref)
+{
+    struct event_capture *capture =
+        container_of(kref, struct event_capture, kref);
+    kvfree(capture->buffer);
+    kfree(capture);
+}
+
+
+void revoke_event_capture(struct event_capture *capture)
+{
+    stop_capture(capture, -ENODEV);
+}
+
+
+void release_event_capture(struct event_capture *capture)
+{
+    stop_capture(capture, -ECANCELED);
+    kref_put(&capture->kref, free_capture);
+}
+
+
+void get_event_capture(struct event_capture *capture)
+{
+    kref_get(&capture->kref);
+}
+
+
+void put_event_capture(struct event_capture *capture)
+{
+    kref_put(&capture->kref, free_capture);
+}
+
+
+ssize_t read_event_capture(
+    struct event_capture *capture, char __user *buf, size_t count,
+    u64 *timestamp, bool no_wait)
+{
+    bool done = atomic_read(&capture->state) == CAPTURE_DONE;
+    if (no_wait  &&  !done)
+        return -EAGAIN;
+    ssize_t rc = wait_event_interruptible(capture->wait_queue,
+        atomic_read(&capture->state) == CAPTURE_DONE);
+    if (rc < 0)
+        return rc;
+
+    *timestamp = ktime_to_ns(capture->timestamp);
+    if (capture->result < 0)
+        return capture->result;
+    count = min(count, capture->length);
+    if (copy_to_user(buf, capture->buffer, count))
+        return -EFAULT;
+    return count;
+}
@@ -0,0 +1,39 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+/* Event triggered capture of FPGA memory. */
+
+struct dma_control;
+struct interrupt_control;
+struct event_capture;
+
+/* Arms a one-shot capture of length bytes of FPGA memory from start into a
+ * kernel buffer, to be triggered by the given user event bit.  The capture is
+ * made at the given DMA priority. */
+struct event_capture *arm_event_capture(
+    struct dma_control *dma, struct interrupt_control *interrupts,
+    size_t start, size_t length, unsigned int event,
+    enum dma_priority priority);
+
+/* Disarms the capture and stops any DMA in progress, called when the board is
+ * about to be reloaded.  Any reader not yet satisfied sees -ENODEV. */
+void revoke_event_capture(struct event_capture *capture);
+
+/* Disarms the capture if necessary and drops the owner's reference.  Readers
+ * still waiting see -ECANCELED, and the capture is freed once the last of them
+ * has finished. */
+void release_event_capture(struct event_capture *capture);
+
+/* A reader holds a reference for the duration of read_event_capture(), as the
+ * owner may replace the capture at any time. */
+void get_event_capture(struct event_capture *capture);
+void put_event_capture(struct event_capture *capture);
+
+/* Waits for the capture to complete and copies the captured data to user space.
+ * The interrupt timestamp in CLOCK_MONOTONIC nanoseconds is returned through
+ * timestamp, and on success the number of bytes copied is returned. */
+ssize_t read_event_capture(
+    struct event_capture *capture, char __user *buf, size_t count,
+    u64 *timestamp, bool no_wait);
+
+#endif
@@ -0,0 +1,215 @@
+/* Simultaneous capture of FPGA memory across several boards.
+ *
+ * Reading each board in turn leaves a large and variable skew between the
+ * snapshots, as each read waits for its own DMA engine and then copies to user
+ * space.  Here every board in the group is first prepared by holding off reload
+ * and taking its DMA engine, after which one transfer per board is started in
+ * quick succession and only then are they all waited for.  Boards with more
+ * than one region are captured in further such rounds.
+ *
+ * To avoid deadlock between groups sharing boards, boards are always entered
+ * and their DMA engines taken in the same order, and each board is entered
+ * only once whatever number of its handles are in the group. */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/fs.h>
+#include <linux/pci.h>
+#include <linux/sort.h>
+#include <linux/ktime.h>
+
+#include "error.h"
+#include "amc_pci_core.h"
+#include "dma_control.h"
+
+#include "capture_group.h"
+
+
+/* The members of the group on a single board. */
+struct capture_board {
+    struct capture_member **members;
+    unsigned int count;
+    struct dma_control *dma;
+    enum dma_priority priority;     // Highest priority of its members
+    bool busy;                      // Transfer started in this round
+};
+
+
+/* Orders members by board, and within each board in request order. */
+static int compare_members(const void *a, const void *b)
+{
+    const struct capture_member *member_a =
+        *(const struct capture_member * const *) a;
+    const struct capture_member *member_b =
+        *(const struct capture_member * const *) b;
+    struct amc_pci *board_a = member_a->handle->amc_priv;
+    struct amc_pci *board_b = member_b->handle->amc_priv;
+    if (board_a != board_b)
+        return board_a < board_b ? -1 : 1;
+    else
+        return member_a < member_b ? -1 : member_a > member_b;
+}
+
+
+/* Divides the ordered members into boards, returning the number of boards. */
+static unsigned int group_boards(
+    struct capture_member **order, unsigned int count,
+    struct capture_board *boards)
+{
+    unsigned int nboards = 0;
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        struct capture_member *member = order[i];
+        if (nboards > 0  &&  member->handle->amc_priv ==
+                boards[nboards - 1].members[0]->handle->amc_priv)
+        {
+            struct capture_board *board = &boards[nboards - 1];
+            board->count += 1;
+            board->priority = min(board->priority, member->priority);
+        }
+        else
+            boards[nboards++] = (struct capture_board) {
+                .members = &order[i],
+                .count = 1,
+                .priority = member->priority,
+            };
+    }
+    return nboards;
+}
+
+
+/* Checks a member once its board has been entered, as the DMA engine of a
+ * revoked handle may already have gone.  Each region must fit in a single
+ * transfer at the priority the board's engine will be taken at. */
+static int check_member(
+    struct capture_member *member, enum dma_priority priority)
+{
+    if (amc_pci_revoked(member->handle))
+        return -ENODEV;
+    size_t alignment = dma_get_alignment(member->dma);
+    if (member->length == 0  ||
+        member->length > dma_priority_max_transfer(member->dma, priority)  ||
+        !IS_ALIGNED(member->start, alignment)  ||
+        !IS_ALIGNED(member->length, alignment))
+        return -EINVAL;
+    else
+        return 0;
+}
+
+
+/* Enters a board through its first handle.  Handles opened before an earlier
+ * reload have been revoked, and the others then all share one DMA engine. */
+static int enter_board(struct capture_board *board)
+{
+    int rc = amc_pci_enter(board->members[0]->handle);
+    if (rc < 0)
+        return rc;
+    for (unsigned int i = 0; i < board->count  &&  rc == 0; i ++)
+        rc = check_member(board->members[i], board->priority);
+    if (rc < 0)
+        amc_pci_leave(board->members[0]->handle);
+    else
+        board->dma = board->members[0]->dma;
+    return rc;
+}
+
+
+/* Starts the given member of every board back to back and then waits for and
+ * collects each transfer. */
+static int capture_round(
+    struct capture_board *boards, unsigned int nboards, unsigned int round)
+{
+    int rc = 0;
+    for (unsigned int i = 0; i < nboards; i ++)
+        boards[i].busy = false;
+    for (unsigned int i = 0; i < nboards  &&  rc == 0; i ++)
+    {
+        struct capture_board *board = &boards[i];
+        if (round < board->count)
+        {
+            struct capture_member *member = board->members[round];
+            member->timestamp = ktime_get_ns();
+            ssize_t count = dma_start_buffer_unlocked(
+                board->dma, member->start, 0, member->length,
+                DMA_FROM_DEVICE);
+            board->busy = count > 0;
+            if (count != member->length)
+                rc = count < 0 ? count : -EINVAL;
+        }
+    }
+
+    for (unsigned int i = 0; i < nboards; i ++)
+    {
+        struct capture_board *board = &boards[i];
+        if (board->busy)
+        {
+            struct capture_member *member = board->members[round];
+            int wait_rc = dma_wait_transfer_unlocked(board->dma);
+            if (wait_rc < 0)
+                rc = rc ?: wait_rc;
+            else if (rc == 0  &&  copy_to_user(member->data,
+                    dma_get_buffer(board->dma), member->length))
+                rc = -EFAULT;
+        }
+    }
+    return rc;
+}
+
+
+static int capture_boards(struct capture_board *boards, unsigned int nboards)
+{
+    int rc = 0;
+    unsigned int rounds = 0;
+    unsigned int locked = 0;
+    for (; locked < nboards  &&  rc == 0; locked ++)
+    {
+        rc = dma_memory_lock(boards[locked].dma, boards[locked].priority);
+        rounds = max(rounds, boards[locked].count);
+    }
+    if (rc < 0)
+        /* The last engine wasn't taken. */
+        locked -= 1;
+
+    for (unsigned int round = 0; round < rounds  &&  rc == 0; round ++)
+        rc = capture_round(boards, nboards, round);
+
+    for (unsigned int i = locked; i > 0; i --)
+        dma_memory_unlock(boards[i - 1].dma);
+    return rc;
+}
+
+
+int run_capture_group(struct capture_member *members, unsigned int count)
+{
+    int rc = 0;
+    struct capture_member **order =
+        kmalloc_array(count, sizeof(struct capture_member *), GFP_KERNEL);
+    TEST_PTR(order, rc, no_order, "Unable to allocate capture group");
+    struct capture_board *boards =
+        kmalloc_array(count, sizeof(struct capture_board), GFP_KERNEL);
+    TEST_PTR(boards, rc, no_boards, "Unable to allocate capture group");
+
+    for (unsigned int i = 0; i < count; i ++)
+        order[i] = &members[i];
+    sort(order, count, sizeof(struct capture_member *),
+        compare_members, NULL);
+    unsigned int nboards = group_boards(order, count, boards);
+
+    unsigned int entered = 0;
+    for (; entered < nboards  &&  rc == 0; entered ++)
+        rc = enter_board(&boards[entered]);
+    if (rc < 0)
+        /* The last board wasn't entered. */
+        entered -= 1;
+    else
+        rc = capture_boards(boards, nboards);
+    for (unsigned int i = 0; i < entered; i ++)
+        amc_pci_leave(boards[i].members[0]->handle);
+
+    kfree(boards);
+no_boards:
+    kfree(order);
+no_order:
+    return rc;
+}
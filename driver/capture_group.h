@@ -0,0 +1,28 @@
+#ifndef CAPTURE_GROUP_H
+#define CAPTURE_GROUP_H
+
+/* Simultaneous capture of FPGA memory across several boards. */
+
+struct amc_pci_handle;
+struct dma_control;
+
+/* One region of a DMA area to be captured, small enough for a single
+ * transfer.  The file holds the DMA device open for the capture. */
+struct capture_member {
+    struct file *file;
+    struct amc_pci_handle *handle;
+    struct dma_control *dma;
+    enum dma_priority priority;
+    size_t start;                   // Region of FPGA memory to capture
+    size_t length;
+    void __user *data;              // User buffer for captured data
+    u64 timestamp;                  // Returned time transfer was started
+};
+
+/* Holds off reload on every board in the group and takes all of their DMA
+ * engines, then starts the transfers of each board back to back before
+ * waiting for any of them.  The CLOCK_MONOTONIC time at which each transfer
+ * was started is returned in its timestamp. */
+int run_capture_group(struct capture_member *members, unsigned int count);
+
+#endif
@@ -0,0 +1,189 @@
+/* Cache of DMA areas whose contents rarely change.
+ *
+ * The area is divided into fixed size blocks which are filled from FPGA memory
+ * on first read and kept in an xarray indexed by block number.  Readers hold
+ * the cache semaphore for reading while they fill and copy out blocks, and
+ * invalidation takes it for writing, so a block being filled from memory that
+ * is being written is always discarded by the invalidation that follows. */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/pci.h>
+#include <linux/rwsem.h>
+#include <linux/xarray.h>
+
+#include "error.h"
+#include "dma_control.h"
+
+#include "dma_cache.h"
+
+
+/* Size of each cached block as a power of 2. */
+static int dma_cache_block_shift = 16;
+module_param(dma_cache_block_shift, int, S_IRUGO);
+
+/* Limit on the memory used by the cache of a single area. */
+static int dma_cache_max_mb = 64;
+module_param(dma_cache_max_mb, int, S_IRUGO | S_IWUSR);
+
+
+struct dma_cache {
+    struct dma_control *dma;
+    size_t base;                    // DMA area in FPGA memory
+    size_t length;
+    size_t block_size;
+
+    struct rw_semaphore sem;        // Held for writing to invalidate
+    struct xarray blocks;           // Cached blocks by block number
+    atomic_long_t cached;           // Bytes held in blocks
+};
+
+
+struct dma_cache *create_dma_cache(
+    struct dma_control *dma, size_t base, size_t length)
+{
+    struct dma_cache *cache = kzalloc(sizeof(struct dma_cache), GFP_KERNEL);
+    if (!cache)
+        return ERR_PTR(-ENOMEM);
+    *cache = (struct dma_cache) {
+        .dma = dma,
+        .base = base,
+        .length = length,
+        .block_size = max_t(size_t,
+            1ul << max(dma_cache_block_shift, PAGE_SHIFT),
+            dma_get_alignment(dma)),
+    };
+    init_rwsem(&cache->sem);
+    xa_init(&cache->blocks);
+    atomic_long_set(&cache->cached, 0);
+    return cache;
+}
+
+
+static void free_blocks(struct dma_cache *cache, size_t first, size_t last)
+{
+    void *block;
+    unsigned long index;
+    xa_for_each_range(&cache->blocks, index, block, first, last)
+    {
+        xa_erase(&cache->blocks, index);
+        kvfree(block);
+        atomic_long_sub(cache->block_size, &cache->cached);
+    }
+}
+
+
+void destroy_dma_cache(struct dma_cache *cache)
+{
+    free_blocks(cache, 0, ULONG_MAX);
+    xa_destroy(&cache->blocks);
+    kfree(cache);
+}
+
+
+/* Length of the given block, which is only short at the end of the area. */
+static size_t block_length(struct dma_cache *cache, size_t index)
+{
+    size_t start = index * cache->block_size;
+    return ALIGN_DOWN(
+        min(cache->block_size, cache->length - start),
+        dma_get_alignment(cache->dma));
+}
+
+
+/* Reads the given block from FPGA memory and adds it to the cache. */
+static void *fill_block(
+    struct dma_cache *cache, enum dma_priority priority, size_t index)
+{
+    size_t length = block_length(cache, index);
+    if (length == 0)
+        /* Can't read the tail of the area without violating alignment. */
+        return ERR_PTR(-EFAULT);
+    if (atomic_long_read(&cache->cached) + cache->block_size >
+            (long) dma_cache_max_mb << 20)
+        return ERR_PTR(-ENOSPC);
+
+    void *block = kvmalloc(cache->block_size, GFP_KERNEL);
+    if (!block)
+        return ERR_PTR(-ENOMEM);
+
+    struct dma_control *dma = cache->dma;
+    void *dma_buffer = dma_get_buffer(dma);
+    size_t start = cache->base + index * cache->block_size;
+    ssize_t rc = dma_memory_lock(dma, priority);
+    if (rc < 0)
+    {
+        kvfree(block);
+        return ERR_PTR(rc);
+    }
+    for (size_t done = 0; done < length; )
+    {
+        rc = dma_operation_unlocked(
+            dma, start + done, length - done, DMA_FROM_DEVICE);
+        if (rc <= 0)
+        {
+            rc = rc ?: -EIO;
+            break;
+        }
+        memcpy(block + done, dma_buffer, rc);
+        done += rc;
+    }
+    dma_memory_unlock(dma);
+    if (rc < 0)
+    {
+        kvfree(block);
+        return ERR_PTR(rc);
+    }
+
+    /* If another reader got there first we use their block instead. */
+    void *old = xa_cmpxchg(&cache->blocks, index, NULL, block, GFP_KERNEL);
+    if (old)
+    {
+        kvfree(block);
+        return xa_is_err(old) ? ERR_PTR(xa_err(old)) : old;
+    }
+    atomic_long_add(cache->block_size, &cache->cached);
+    return block;
+}
+
+
+const void *dma_cache_get(
+    struct dma_cache *cache, enum dma_priority priority, size_t offset,
+    size_t *length)
+{
+    size_t index = offset / cache->block_size;
+    size_t in_offset = offset - index * cache->block_size;
+
+    down_read(&cache->sem);
+    void *block = xa_load(&cache->blocks, index);
+    if (!block)
+        block = fill_block(cache, priority, index);
+    if (IS_ERR(block))
+    {
+        up_read(&cache->sem);
+        return block;
+    }
+
+    size_t available = block_length(cache, index);
+    *length = available > in_offset ? available - in_offset : 0;
+    return block + in_offset;
+}
+
+
+void dma_cache_put(struct dma_cache *cache)
+{
+    up_read(&cache->sem);
+}
+
+
+void dma_cache_invalidate(struct dma_cache *cache, size_t offset, size_t count)
+{
+    if (count == 0)
+        return;
+    down_write(&cache->sem);
+    free_blocks(cache,
+        offset / cache->block_size, (offset + count - 1) / cache->block_size);
+    up_write(&cache->sem);
+}
@@ -0,0 +1,30 @@
+#ifndef DMA_CACHE_H
+#define DMA_CACHE_H
+
+/* Kernel side cache of DMA areas which the PROM marks as cacheable. */
+
+struct dma_control;
+struct dma_cache;
+
+/* Creates an empty cache for the DMA area at base of the given length. */
+struct dma_cache *create_dma_cache(
+    struct dma_control *dma, size_t base, size_t length);
+
+void destroy_dma_cache(struct dma_cache *cache);
+
+/* Returns the cached data at offset into the area, reading the enclosing block
+ * from FPGA memory if necessary, and the number of bytes available from there
+ * to the end of the block in *length.  The cache is held until dma_cache_put()
+ * is called.  On error an ERR_PTR is returned and the cache is not held; in
+ * particular -ENOSPC is returned if the cache is full, in which case the data
+ * should be read directly. */
+const void *dma_cache_get(
+    struct dma_cache *cache, enum dma_priority priority, size_t offset,
+    size_t *length);
+void dma_cache_put(struct dma_cache *cache);
+
+/* Discards any cached data overlapping the given range of the area.  This must
+ * be called after the FPGA memory has been written. */
+void dma_cache_invalidate(struct dma_cache *cache, size_t offset, size_t count);
+
+#endif
@@ -4,6 +4,10 @@
 #include <linux/dma-mapping.h>
 #include <linux/delay.h>
 #include <linux/module.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/lockdep.h>
 
 #include "error.h"
 #include "debug.h"
@@ -17,6 +21,39 @@
 static int dma_block_shift = DMA_BLOCK_SHIFT;
 module_param(dma_block_shift, int, S_IRUGO);
 
+/* Transfers up to this size are completed by busy polling the DMA status
+ * register in the default completion mode. */
+static unsigned int dma_poll_threshold = 16384;
+module_param(dma_poll_threshold, uint, S_IRUGO | S_IWUSR);
+
+/* Upper limit on the time spent busy polling before falling back to waiting for
+ * the completion interrupt. */
+static unsigned int dma_poll_max_us = 50;
+module_param(dma_poll_max_us, uint, S_IRUGO | S_IWUSR);
+
+/* A transfer interrupted by a PCIe link error waits this long for the error to
+ * be recovered, and is retried at most this many times. */
+static int dma_recovery_timeout_ms = 5000;
+module_param(dma_recovery_timeout_ms, int, S_IRUGO | S_IWUSR);
+static int dma_link_retries = 3;
+module_param(dma_link_retries, int, S_IRUGO | S_IWUSR);
+
+/* Deadline for completion of a single transfer: a fixed allowance plus the time
+ * the transfer would take at the given minimum rate in MB/s.  A transfer which
+ * misses its deadline resets the engine and is retried at most this many
+ * times before failing with -ETIMEDOUT. */
+static int dma_timeout_ms = 100;
+module_param(dma_timeout_ms, int, S_IRUGO | S_IWUSR);
+static int dma_timeout_min_rate = 100;
+module_param(dma_timeout_min_rate, int, S_IRUGO | S_IWUSR);
+static int dma_timeout_retries = 1;
+module_param(dma_timeout_retries, int, S_IRUGO | S_IWUSR);
+
+/* Largest transfer made by a user in the bulk priority class.  This bounds the
+ * time that a higher priority user waits for the engine. */
+static int dma_bulk_chunk = 1 << 18;
+module_param(dma_bulk_chunk, int, S_IRUGO);
+
 
 /* The DMA transfer count is limited to 23 bits, so the maximum transfer size is
  * 2^23-1 = 8388607 bytes, and we align the limit. */
@@ -47,6 +84,9 @@ struct axi_dma_controller {
 #define CDMACR_IrqEn        (1 << 12)   // Enable completion interrupt
 #define CDMACR_Reset        (1 << 2)    // Force soft reset of controller
 
+/* Normal operating state with completion and error interrupts enabled. */
+#define CDMACR_Default      (CDMACR_IrqEn | CDMACR_Err_IrqEn)
+
 /* Status bits. */
 #define CDMASR_Err_Irq      (1 << 14)   // DMA error event seen
 #define CDMASR_IOC_Irq      (1 << 12)   // DMA completion event seen
@@ -69,14 +109,61 @@ struct dma_control {
     void *buffer;           // DMA transfer buffer
     dma_addr_t buffer_dma;  // Associated DMA address
 
-    /* Mutex for exclusive access to DMA engine. */
-    struct mutex mutex;
+    /* Scheduler for exclusive access to DMA engine.  The engine is held while
+     * busy is set, and on release is handed directly to the first waiter of
+     * the highest priority class. */
+    spinlock_t sched_lock;
+    bool busy;
+    struct task_struct *holder;
+    enum dma_priority holder_priority;
+    struct list_head waiters[DMA_PRIORITY_COUNT];
+    unsigned int waiting[DMA_PRIORITY_COUNT];
+    struct list_head served;    // Readers whose data is in the DMA buffer
+    unsigned long merged;       // Reads served by another reader's transfer
+#ifdef CONFIG_DEBUG_LOCK_ALLOC
+    /* Each engine is its own lock class, as transfers between boards may
+     * legitimately hold more than one. */
+    struct lock_class_key dep_key;
+    struct lockdep_map dep_map;
+#endif
 
     /* Completion for DMA transfer. */
     struct completion dma_done;
 
     ssize_t alignment;
     ssize_t max_transfer;
+    ssize_t bulk_transfer;      // max_transfer for the bulk priority class
+
+    /* Completion mode for the current lock holder, and the adaptive budget for
+     * busy polling derived from recently observed completion times. */
+    enum dma_completion_mode completion_mode;
+    u64 poll_budget_ns;
+    u64 poll_average_ns;
+
+    /* State of the transfer in progress: whether we're polling for
+     * completion, and the part of the DMA buffer to return to the CPU. */
+    bool polling;
+    size_t buffer_offset;
+    size_t buffer_count;
+    enum dma_data_direction buffer_dir;
+
+    /* Engine settings for the transfer in progress, kept so that it can be
+     * replayed after a PCIe error, and the link generation when it started. */
+    size_t transfer_src;
+    size_t transfer_dst;
+    size_t transfer_count;
+    uint32_t transfer_control;
+    unsigned int transfer_generation;
+
+    /* PCIe error recovery state.  These are updated by the error handlers
+     * without the DMA mutex, and the generation counts completed recoveries. */
+    bool offline;
+    bool failed;
+    unsigned int generation;
+    wait_queue_head_t recovery_wait;
+
+    /* Number of transfers which have missed their deadline. */
+    unsigned long timeouts;
 };
 
 
@@ -105,14 +192,13 @@ static int reset_dma_controller(struct dma_control *dma)
         return -EIO;
 
     /* Now restore the default working state. */
-    writel(CDMACR_IrqEn | CDMACR_Err_IrqEn, &dma->regs->cdmacr);
+    writel(CDMACR_Default, &dma->regs->cdmacr);
     return 0;
 }
 
 
-static int check_dma_status(struct dma_control *dma)
+static int check_dma_status(uint32_t status)
 {
-    uint32_t status = readl(&dma->regs->cdmasr);
     bool error =
         status & (CDMASR_DMADecErr | CDMASR_DMASlvErr | CDMASR_DMAIntErr);
     if (error)
@@ -152,7 +238,8 @@ void dma_interrupt(struct dma_control *dma)
 
 
 static int configure_dma_engine(
-    struct dma_control *dma, size_t src, size_t dst, size_t count)
+    struct dma_control *dma, size_t src, size_t dst, size_t count,
+    uint32_t control)
 {
     dev_dbg(&dma->pdev->dev,
         "Requesting DMA transfer 0x%08zx -> 0x%08zx, 0x%08zx bytes\n",
@@ -167,6 +254,11 @@ static int configure_dma_engine(
     TEST_RC(rc, reset_error, "Failed to reset DMA");
 
     /* Configure the engine for transfer. */
+    dma->transfer_src = src;
+    dma->transfer_dst = dst;
+    dma->transfer_count = count;
+    dma->transfer_control = control;
+    writel(control, &dma->regs->cdmacr);
     writel((uint32_t) (src >> 32), &dma->regs->sa_msb);
     writel((uint32_t) src, &dma->regs->sa);
     writel((uint32_t) dst, &dma->regs->da);
@@ -179,63 +271,677 @@ unaligned_error:
 }
 
 
-/* Caller must have dma memory locked. */
-ssize_t dma_operation_unlocked(
-    struct dma_control *dma, size_t start, size_t count,
+static bool use_polling(struct dma_control *dma, size_t count)
+{
+    switch (dma->completion_mode)
+    {
+        case DMA_COMPLETION_POLL:
+            return true;
+        case DMA_COMPLETION_INTERRUPT:
+            return false;
+        default:
+            return count <= dma_poll_threshold;
+    }
+}
+
+
+/* Spins on the idle bit for at most the current poll budget.  On success the
+ * status is acknowledged here, as no interrupt will be raised.  The budget
+ * tracks twice the average completion time, bounded by dma_poll_max_us. */
+static bool poll_for_completion(struct dma_control *dma)
+{
+    u64 max_budget = (u64) dma_poll_max_us * NSEC_PER_USEC;
+    u64 budget = min(dma->poll_budget_ns ?: max_budget, max_budget);
+    u64 start = ktime_get_ns();
+    u64 elapsed;
+    do {
+        uint32_t status = readl(&dma->regs->cdmasr);
+        elapsed = ktime_get_ns() - start;
+        if (status & CDMASR_Idle)
+        {
+            writel(status, &dma->regs->cdmasr);
+            dma->poll_average_ns =
+                (3 * dma->poll_average_ns + elapsed) / 4;
+            dma->poll_budget_ns = 2 * dma->poll_average_ns + NSEC_PER_USEC;
+            return true;
+        }
+        cpu_relax();
+    } while (elapsed < budget);
+    return false;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* PCIe error recovery. */
+
+
+/* Waits for recovery from a link error, returning false if recovery failed or
+ * took too long.  Recovery is complete when the link generation has moved on
+ * from the given generation. */
+static bool wait_for_recovery(struct dma_control *dma, unsigned int generation)
+{
+    long rc = wait_event_killable_timeout(dma->recovery_wait,
+        READ_ONCE(dma->failed)  ||  (
+            !READ_ONCE(dma->offline)  &&
+            READ_ONCE(dma->generation) != generation),
+        msecs_to_jiffies(dma_recovery_timeout_ms));
+    return rc > 0  &&  !READ_ONCE(dma->failed);
+}
+
+
+/* A transfer has been lost if a link error has been reported since it was
+ * started, or if the link is down, in which case all reads return ones. */
+static bool transfer_lost(struct dma_control *dma, uint32_t status)
+{
+    return READ_ONCE(dma->offline)  ||
+        READ_ONCE(dma->generation) != dma->transfer_generation  ||
+        status == 0xFFFFFFFF;
+}
+
+
+/* Issues the transfer in progress again, after a successful recovery or after
+ * a timeout. */
+static int replay_transfer(struct dma_control *dma, const char *reason)
+{
+    dev_info(&dma->pdev->dev, "Replaying DMA transfer after %s\n", reason);
+    dma->transfer_generation = READ_ONCE(dma->generation);
+    reinit_completion(&dma->dma_done);
+    return configure_dma_engine(dma,
+        dma->transfer_src, dma->transfer_dst, dma->transfer_count,
+        dma->transfer_control);
+}
+
+
+void dma_link_offline(struct dma_control *dma)
+{
+    WRITE_ONCE(dma->offline, true);
+    /* Wake any transfer waiting for completion so that it can wait for
+     * recovery instead. */
+    complete(&dma->dma_done);
+}
+
+
+int dma_link_reset(struct dma_control *dma)
+{
+    return reset_dma_controller(dma);
+}
+
+
+void dma_link_resume(struct dma_control *dma)
+{
+    /* Nothing was stopped if the link stayed up. */
+    if (!READ_ONCE(dma->offline))
+        return;
+    WRITE_ONCE(dma->generation, dma->generation + 1);
+    WRITE_ONCE(dma->failed, false);
+    WRITE_ONCE(dma->offline, false);
+    wake_up_all(&dma->recovery_wait);
+}
+
+
+void dma_link_failed(struct dma_control *dma)
+{
+    WRITE_ONCE(dma->failed, true);
+    complete(&dma->dma_done);
+    wake_up_all(&dma->recovery_wait);
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+/* Caller must have dma memory locked and host_dma mapped for the device. */
+ssize_t dma_start_transfer_unlocked(
+    struct dma_control *dma, size_t start, dma_addr_t host_dma, size_t count,
     enum dma_data_direction dir)
 {
-    if (count > dma->max_transfer)
-        count = dma->max_transfer;
+    count = min(count, dma_max_transfer(dma));
 
-    /* Hand the buffer over to the DMA engine. */
-    dma_sync_single_for_device(
-        &dma->pdev->dev, dma->buffer_dma, dma->buffer_size, dir);
+    /* Don't start anything while the link is being recovered. */
+    unsigned int generation = READ_ONCE(dma->generation);
+    if (READ_ONCE(dma->offline)  &&  !wait_for_recovery(dma, generation))
+        return -EIO;
+    if (READ_ONCE(dma->failed))
+        return -EIO;
+    dma->transfer_generation = READ_ONCE(dma->generation);
+
+    /* When polling we run with interrupts disabled so that a late interrupt
+     * can't complete a subsequent transfer. */
+    dma->polling = use_polling(dma, count);
+    uint32_t control = dma->polling ? 0 : CDMACR_Default;
 
     reinit_completion(&dma->dma_done);
     ssize_t rc;
     if (dir == DMA_TO_DEVICE)
-        rc = configure_dma_engine(dma, dma->buffer_dma, start, count);
+        rc = configure_dma_engine(dma, host_dma, start, count, control);
     else if (dir == DMA_FROM_DEVICE)
-        rc = configure_dma_engine(dma, start, dma->buffer_dma, count);
+        rc = configure_dma_engine(dma, start, host_dma, count, control);
     else
         rc = -EINVAL;
 
     TEST_RC(rc, dma_error, "Failed to configure DMA");
+    return count;
+
+dma_error:
+    return rc;
+}
+
+
+static unsigned long transfer_deadline(size_t count)
+{
+    /* One MB/s is a thousand bytes per millisecond. */
+    unsigned long ms = (unsigned long) dma_timeout_ms +
+        count / (1000 * (size_t) max(dma_timeout_min_rate, 1));
+    return msecs_to_jiffies(ms);
+}
+
+
+/* Called when a transfer misses its deadline.  If the engine has in fact
+ * finished then the completion interrupt was lost and we carry on, otherwise
+ * the engine is reset ready for a retry.  During PCIe error recovery this is
+ * left to the recovery code. */
+static int transfer_timed_out(struct dma_control *dma)
+{
+    uint32_t status = readl(&dma->regs->cdmasr);
+    if (READ_ONCE(dma->offline)  ||  status == 0xFFFFFFFF)
+        return 0;
+    else if (status & CDMASR_Idle)
+    {
+        dev_warn(&dma->pdev->dev, "DMA completion interrupt lost\n");
+        writel(status, &dma->regs->cdmasr);
+        return 0;
+    }
+    else
+    {
+        dma->timeouts += 1;
+        dev_err(&dma->pdev->dev,
+            "DMA transfer of %zu bytes timed out (status = %08x)\n",
+            dma->transfer_count, status);
+        reset_dma_controller(dma);
+        return -ETIMEDOUT;
+    }
+}
+
+
+static int wait_for_transfer(struct dma_control *dma)
+{
+    /* If polling completes we're done, otherwise re-enabling interrupts will
+     * raise the completion interrupt if the transfer finished in between. */
+    if (dma->polling  &&  poll_for_completion(dma))
+    {
+        writel(CDMACR_Default, &dma->regs->cdmacr);
+        return 0;
+    }
+    else
+    {
+        if (dma->polling)
+            writel(CDMACR_Default, &dma->regs->cdmacr);
+
+        /* Wait for transfer to complete.  If we're killed, unlock and bail.
+         * Note that this call is only killable (kill -9) and not
+         * interruptible because if the DMA engine does fail to complete then
+         * we have a bit of a problem anyway, and if this completion were to be
+         * interrupted normally there would be a hazard from the residual DMA
+         * in progress.  A hung engine is caught by the deadline instead. */
+        long rc = wait_for_completion_killable_timeout(
+            &dma->dma_done, transfer_deadline(dma->transfer_count));
+        if (rc < 0)
+            return (int) rc;
+        else if (rc == 0)
+            return transfer_timed_out(dma);
+        else
+            return 0;
+    }
+}
+
+
+int dma_wait_transfer_unlocked(struct dma_control *dma)
+{
+    int rc = 0;
+    uint32_t status;
+
+    /* A transfer lost to a PCIe link error is replayed once the error handlers
+     * have recovered the link and reset the controller, and a transfer which
+     * times out is replayed after the engine has been reset. */
+    int link_retries = 0;
+    int timeout_retries = 0;
+    for (;;)
+    {
+        rc = wait_for_transfer(dma);
+        if (rc == -ETIMEDOUT)
+        {
+            TEST_OK(timeout_retries++ < dma_timeout_retries, , killed,
+                "DMA transfer timed out");
+            rc = replay_transfer(dma, "timeout");
+            TEST_RC(rc, killed, "Unable to replay DMA transfer");
+            continue;
+        }
+        TEST_RC(rc, killed, "DMA transfer killed");
+        status = readl(&dma->regs->cdmasr);
+        if (!transfer_lost(dma, status))
+            break;
+
+        TEST_OK(link_retries++ < dma_link_retries  &&
+            wait_for_recovery(dma, dma->transfer_generation),
+            rc = -EIO, killed, "DMA transfer lost to PCIe error");
+        rc = replay_transfer(dma, "PCIe error");
+        TEST_RC(rc, killed, "Unable to replay DMA transfer");
+    }
+
+    rc = check_dma_status(status);
+
+killed:
+    /* Return any part of the DMA buffer in use to the CPU. */
+    if (dma->buffer_count)
+    {
+        dma_sync_single_range_for_cpu(
+            &dma->pdev->dev, dma->buffer_dma, dma->buffer_offset,
+            dma->buffer_count, dma->buffer_dir);
+        dma->buffer_count = 0;
+    }
+    return rc;
+}
+
+
+/* Caller must have dma memory locked and host_dma mapped for the device. */
+ssize_t dma_transfer_unlocked(
+    struct dma_control *dma, size_t start, dma_addr_t host_dma, size_t count,
+    enum dma_data_direction dir)
+{
+    ssize_t rc = dma_start_transfer_unlocked(dma, start, host_dma, count, dir);
+    if (rc > 0)
+    {
+        int wait_rc = dma_wait_transfer_unlocked(dma);
+        if (wait_rc < 0)
+            rc = wait_rc;
+    }
+    return rc;
+}
+
+
+/* Caller must have dma memory locked. */
+ssize_t dma_start_buffer_unlocked(
+    struct dma_control *dma, size_t start, size_t offset, size_t count,
+    enum dma_data_direction dir)
+{
+    if (offset + count > dma->buffer_size)
+        return -EINVAL;
+
+    /* Hand this part of the buffer over to the DMA engine until the transfer
+     * has completed. */
+    dma_sync_single_range_for_device(
+        &dma->pdev->dev, dma->buffer_dma, offset, count, dir);
+    ssize_t rc = dma_start_transfer_unlocked(
+        dma, start, dma->buffer_dma + offset, count, dir);
+    if (rc > 0)
+    {
+        dma->buffer_offset = offset;
+        dma->buffer_count = count;
+        dma->buffer_dir = dir;
+    }
+    else
+        dma_sync_single_range_for_cpu(
+            &dma->pdev->dev, dma->buffer_dma, offset, count, dir);
+    return rc;
+}
 
-    /* Wait for transfer to complete.  If we're killed, unlock and bail.  Note
-     * that this call is only killable (kill -9) and not interruptible because
-     * if the DMA engine does fail to complete then we have a bit of a problem
-     * anyway, and if this completion were to be interrupted normally there
-     * would be a hazard from the residual DMA in progress. */
-    rc = wait_for_completion_killable(&dma->dma_done);
-    TEST_RC(rc, killed, "DMA transfer killed");
+
+/* Caller must have dma memory locked. */
+ssize_t dma_operation_unlocked(
+    struct dma_control *dma, size_t start, size_t count,
+    enum dma_data_direction dir)
+{
+    /* Hand the buffer over to the DMA engine. */
+    dma_sync_single_for_device(
+        &dma->pdev->dev, dma->buffer_dma, dma->buffer_size, dir);
+
+    ssize_t rc = dma_transfer_unlocked(dma, start, dma->buffer_dma, count, dir);
 
     /* Restore the buffer to CPU access (really just flushes associated cache
      * entries). */
     dma_sync_single_for_cpu(
         &dma->pdev->dev, dma->buffer_dma, dma->buffer_size, dir);
+    return rc;
+}
 
-    rc = check_dma_status(dma);
-    if (rc)
-        goto dma_error;
 
-    return count;
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* DMA scheduling. */
 
-dma_error:
-killed:
+
+/* A read waiting for the engine, which may be served by the transfer of
+ * another reader if their regions overlap or are adjacent. */
+struct dma_read {
+    size_t start;               // Region of FPGA memory wanted
+    size_t count;
+    bool done;                  // Set if served by another reader's transfer
+    ssize_t result;             // Bytes available or error code if done
+    size_t offset;              // Offset of data in DMA buffer if done
+};
+
+struct dma_waiter {
+    struct list_head list;
+    struct task_struct *task;
+    enum dma_priority priority;
+    struct dma_read *read;      // Set if this is a mergeable read
+    bool queued;                // Counted in waiting[priority]
+    bool granted;               // Set when the engine is handed over
+};
+
+
+/* Called with sched_lock held, hands the engine to a waiter which has already
+ * been removed from the waiting lists. */
+static void grant(struct dma_control *dma, struct dma_waiter *waiter)
+{
+    WRITE_ONCE(dma->holder, waiter->task);
+    dma->holder_priority = waiter->priority;
+    waiter->granted = true;
+    wake_up_process(waiter->task);
+}
+
+
+/* Called with sched_lock held.  Hands the engine to the first waiter with
+ * priority above the given class, returning false if there is none. */
+static bool hand_over(struct dma_control *dma, enum dma_priority above)
+{
+    for (int priority = 0; priority < above; priority ++)
+    {
+        if (dma->waiting[priority])
+        {
+            struct dma_waiter *waiter = list_first_entry(
+                &dma->waiters[priority], struct dma_waiter, list);
+            list_del(&waiter->list);
+            dma->waiting[priority] -= 1;
+            waiter->queued = false;
+            grant(dma, waiter);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/* Called with sched_lock held, which is released on return when the engine has
+ * been handed to us, or with -EINTR if we are killed first.  The waiter may by
+ * then have been moved onto the batch or served list of another reader, and is
+ * simply taken off whichever list it is on.  A holder which has yielded goes
+ * back to the front of its class so that it is not overtaken by later
+ * arrivals. */
+static int wait_for_turn(
+    struct dma_control *dma, struct dma_waiter *waiter, bool front)
+{
+    struct list_head *waiters = &dma->waiters[waiter->priority];
+    if (front)
+        list_add(&waiter->list, waiters);
+    else
+        list_add_tail(&waiter->list, waiters);
+    dma->waiting[waiter->priority] += 1;
+    waiter->queued = true;
+
+    int rc = 0;
+    for (;;)
+    {
+        set_current_state(TASK_KILLABLE);
+        if (waiter->granted)
+            break;
+        if (fatal_signal_pending(current))
+        {
+            list_del(&waiter->list);
+            if (waiter->queued)
+                dma->waiting[waiter->priority] -= 1;
+            rc = -EINTR;
+            break;
+        }
+        spin_unlock(&dma->sched_lock);
+        schedule();
+        spin_lock(&dma->sched_lock);
+    }
+    __set_current_state(TASK_RUNNING);
+    spin_unlock(&dma->sched_lock);
+    return rc;
+}
+
+
+/* Called with sched_lock held to take the engine if it is free. */
+static bool take_idle_engine(struct dma_control *dma, struct dma_waiter *waiter)
+{
+    if (dma->busy)
+        return false;
+    dma->busy = true;
+    WRITE_ONCE(dma->holder, waiter->task);
+    dma->holder_priority = waiter->priority;
+    return true;
+}
+
+
+/* The engine is annotated for lockdep as a lock from the moment we start
+ * waiting for it, so that taking it in conflicting orders with other locks is
+ * reported.  Only we can make ourself the holder, so the test for recursion
+ * needs no lock. */
+static int acquire_engine(struct dma_control *dma, struct dma_waiter *waiter)
+{
+    if (READ_ONCE(dma->holder) == current)
+        return -EDEADLK;
+
+    int rc = 0;
+    lock_map_acquire(&dma->dep_map);
+    spin_lock(&dma->sched_lock);
+    if (take_idle_engine(dma, waiter))
+        spin_unlock(&dma->sched_lock);
+    else
+        rc = wait_for_turn(dma, waiter, false);
+    if (rc < 0)
+        lock_map_release(&dma->dep_map);
     return rc;
 }
 
 
-void dma_memory_lock(struct dma_control *dma)
+int dma_memory_lock(struct dma_control *dma, enum dma_priority priority)
 {
-    mutex_lock(&dma->mutex);
+    struct dma_waiter waiter = { .task = current, .priority = priority };
+    return acquire_engine(dma, &waiter);
 }
 
 
+int dma_memory_trylock(struct dma_control *dma, enum dma_priority priority)
+{
+    if (READ_ONCE(dma->holder) == current)
+        return -EDEADLK;
+
+    struct dma_waiter waiter = { .task = current, .priority = priority };
+    spin_lock(&dma->sched_lock);
+    bool taken = take_idle_engine(dma, &waiter);
+    spin_unlock(&dma->sched_lock);
+    if (!taken)
+        return -EBUSY;
+    lock_map_acquire_try(&dma->dep_map);
+    return 0;
+}
+
+
+/* Readers whose data is already in the DMA buffer are served first, so that
+ * the buffer is not overwritten before they have copied it. */
 void dma_memory_unlock(struct dma_control *dma)
 {
-    mutex_unlock(&dma->mutex);
+    dma->completion_mode = DMA_COMPLETION_AUTO;
+    lock_map_release(&dma->dep_map);
+    spin_lock(&dma->sched_lock);
+    WRITE_ONCE(dma->holder, NULL);
+    if (!list_empty(&dma->served))
+    {
+        struct dma_waiter *waiter =
+            list_first_entry(&dma->served, struct dma_waiter, list);
+        list_del(&waiter->list);
+        grant(dma, waiter);
+    }
+    else if (!hand_over(dma, DMA_PRIORITY_COUNT))
+        dma->busy = false;
+    spin_unlock(&dma->sched_lock);
+}
+
+
+bool dma_memory_should_yield(struct dma_control *dma)
+{
+    for (int priority = 0; priority < dma->holder_priority; priority ++)
+        if (READ_ONCE(dma->waiting[priority]))
+            return true;
+    return false;
+}
+
+
+int dma_memory_yield(struct dma_control *dma)
+{
+    if (!dma_memory_should_yield(dma))
+        return 0;
+
+    struct dma_waiter waiter = {
+        .task = current,
+        .priority = dma->holder_priority,
+    };
+    enum dma_completion_mode mode = dma->completion_mode;
+    int rc = 0;
+    spin_lock(&dma->sched_lock);
+    if (hand_over(dma, waiter.priority))
+    {
+        /* We don't hold the engine while the other user has it. */
+        lock_map_release(&dma->dep_map);
+        lock_map_acquire(&dma->dep_map);
+        rc = wait_for_turn(dma, &waiter, true);
+        if (rc < 0)
+            lock_map_release(&dma->dep_map);
+        else
+            dma->completion_mode = mode;
+    }
+    else
+        spin_unlock(&dma->sched_lock);
+    return rc;
+}
+
+
+/* Called with sched_lock held.  Repeatedly extends [*start, *end) to cover
+ * waiting reads which overlap or abut it, for as long as the result fits in a
+ * single transfer, and moves the merged waiters onto the batch list. */
+static void collect_reads(
+    struct dma_control *dma, size_t *start, size_t *end,
+    struct list_head *batch)
+{
+    size_t max_transfer = dma_max_transfer(dma);
+    bool added;
+    do {
+        added = false;
+        for (int priority = 0; priority < DMA_PRIORITY_COUNT; priority ++)
+        {
+            struct dma_waiter *waiter, *next;
+            list_for_each_entry_safe(
+                waiter, next, &dma->waiters[priority], list)
+            {
+                struct dma_read *read = waiter->read;
+                if (!read  ||
+                    read->start > *end  ||  read->start + read->count < *start)
+                    continue;
+                size_t new_start = min(*start, read->start);
+                size_t new_end = max(*end, read->start + read->count);
+                if (new_end - new_start > max_transfer)
+                    continue;
+                *start = new_start;
+                *end = new_end;
+                list_move_tail(&waiter->list, batch);
+                dma->waiting[priority] -= 1;
+                waiter->queued = false;
+                added = true;
+            }
+        }
+    } while (added);
+}
+
+
+ssize_t dma_read_shared(
+    struct dma_control *dma, enum dma_priority priority,
+    enum dma_completion_mode mode, size_t start, size_t count,
+    size_t *offset)
+{
+    struct dma_read read = { .start = start, .count = count };
+    struct dma_waiter waiter = {
+        .task = current,
+        .priority = priority,
+        .read = &read,
+    };
+    int lock_rc = acquire_engine(dma, &waiter);
+    if (lock_rc < 0)
+        return lock_rc;
+    dma->completion_mode = mode;
+    if (read.done)
+    {
+        *offset = read.offset;
+        if (read.result < 0)
+            dma_memory_unlock(dma);
+        return read.result;
+    }
+
+    /* We do the transfer, so take on every waiting read which fits. */
+    LIST_HEAD(batch);
+    size_t end = start + min(count, dma_max_transfer(dma));
+    spin_lock(&dma->sched_lock);
+    collect_reads(dma, &start, &end, &batch);
+    spin_unlock(&dma->sched_lock);
+
+    ssize_t rc = dma_operation_unlocked(
+        dma, start, end - start, DMA_FROM_DEVICE);
+
+    /* Fill in the results for the merged readers, who are then handed the
+     * engine in turn to collect their data.  Any reader whose data was not
+     * transferred goes back to the front of its queue to try again. */
+    struct dma_waiter *merged, *next;
+    spin_lock(&dma->sched_lock);
+    list_for_each_entry_safe(merged, next, &batch, list)
+    {
+        struct dma_read *other = merged->read;
+        other->offset = other->start - start;
+        if (rc < 0)
+            other->result = rc;
+        else if ((size_t) rc > other->offset)
+        {
+            other->result = min(other->count, rc - other->offset);
+            dma->merged += 1;
+        }
+        else
+        {
+            list_move(&merged->list, &dma->waiters[merged->priority]);
+            dma->waiting[merged->priority] += 1;
+            merged->queued = true;
+            continue;
+        }
+        other->done = true;
+        list_move_tail(&merged->list, &dma->served);
+    }
+    spin_unlock(&dma->sched_lock);
+
+    *offset = read.start - start;
+    if (rc >= 0  &&  (size_t) rc <= *offset)
+        rc = -EIO;
+    if (rc < 0)
+    {
+        dma_memory_unlock(dma);
+        return rc;
+    }
+    else
+        return min(count, rc - *offset);
+}
+
+
+unsigned long dma_get_merged(struct dma_control *dma)
+{
+    return READ_ONCE(dma->merged);
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+void dma_set_completion_mode(
+    struct dma_control *dma, enum dma_completion_mode mode)
+{
+    dma->completion_mode = mode;
 }
 
 
@@ -257,6 +963,34 @@ size_t dma_get_alignment(struct dma_control *dma)
 }
 
 
+size_t dma_priority_max_transfer(
+    struct dma_control *dma, enum dma_priority priority)
+{
+    if (priority == DMA_PRIORITY_BULK)
+        return dma->bulk_transfer;
+    else
+        return dma->max_transfer;
+}
+
+
+size_t dma_max_transfer(struct dma_control *dma)
+{
+    return dma_priority_max_transfer(dma, dma->holder_priority);
+}
+
+
+struct device *dma_get_device(struct dma_control *dma)
+{
+    return &dma->pdev->dev;
+}
+
+
+unsigned long dma_get_timeouts(struct dma_control *dma)
+{
+    return READ_ONCE(dma->timeouts);
+}
+
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Initialisation and shutdown. */
 
@@ -281,6 +1015,16 @@ int initialise_dma_control(
     *pdma = dma;
     dma->pdev = pdev;
     dma->regs = regs;
+    dma->completion_mode = DMA_COMPLETION_AUTO;
+    dma->poll_budget_ns = 0;
+    dma->poll_average_ns = 0;
+    dma->polling = false;
+    dma->buffer_count = 0;
+    dma->offline = false;
+    dma->failed = false;
+    dma->generation = 0;
+    dma->timeouts = 0;
+    init_waitqueue_head(&dma->recovery_wait);
 
     /* Allocate DMA buffer area. */
     dma->buffer_shift = dma_block_shift;
@@ -292,6 +1036,10 @@ int initialise_dma_control(
     dma->max_transfer =
         ALIGN_DOWN(min((size_t) MAX_DMA_TRANSFER, dma->buffer_size),
             dma->alignment);
+    dma->bulk_transfer = max(
+        ALIGN_DOWN(min((ssize_t) dma_bulk_chunk, dma->max_transfer),
+            dma->alignment),
+        dma->alignment);
 
     /* Get the associated DMA address for the buffer. */
     dma->buffer_dma = dma_map_single(
@@ -300,7 +1048,21 @@ int initialise_dma_control(
         rc = -EIO, no_dma_map, "Unable to map DMA buffer");
 
     /* Final initialisation, now ready to run. */
-    mutex_init(&dma->mutex);
+    spin_lock_init(&dma->sched_lock);
+    dma->busy = false;
+    dma->holder = NULL;
+    dma->holder_priority = DMA_PRIORITY_NORMAL;
+    for (int priority = 0; priority < DMA_PRIORITY_COUNT; priority ++)
+    {
+        INIT_LIST_HEAD(&dma->waiters[priority]);
+        dma->waiting[priority] = 0;
+    }
+    INIT_LIST_HEAD(&dma->served);
+    dma->merged = 0;
+#ifdef CONFIG_DEBUG_LOCK_ALLOC
+    lockdep_register_key(&dma->dep_key);
+    lockdep_init_map(&dma->dep_map, "amc_dma_engine", &dma->dep_key, 0);
+#endif
     init_completion(&dma->dma_done);
     rc = reset_dma_controller(dma);
     TEST_RC(rc, reset_error, "Failed to reset DMA");
@@ -309,6 +1071,9 @@ int initialise_dma_control(
 
 
 reset_error:
+#ifdef CONFIG_DEBUG_LOCK_ALLOC
+    lockdep_unregister_key(&dma->dep_key);
+#endif
     dma_unmap_single(
         &pdev->dev, dma->buffer_dma, dma->buffer_size, DMA_BIDIRECTIONAL);
 no_dma_map:
@@ -326,5 +1091,8 @@ void terminate_dma_control(struct dma_control *dma)
     dma_unmap_single(
         &dma->pdev->dev, dma->buffer_dma, dma->buffer_size, DMA_FROM_DEVICE);
     free_pages((unsigned long) dma->buffer, dma->buffer_shift - PAGE_SHIFT);
+#ifdef CONFIG_DEBUG_LOCK_ALLOC
+    lockdep_unregister_key(&dma->dep_key);
+#endif
     kfree(dma);
 }
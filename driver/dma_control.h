@@ -14,6 +14,25 @@
 
 struct dma_control;
 
+/* Selects how completion of a transfer is detected.  In the automatic mode
+ * small transfers are busy polled and larger ones wait for the interrupt. */
+enum dma_completion_mode {
+    DMA_COMPLETION_AUTO,
+    DMA_COMPLETION_INTERRUPT,
+    DMA_COMPLETION_POLL,
+};
+
+/* Priority classes for access to the DMA engine.  When the engine is released
+ * it is handed to the longest waiting user of the highest class.  Transfers
+ * made in the bulk class are limited to dma_bulk_chunk bytes so that other
+ * users can interleave. */
+enum dma_priority {
+    DMA_PRIORITY_RT,
+    DMA_PRIORITY_NORMAL,
+    DMA_PRIORITY_BULK,
+    DMA_PRIORITY_COUNT
+};
+
 /* Initialises DMA control, returns structure used for access. */
 int initialise_dma_control(
     struct pci_dev *pdev, void __iomem *regs, struct dma_control **pdma,
@@ -30,16 +49,92 @@ ssize_t dma_operation_unlocked(
     struct dma_control *dma, size_t start, size_t count,
     enum dma_data_direction dir);
 
-void dma_memory_lock(struct dma_control *dma);
+/* Transfers between FPGA memory and an arbitrary host buffer which the caller
+ * has already mapped for the device at host_dma.  The DMA memory lock must be
+ * held, and as above the number of bytes transferred is returned. */
+ssize_t dma_transfer_unlocked(
+    struct dma_control *dma, size_t start, dma_addr_t host_dma, size_t count,
+    enum dma_data_direction dir);
+
+/* Asynchronous transfers.  A transfer is started by one of the following two
+ * functions, and dma_wait_transfer_unlocked() must then be called before any
+ * further DMA operation.  The first form transfers to an arbitrary mapped host
+ * buffer, the second transfers count bytes at offset into the DMA buffer.  In
+ * both cases the number of bytes in the transfer is returned. */
+ssize_t dma_start_transfer_unlocked(
+    struct dma_control *dma, size_t start, dma_addr_t host_dma, size_t count,
+    enum dma_data_direction dir);
+ssize_t dma_start_buffer_unlocked(
+    struct dma_control *dma, size_t start, size_t offset, size_t count,
+    enum dma_data_direction dir);
+int dma_wait_transfer_unlocked(struct dma_control *dma);
+
+/* Acquires exclusive use of the DMA engine at the given priority.  Fails with
+ * -EINTR if the caller is killed while waiting, or with -EDEADLK if the caller
+ * already holds the engine, as happens when a copy to or from user space made
+ * while holding it faults on a mapping of FPGA memory.  The second form fails
+ * with -EBUSY rather than waiting. */
+int dma_memory_lock(struct dma_control *dma, enum dma_priority priority);
+int dma_memory_trylock(struct dma_control *dma, enum dma_priority priority);
 void dma_memory_unlock(struct dma_control *dma);
 
+/* Operations spanning many transfers should call dma_memory_yield() between
+ * transfers, when no transfer is in progress and nothing in the DMA buffer is
+ * still needed.  If a user of higher priority is waiting the engine is handed
+ * over and then reacquired.  dma_memory_should_yield() is a cheap test of
+ * whether this would happen.  If the caller is killed while waiting to
+ * reacquire the engine -EINTR is returned, and the engine is no longer held. */
+bool dma_memory_should_yield(struct dma_control *dma);
+int dma_memory_yield(struct dma_control *dma);
+
+/* Acquires the DMA engine and reads count bytes of FPGA memory from start into
+ * the DMA buffer, returning with the lock held.  Reads waiting at the same
+ * time which overlap or abut are merged into a single transfer, and each
+ * reader is then handed the lock in turn to collect its data.  Returns the
+ * number of bytes available at *offset in the DMA buffer, or an error code in
+ * which case the lock is not held. */
+ssize_t dma_read_shared(
+    struct dma_control *dma, enum dma_priority priority,
+    enum dma_completion_mode mode, size_t start, size_t count,
+    size_t *offset);
+
+/* Returns the number of reads served by the transfer of another reader. */
+unsigned long dma_get_merged(struct dma_control *dma);
+
+/* Sets the completion mode for transfers made while the lock is held.  The mode
+ * reverts to DMA_COMPLETION_AUTO when the lock is released. */
+void dma_set_completion_mode(
+    struct dma_control *dma, enum dma_completion_mode mode);
+
 void *dma_get_buffer(struct dma_control *dma);
 size_t dma_get_alignment(struct dma_control *dma);
 
+/* Device for mapping host buffers to be passed to dma_transfer_unlocked. */
+struct device *dma_get_device(struct dma_control *dma);
+
+/* Returns the number of transfers which have missed their deadline. */
+unsigned long dma_get_timeouts(struct dma_control *dma);
+
 /* To be called each time a DMA completion interrupt is seen. */
 void dma_interrupt(struct dma_control *dma);
 
+/* PCIe error recovery.  When a link error is reported the controller is marked
+ * offline and any transfer in progress is woken to wait for recovery.  Once the
+ * link has been restored dma_link_reset() resets the controller, and then
+ * dma_link_resume() allows the interrupted transfer to be replayed.  If the
+ * link can't be recovered dma_link_failed() fails all transfers with -EIO. */
+void dma_link_offline(struct dma_control *dma);
+int dma_link_reset(struct dma_control *dma);
+void dma_link_resume(struct dma_control *dma);
+void dma_link_failed(struct dma_control *dma);
+
 /* Returns available DMA buffer size. */
 size_t dma_buffer_size(struct dma_control *dma);
 
+/* Returns the largest transfer which can be made in a single operation by the
+ * current lock holder, or by a holder of the given priority. */
+size_t dma_max_transfer(struct dma_control *dma);
+size_t dma_priority_max_transfer(
+    struct dma_control *dma, enum dma_priority priority);
+
 #endif
@@ -0,0 +1,72 @@
+/* Tests of DMA engine scheduling against a fake engine. */
+
+#include <kunit/test.h>
+#include <linux/pci.h>
+
+#include "dma_control.h"
+#include "test_assets/fake_cdma.c"
+
+
+/* A read() copying to a mapping of the area it is reading faults while holding
+ * the engine, and the fault then asks for the engine again.  This must fail
+ * rather than wait forever, and must leave the engine usable. */
+static void test_dma_lock_recursion(struct kunit *test)
+{
+    struct dma_control *dma = create_fake_dma(test);
+    if (!dma)
+        return;
+
+    KUNIT_ASSERT_EQ(test, 0, dma_memory_lock(dma, DMA_PRIORITY_NORMAL));
+    KUNIT_EXPECT_EQ(test, -EDEADLK, dma_memory_lock(dma, DMA_PRIORITY_NORMAL));
+    KUNIT_EXPECT_EQ(test, -EDEADLK,
+        dma_memory_trylock(dma, DMA_PRIORITY_NORMAL));
+    KUNIT_EXPECT_EQ(test, (ssize_t) PAGE_SIZE,
+        dma_operation_unlocked(dma, 0, PAGE_SIZE, DMA_FROM_DEVICE));
+    dma_memory_unlock(dma);
+
+    KUNIT_EXPECT_EQ(test, 0, dma_memory_trylock(dma, DMA_PRIORITY_BULK));
+    dma_memory_unlock(dma);
+    KUNIT_EXPECT_EQ(test, 0, dma_memory_lock(dma, DMA_PRIORITY_NORMAL));
+    dma_memory_unlock(dma);
+
+    destroy_fake_dma(dma);
+}
+
+
+/* A shared read which fails to get the engine returns without it. */
+static void test_dma_read_shared_recursion(struct kunit *test)
+{
+    struct dma_control *dma = create_fake_dma(test);
+    if (!dma)
+        return;
+
+    size_t offset;
+    KUNIT_ASSERT_EQ(test, 0, dma_memory_lock(dma, DMA_PRIORITY_NORMAL));
+    KUNIT_EXPECT_EQ(test, (ssize_t) -EDEADLK,
+        dma_read_shared(dma, DMA_PRIORITY_NORMAL, DMA_COMPLETION_AUTO,
+            0, PAGE_SIZE, &offset));
+    dma_memory_unlock(dma);
+
+    KUNIT_EXPECT_EQ(test, (ssize_t) PAGE_SIZE,
+        dma_read_shared(dma, DMA_PRIORITY_NORMAL, DMA_COMPLETION_AUTO,
+            0, PAGE_SIZE, &offset));
+    dma_memory_unlock(dma);
+
+    destroy_fake_dma(dma);
+}
+
+
+static struct kunit_case dma_control_test_cases[] = {
+    KUNIT_CASE(test_dma_lock_recursion),
+    KUNIT_CASE(test_dma_read_shared_recursion),
+    {}
+};
+
+
+static struct kunit_suite dma_control_test_suite = {
+    .name = "amc_pci_dma_control",
+    .test_cases = dma_control_test_cases,
+};
+
+
+kunit_test_suite(dma_control_test_suite);
@@ -0,0 +1,243 @@
+/* Export of FPGA memory through dma-buf.
+ *
+ * A region of a DMA area is copied by the DMA engine into a set of driver owned
+ * blocks which are then handed out as a dma-buf, so that other devices and
+ * subsystems can import the captured data without any copy through user space.
+ * The buffer is completely filled before its file descriptor is returned, so
+ * there is never a pending write for an importer to wait on. */
+
+#include <linux/kernel.h>
+#include <linux/version.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/pci.h>
+#include <linux/dma-mapping.h>
+#include <linux/dma-buf.h>
+#include <linux/scatterlist.h>
+
+#include "error.h"
+#include "dma_control.h"
+
+#include "dmabuf.h"
+
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+MODULE_IMPORT_NS("DMA_BUF");
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+MODULE_IMPORT_NS(DMA_BUF);
+#endif
+
+
+struct amc_dmabuf {
+    size_t length;              // Total length of exported data
+    size_t block_size;          // Size of each block, equal to DMA buffer size
+    unsigned int nblocks;       // Number of allocated blocks
+    struct page *blocks[];      // Physically contiguous blocks of memory
+};
+
+
+static size_t block_length(struct amc_dmabuf *buffer, unsigned int block)
+{
+    return min(buffer->block_size, buffer->length - block * buffer->block_size);
+}
+
+
+static void free_blocks(struct amc_dmabuf *buffer)
+{
+    for (unsigned int i = 0; i < buffer->nblocks; i ++)
+        if (buffer->blocks[i])
+            __free_pages(buffer->blocks[i],
+                get_order(block_length(buffer, i)));
+    kfree(buffer);
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* dma-buf operations. */
+
+
+static struct sg_table *amc_dmabuf_map(
+    struct dma_buf_attachment *attach, enum dma_data_direction dir)
+{
+    struct amc_dmabuf *buffer = attach->dmabuf->priv;
+    int rc = 0;
+
+    struct sg_table *table = kmalloc(sizeof(struct sg_table), GFP_KERNEL);
+    TEST_PTR(table, rc, no_table, "Unable to allocate sg table");
+    rc = sg_alloc_table(table, buffer->nblocks, GFP_KERNEL);
+    TEST_RC(rc, no_sg, "Unable to allocate sg entries");
+
+    struct scatterlist *sg;
+    unsigned int i;
+    for_each_sgtable_sg(table, sg, i)
+        sg_set_page(sg, buffer->blocks[i], block_length(buffer, i), 0);
+
+    rc = dma_map_sgtable(attach->dev, table, dir, 0);
+    TEST_RC(rc, no_map, "Unable to map dma-buf for importer");
+    return table;
+
+no_map:
+    sg_free_table(table);
+no_sg:
+    kfree(table);
+no_table:
+    return ERR_PTR(rc);
+}
+
+
+static void amc_dmabuf_unmap(
+    struct dma_buf_attachment *attach, struct sg_table *table,
+    enum dma_data_direction dir)
+{
+    dma_unmap_sgtable(attach->dev, table, dir, 0);
+    sg_free_table(table);
+    kfree(table);
+}
+
+
+static void amc_dmabuf_release(struct dma_buf *dmabuf)
+{
+    free_blocks(dmabuf->priv);
+}
+
+
+static int amc_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+    struct amc_dmabuf *buffer = dmabuf->priv;
+    size_t offset = vma->vm_pgoff << PAGE_SHIFT;
+    size_t size = vma->vm_end - vma->vm_start;
+    if (offset + size > PAGE_ALIGN(buffer->length))
+        return -EINVAL;
+
+    unsigned long address = vma->vm_start;
+    for (unsigned int i = 0; i < buffer->nblocks  &&  size > 0; i ++)
+    {
+        size_t length = PAGE_ALIGN(block_length(buffer, i));
+        if (offset >= length)
+        {
+            offset -= length;
+            continue;
+        }
+
+        size_t map_size = min(length - offset, size);
+        int rc = remap_pfn_range(vma, address,
+            page_to_pfn(buffer->blocks[i]) + (offset >> PAGE_SHIFT),
+            map_size, vma->vm_page_prot);
+        if (rc < 0)
+            return rc;
+        address += map_size;
+        size -= map_size;
+        offset = 0;
+    }
+    return 0;
+}
+
+
+static const struct dma_buf_ops amc_dmabuf_ops = {
+    .map_dma_buf = amc_dmabuf_map,
+    .unmap_dma_buf = amc_dmabuf_unmap,
+    .release = amc_dmabuf_release,
+    .mmap = amc_dmabuf_mmap,
+};
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Export. */
+
+
+/* Fills the given block from FPGA memory, DMA going straight into the block
+ * without passing through the DMA bounce buffer. */
+static int fill_block(
+    struct dma_control *dma, struct amc_dmabuf *buffer, unsigned int block,
+    size_t start, enum dma_priority priority)
+{
+    struct device *dev = dma_get_device(dma);
+    size_t length = block_length(buffer, block);
+    int rc = 0;
+
+    dma_addr_t block_dma = dma_map_page(
+        dev, buffer->blocks[block], 0, length, DMA_FROM_DEVICE);
+    TEST_OK(!dma_mapping_error(dev, block_dma), rc = -EIO, no_map,
+        "Unable to map dma-buf block");
+
+    rc = dma_memory_lock(dma, priority);
+    if (rc < 0)
+        goto no_lock;
+    for (size_t done = 0; done < length; )
+    {
+        ssize_t count = dma_transfer_unlocked(
+            dma, start + done, block_dma + done, length - done,
+            DMA_FROM_DEVICE);
+        if (count <= 0)
+        {
+            rc = count ?: -EIO;
+            break;
+        }
+        done += count;
+        rc = dma_memory_yield(dma);
+        if (rc < 0)
+            goto no_lock;
+    }
+    dma_memory_unlock(dma);
+
+no_lock:
+    dma_unmap_page(dev, block_dma, length, DMA_FROM_DEVICE);
+no_map:
+    return rc;
+}
+
+
+int amc_pci_export_dmabuf(
+    struct dma_control *dma, size_t start, size_t length, unsigned int flags,
+    enum dma_priority priority)
+{
+    size_t alignment = dma_get_alignment(dma);
+    if (length == 0  ||
+        !IS_ALIGNED(start, alignment)  ||  !IS_ALIGNED(length, alignment))
+        return -EINVAL;
+
+    int rc = 0;
+    size_t block_size = dma_buffer_size(dma);
+    unsigned int nblocks = DIV_ROUND_UP(length, block_size);
+    struct amc_dmabuf *buffer = kzalloc(
+        struct_size(buffer, blocks, nblocks), GFP_KERNEL);
+    TEST_PTR(buffer, rc, no_buffer, "Unable to allocate dma-buf");
+    *buffer = (struct amc_dmabuf) {
+        .length = length,
+        .block_size = block_size,
+        .nblocks = nblocks,
+    };
+
+    /* The blocks are zeroed, as mappings expose the tail of the last page
+     * beyond the end of the data. */
+    for (unsigned int i = 0; i < nblocks; i ++)
+    {
+        buffer->blocks[i] = alloc_pages(
+            GFP_KERNEL | __GFP_ZERO, get_order(block_length(buffer, i)));
+        TEST_PTR(buffer->blocks[i], rc, no_blocks,
+            "Unable to allocate dma-buf block");
+        rc = fill_block(dma, buffer, i, start + i * block_size, priority);
+        TEST_RC(rc, no_blocks, "Unable to fill dma-buf block");
+    }
+
+    DEFINE_DMA_BUF_EXPORT_INFO(export_info);
+    export_info.ops = &amc_dmabuf_ops;
+    export_info.size = PAGE_ALIGN(length);
+    export_info.flags = O_RDWR;
+    export_info.priv = buffer;
+    struct dma_buf *dmabuf = dma_buf_export(&export_info);
+    TEST_PTR(dmabuf, rc, no_export, "Unable to export dma-buf");
+
+    /* From this point on the buffer is owned by the dma-buf. */
+    rc = dma_buf_fd(dmabuf, flags & O_CLOEXEC);
+    if (rc < 0)
+        dma_buf_put(dmabuf);
+    return rc;
+
+no_export:
+no_blocks:
+    free_blocks(buffer);
+no_buffer:
+    return rc;
+}
@@ -0,0 +1,15 @@
+#ifndef DMABUF_H
+#define DMABUF_H
+
+/* Export of FPGA memory through dma-buf. */
+
+struct dma_control;
+
+/* Allocates a dma-buf of length bytes, fills it from FPGA address start using
+ * the DMA engine at the given priority, and returns a file descriptor for the
+ * new buffer.  Both start and length must be aligned to the DMA alignment. */
+int amc_pci_export_dmabuf(
+    struct dma_control *dma, size_t start, size_t length, unsigned int flags,
+    enum dma_priority priority);
+
+#endif
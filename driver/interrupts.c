@@ -5,6 +5,11 @@
 #include <linux/sched.h>
 #include <linux/wait.h>
 #include <linux/atomic.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
+#include <linux/seq_file.h>
+#include <linux/debugfs.h>
 
 #include "error.h"
 #include "dma_control.h"
@@ -29,6 +34,24 @@ struct axi_interrupt_controller {
 };
 
 
+/* Interrupt statistics, counted per CPU by the interrupt handler.  Line 0 is
+ * the DMA engine and the remaining lines are user events. */
+#define INTERRUPT_LINES     32
+
+struct interrupt_stats {
+    u64 count[INTERRUPT_LINES];     // Interrupts seen on each line
+    u64 merged[INTERRUPT_LINES];    // Events already pending for a reader
+    u64 spurious;                   // Interrupts with nothing pending
+};
+
+/* The rate of each line is a decaying average updated every second, in fixed
+ * point with RATE_SHIFT fractional bits as for the load average.  RATE_DECAY
+ * is exp(-1/8), giving a time constant of 8 seconds. */
+#define RATE_SHIFT          11
+#define RATE_ONE            (1 << RATE_SHIFT)
+#define RATE_DECAY          1807
+
+
 struct interrupt_control {
     /* Interrupt controller register space. */
     struct axi_interrupt_controller __iomem *intc;
@@ -40,6 +63,19 @@ struct interrupt_control {
     /* Set of user-space events seen. */
     atomic_t events[N_EVENT_READERS];
     long active_readers;
+    /* Time in ns of the interrupt delivering the first unread event. */
+    atomic64_t event_time[N_EVENT_READERS];
+
+    /* Triggers called from the interrupt handler. */
+    spinlock_t triggers_lock;
+    struct list_head triggers;
+
+    /* Statistics, and the rate estimates derived from them by rate_work. */
+    struct interrupt_stats __percpu *stats;
+    struct mutex rate_lock;
+    struct delayed_work rate_work;
+    u64 last_count[INTERRUPT_LINES];
+    u64 rate[INTERRUPT_LINES];
 };
 
 
@@ -54,6 +90,7 @@ bool assign_reader_number(
         {
             // reset events for new readers
             atomic_set(&interrupts->events[bit], 0);
+            atomic64_set(&interrupts->event_time[bit], 0);
             *reader_number = bit;
             return true;
         }
@@ -94,33 +131,121 @@ int read_interrupt_events(
 }
 
 
+u64 read_interrupt_event_time(struct interrupt_control *control, int reader)
+{
+    return (u64) atomic64_xchg(&control->event_time[reader], 0);
+}
+
+
 wait_queue_head_t *interrupts_wait_queue(struct interrupt_control *control)
 {
     return &control->wait_queue;
 }
 
 
+void add_event_trigger(
+    struct interrupt_control *control, struct event_trigger *trigger)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&control->triggers_lock, flags);
+    list_add_tail(&trigger->list, &control->triggers);
+    spin_unlock_irqrestore(&control->triggers_lock, flags);
+}
+
+
+void remove_event_trigger(
+    struct interrupt_control *control, struct event_trigger *trigger)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&control->triggers_lock, flags);
+    list_del_init(&trigger->list);
+    spin_unlock_irqrestore(&control->triggers_lock, flags);
+}
+
+
+/* Calls all triggers interested in the given events. */
+static void fire_triggers(
+    struct interrupt_control *control, uint32_t events, ktime_t timestamp)
+{
+    spin_lock(&control->triggers_lock);
+    struct event_trigger *trigger;
+    list_for_each_entry(trigger, &control->triggers, list)
+        if (trigger->mask & events)
+            trigger->fire(trigger, events, timestamp);
+    spin_unlock(&control->triggers_lock);
+}
+
+
 /* Stores user space interrupt events and notifies as appropriate. */
-static void event_interrupt(struct interrupt_control *control, uint32_t events)
+static void event_interrupt(
+    struct interrupt_control *control, struct interrupt_stats *stats,
+    uint32_t events, ktime_t timestamp)
 {
-    /* Add the new events into the current event masks. */
+    /* Add the new events into the current event masks, counting any events
+     * which an active reader has not yet seen.  The time is only recorded if
+     * the reader has collected the time of its previous events. */
     for (int reader = 0; reader < N_EVENT_READERS; reader++)
-         atomic_or(events, &control->events[reader]);
+    {
+        atomic64_cmpxchg(
+            &control->event_time[reader], 0, ktime_to_ns(timestamp));
+        unsigned long merged = (unsigned int) atomic_fetch_or(
+            events, &control->events[reader]) & events;
+        if (merged  &&  test_bit(reader, &control->active_readers))
+        {
+            unsigned int bit;
+            for_each_set_bit(bit, &merged, INTERRUPT_LINES - 1)
+                stats->merged[bit + 1] += 1;
+        }
+    }
     /* Let any listeners know. */
     wake_up_all(&control->wait_queue);
 }
 
 
+/* Hands user events on to the triggers and readers. */
+static void user_interrupt(
+    struct interrupt_control *control, struct interrupt_stats *stats,
+    uint32_t events, ktime_t timestamp)
+{
+    fire_triggers(control, events, timestamp);
+    event_interrupt(control, stats, events, timestamp);
+}
+
+
+void inject_interrupt_events(struct interrupt_control *control, uint32_t events)
+{
+    /* Interrupts are disabled so that we look just like the interrupt handler
+     * to the triggers and the statistics. */
+    unsigned long flags;
+    local_irq_save(flags);
+    user_interrupt(control, this_cpu_ptr(control->stats), events, ktime_get());
+    local_irq_restore(flags);
+}
+
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 static irqreturn_t amc_pci_isr(int ireq, void *context)
 {
     struct interrupt_control *control = context;
     struct axi_interrupt_controller *intc = control->intc;
+    ktime_t timestamp = ktime_get();
 
     /* Ask the interrupt controller for the active interrupts and acknowlege the
      * ones we've seen. */
     uint32_t isr = readl(&intc->isr);
+    /* If the link has gone down all reads return ones, and there is nothing we
+     * can usefully do here until error recovery has run. */
+    if (isr == 0xFFFFFFFF)
+        return IRQ_NONE;
+
+    struct interrupt_stats *stats = this_cpu_ptr(control->stats);
+    if (isr == 0)
+        stats->spurious += 1;
+    unsigned long lines = isr;
+    unsigned int line;
+    for_each_set_bit(line, &lines, INTERRUPT_LINES)
+        stats->count[line] += 1;
 
     /* Interrupt number 1 belongs to the DMA engine. */
     if (isr & 1  &&  control->dma)
@@ -129,7 +254,7 @@ static irqreturn_t amc_pci_isr(int ireq, void *context)
     /* The remaining interrupts are handed on to the event source. */
     uint32_t user_isr = isr >> 1;
     if (user_isr)
-        event_interrupt(control, user_isr);
+        user_interrupt(control, stats, user_isr, timestamp);
 
     /* because the DMA interrupt is level-triggered, we need to do this
      * after the interrupt condition is cleared in the DMA, otherwise, we
@@ -140,10 +265,111 @@ static irqreturn_t amc_pci_isr(int ireq, void *context)
 }
 
 
-int initialise_interrupt_control(
-    struct pci_dev *pdev, void __iomem *regs,
-    struct dma_control *dma,
-    struct interrupt_control **pcontrol)
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Statistics. */
+
+
+/* Sums the per CPU counts.  The counts are not updated atomically, but as each
+ * is only written by its own CPU the worst we can see is a stale value. */
+static void sum_stats(
+    struct interrupt_control *control, struct interrupt_stats *total)
+{
+    memset(total, 0, sizeof(struct interrupt_stats));
+    int cpu;
+    for_each_possible_cpu(cpu)
+    {
+        struct interrupt_stats *stats = per_cpu_ptr(control->stats, cpu);
+        for (int line = 0; line < INTERRUPT_LINES; line ++)
+        {
+            total->count[line] += READ_ONCE(stats->count[line]);
+            total->merged[line] += READ_ONCE(stats->merged[line]);
+        }
+        total->spurious += READ_ONCE(stats->spurious);
+    }
+}
+
+
+static void rate_work(struct work_struct *work)
+{
+    struct interrupt_control *control = container_of(
+        to_delayed_work(work), struct interrupt_control, rate_work);
+    struct interrupt_stats total;
+    sum_stats(control, &total);
+
+    mutex_lock(&control->rate_lock);
+    for (int line = 0; line < INTERRUPT_LINES; line ++)
+    {
+        u64 delta = total.count[line] - control->last_count[line];
+        control->last_count[line] = total.count[line];
+        control->rate[line] = (
+            control->rate[line] * RATE_DECAY +
+            delta * (RATE_ONE - RATE_DECAY) * RATE_ONE) >> RATE_SHIFT;
+    }
+    mutex_unlock(&control->rate_lock);
+
+    schedule_delayed_work(&control->rate_work, HZ);
+}
+
+
+static int interrupt_stats_show(struct seq_file *m, void *v)
+{
+    struct interrupt_control *control = m->private;
+    struct interrupt_stats total;
+    sum_stats(control, &total);
+
+    seq_printf(m, "%-6s %16s %16s %12s\n", "line", "count", "merged", "rate");
+    mutex_lock(&control->rate_lock);
+    for (int line = 0; line < INTERRUPT_LINES; line ++)
+    {
+        u64 rate = control->rate[line];
+        char name[8];
+        if (line == 0)
+            strscpy(name, "dma", sizeof(name));
+        else
+            snprintf(name, sizeof(name), "%d", line - 1);
+        seq_printf(m, "%-6s %16llu %16llu %9llu.%02llu\n",
+            name, total.count[line], total.merged[line],
+            rate >> RATE_SHIFT,
+            ((rate & (RATE_ONE - 1)) * 100) >> RATE_SHIFT);
+    }
+    mutex_unlock(&control->rate_lock);
+    seq_printf(m, "spurious %llu\n", total.spurious);
+    return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(interrupt_stats);
+
+
+void interrupt_stats_debugfs(
+    struct interrupt_control *control, struct dentry *dir)
+{
+    debugfs_create_file(
+        "interrupts", S_IRUGO, dir, control, &interrupt_stats_fops);
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+/* Start with the interrupt controller disabled while we internally enable
+ * everything and clear any acknowleges. */
+static void reset_controller(struct axi_interrupt_controller __iomem *intc)
+{
+    writel(0, &intc->mer);              // Disable controller
+    writel(0xFFFFFFFF, &intc->iar);     // Ensure no pending interrupts
+    writel(0xFFFFFFFF, &intc->ier);     // Enable all interrupts
+}
+
+
+/* Put the controller in normal operating mode. */
+static void start_controller(struct axi_interrupt_controller __iomem *intc)
+{
+    writel(3, &intc->mer);              // Enable controller
+}
+
+
+struct interrupt_control *create_interrupt_control(
+    void __iomem *regs, struct dma_control *dma)
 {
     int rc = 0;
 
@@ -155,28 +381,53 @@ int initialise_interrupt_control(
         .intc = regs,
         .dma = dma
     };
-    *pcontrol = control;
     init_waitqueue_head(&control->wait_queue);
+    spin_lock_init(&control->triggers_lock);
+    INIT_LIST_HEAD(&control->triggers);
+    mutex_init(&control->rate_lock);
+    INIT_DELAYED_WORK(&control->rate_work, rate_work);
+    control->stats = alloc_percpu(struct interrupt_stats);
+    TEST_PTR(control->stats, rc, no_stats, "Unable to allocate statistics");
+    return control;
+
+no_stats:
+    kfree(control);
+no_memory:
+    return ERR_PTR(rc);
+}
 
-    /* Start with the interrupt controller disabled while we internally enable
-     * everything and clear any acknowleges. */
-    struct axi_interrupt_controller *intc = control->intc;
-    writel(0, &intc->mer);              // Disable controller
-    writel(0xFFFFFFFF, &intc->iar);     // Ensure no pending interrupts
-    writel(0xFFFFFFFF, &intc->ier);     // Enable all interrupts
 
+void destroy_interrupt_control(struct interrupt_control *control)
+{
+    cancel_delayed_work_sync(&control->rate_work);
+    free_percpu(control->stats);
+    kfree(control);
+}
+
+
+int initialise_interrupt_control(
+    struct pci_dev *pdev, void __iomem *regs,
+    struct dma_control *dma,
+    struct interrupt_control **pcontrol)
+{
+    int rc = 0;
+
+    struct interrupt_control *control = create_interrupt_control(regs, dma);
+    TEST_PTR(control, rc, no_control, "Unable to create interrupt control");
+    *pcontrol = control;
+
+    reset_controller(control->intc);
     rc = request_irq(pdev->irq, amc_pci_isr, 0, CLASS_NAME, control);
     TEST_RC(rc, no_irq, "Unable to request irq");
-
-    /* Put the controller in normal operating mode. */
-    writel(3, &intc->mer);              // Enable controller
+    start_controller(control->intc);
+    schedule_delayed_work(&control->rate_work, HZ);
 
     return 0;
 
     free_irq(pdev->irq, control);
 no_irq:
-    kfree(control);
-no_memory:
+    destroy_interrupt_control(control);
+no_control:
     return rc;
 }
 
@@ -187,5 +438,23 @@ void terminate_interrupt_control(
     struct axi_interrupt_controller *intc = control->intc;
     writel(0, &intc->mer);              // Disable controller
     free_irq(pdev->irq, control);
-    kfree(control);
+    destroy_interrupt_control(control);
+}
+
+
+void quiesce_interrupt_control(
+    struct pci_dev *pdev, struct interrupt_control *control)
+{
+    writel(0, &control->intc->mer);     // Disable controller
+    synchronize_irq(pdev->irq);
+    control->dma = NULL;
+}
+
+
+void restart_interrupt_control(
+    struct interrupt_control *control, struct dma_control *dma)
+{
+    control->dma = dma;
+    reset_controller(control->intc);
+    start_controller(control->intc);
 }
@@ -4,6 +4,21 @@
 
 struct interrupt_control;
 struct dma_control;
+struct dentry;
+
+/* An event trigger is called directly from the interrupt handler when any of
+ * the events in mask are seen, together with the time of the interrupt. */
+struct event_trigger {
+    struct list_head list;
+    uint32_t mask;
+    void (*fire)(
+        struct event_trigger *trigger, uint32_t events, ktime_t timestamp);
+};
+
+void add_event_trigger(
+    struct interrupt_control *control, struct event_trigger *trigger);
+void remove_event_trigger(
+    struct interrupt_control *control, struct event_trigger *trigger);
 
 bool assign_reader_number(
     struct interrupt_control *interrupts, int *reader_number);
@@ -11,6 +26,12 @@ bool assign_reader_number(
 void unassign_reader_number(struct interrupt_control *interrupts,
     int reader_number);
 
+/* Creates and destroys the interrupt state without touching the hardware.
+ * These are used by the functions below and by the benchmarks. */
+struct interrupt_control *create_interrupt_control(
+    void __iomem *regs, struct dma_control *dma);
+void destroy_interrupt_control(struct interrupt_control *control);
+
 int initialise_interrupt_control(
     struct pci_dev *pdev, void __iomem *regs,
     struct dma_control *dma,
@@ -19,6 +40,21 @@ int initialise_interrupt_control(
 void terminate_interrupt_control(
     struct pci_dev *pdev, struct interrupt_control *control);
 
+/* Used across an FPGA reload: the controller is disabled and the interrupt
+ * handler synchronised, and then the controller is restarted with the new DMA
+ * controller.  Readers and triggers are preserved. */
+void quiesce_interrupt_control(
+    struct pci_dev *pdev, struct interrupt_control *control);
+void restart_interrupt_control(
+    struct interrupt_control *control, struct dma_control *dma);
+
+/* Creates a debugfs file in dir reporting, for each interrupt line, the number
+ * of interrupts seen, the number of events merged because a reader had not yet
+ * collected the previous event, and the recent rate in interrupts per second,
+ * together with the number of spurious interrupts. */
+void interrupt_stats_debugfs(
+    struct interrupt_control *control, struct dentry *dir);
+
 /* Blocks until non zero event mask can be returned. */
 int read_interrupt_events(
     struct interrupt_control *control, bool no_wait, uint32_t *events,
@@ -27,5 +63,15 @@ int read_interrupt_events(
 /* Checks if a non zero event mask is available to read. */
 bool interrupt_events_ready(struct interrupt_control *control, int reader);
 
+/* Returns the CLOCK_MONOTONIC time in ns of the interrupt which delivered the
+ * first of the events returned by the last read, or 0 if this is not known.
+ * This must be called after read_interrupt_events() and clears the time. */
+u64 read_interrupt_event_time(struct interrupt_control *control, int reader);
+
+/* Delivers events to the readers and triggers as if they had been raised by
+ * the interrupt controller. */
+void inject_interrupt_events(
+    struct interrupt_control *control, uint32_t events);
+
 /* Returns wait queue for interrupt status updates. */
 wait_queue_head_t *interrupts_wait_queue(struct interrupt_control *control);
@@ -4,12 +4,29 @@
 #include <linux/slab.h>
 #include <linux/uaccess.h>
 #include <linux/fs.h>
+#include <linux/file.h>
 #include <linux/pci.h>
+#include <linux/poll.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/sched/rt.h>
+#include <linux/capability.h>
+#if __has_include(<linux/crc32c.h>)
+#include <linux/crc32c.h>
+#else
+#include <linux/crc32.h>
+#endif
 
 #include "error.h"
 #include "amc_pci_core.h"
 #include "amc_pci_device.h"
 #include "dma_control.h"
+#include "dma_cache.h"
+#include "dmabuf.h"
+#include "stream.h"
+#include "capture.h"
+#include "capture_group.h"
+#include "memory_map.h"
 
 #include "memory.h"
 
@@ -22,14 +39,42 @@
 
 
 struct memory_context {
+    struct amc_pci_handle handle;   // Revoked on FPGA reload
     struct dma_control *dma;        // DMA controller
     size_t base;
     size_t length;
+    enum dma_completion_mode completion_mode;
+    enum dma_priority priority;     // Scheduling class for DMA
+    void __iomem *write_pointer;    // Set if area supports streaming
+    struct memory_stream *stream;   // Set when streaming
+    struct interrupt_control *interrupts;
+    spinlock_t capture_lock;        // Protects capture for readers
+    struct event_capture *capture;  // Set when capture armed
+    struct dma_cache *cache;        // Set if area is cacheable
+    struct memory_map *map;         // Set once the area has been mapped
+    bool checksum;                  // Compute CRC32C of data read
+    u32 last_checksum;              // CRC32C of last read
 };
 
 
+/* Called on FPGA reload to stop any DMA running in the background. */
+static void revoke_memory(struct amc_pci_handle *handle)
+{
+    struct memory_context *context =
+        container_of(handle, struct memory_context, handle);
+    if (context->stream)
+        stream_revoke(context->stream);
+    if (context->capture)
+        revoke_event_capture(context->capture);
+    if (context->map)
+        memory_map_invalidate(context->map, 0, context->length);
+}
+
+
 int amc_pci_dma_open(
-    struct file *file, struct dma_control *dma, size_t base, size_t length)
+    struct file *file, struct dma_control *dma,
+    struct interrupt_control *interrupts, size_t base, size_t length,
+    void __iomem *write_pointer, struct dma_cache *cache)
 {
     int rc = 0;
     struct memory_context *context =
@@ -40,7 +85,15 @@ int amc_pci_dma_open(
         .dma = dma,
         .base = base,
         .length = length,
+        .completion_mode = DMA_COMPLETION_AUTO,
+        .priority = rt_task(current) ?
+            DMA_PRIORITY_RT : DMA_PRIORITY_NORMAL,
+        .write_pointer = write_pointer,
+        .interrupts = interrupts,
+        .cache = cache,
     };
+    spin_lock_init(&context->capture_lock);
+    amc_pci_add_handle(file, &context->handle, revoke_memory);
 
     file->private_data = context;
     return 0;
@@ -52,16 +105,171 @@ no_context:
 
 static int amc_pci_dma_release(struct inode *inode, struct file *file)
 {
-    kfree(file->private_data);
+    struct memory_context *context = file->private_data;
+
+    /* Hold off any reload while background DMA is stopped. */
+    bool live = amc_pci_enter(&context->handle) == 0;
+    amc_pci_remove_handle(&context->handle);
+    if (context->stream)
+        stream_stop(context->stream);
+    if (context->capture)
+        release_event_capture(context->capture);
+    if (live)
+        amc_pci_leave(&context->handle);
+
+    if (context->map)
+        destroy_memory_map(context->map);
+    kfree(context);
     amc_pci_release(inode);
     return 0;
 }
 
 
-static ssize_t amc_pci_dma_write(
+/* Large writes are pipelined through the two halves of the DMA buffer, so that
+ * the copy from user space of each chunk overlaps the DMA of the previous
+ * chunk.  Unaligned heads and tails are handled by first reading back the
+ * enclosing aligned blocks so that neighbouring data is preserved. */
+
+struct write_pipeline {
+    const char __user *buf;         // Source of user data
+    size_t start;                   // FPGA range written by user
+    size_t end;
+    size_t span_start;              // Aligned FPGA range transferred
+    size_t span_end;
+    void *head_block;               // Existing data for partial blocks
+    void *tail_block;
+};
+
+
+static int read_partial_block(
+    struct dma_control *dma, size_t start, void *block)
+{
+    size_t alignment = dma_get_alignment(dma);
+    ssize_t rc = dma_operation_unlocked(dma, start, alignment, DMA_FROM_DEVICE);
+    if (rc < 0)
+        return rc;
+    memcpy(block, dma_get_buffer(dma), alignment);
+    return 0;
+}
+
+
+/* Fills buffer with the data to be written to [chunk_start, chunk_end). */
+static int prepare_chunk(
+    struct write_pipeline *pipe, size_t alignment, void *buffer,
+    size_t chunk_start, size_t chunk_end)
+{
+    if (pipe->head_block  &&  chunk_start == pipe->span_start)
+        memcpy(buffer, pipe->head_block, alignment);
+    if (pipe->tail_block  &&  chunk_end == pipe->span_end)
+        memcpy(buffer + (chunk_end - chunk_start) - alignment,
+            pipe->tail_block, alignment);
+
+    size_t from = max(chunk_start, pipe->start);
+    size_t to = min(chunk_end, pipe->end);
+    if (copy_from_user(
+            buffer + (from - chunk_start), pipe->buf + (from - pipe->start),
+            to - from))
+        return -EFAULT;
+    return 0;
+}
+
+
+/* Waits for the chunk in flight, if any, to complete. */
+static int finish_write_chunk(
+    struct dma_control *dma, size_t *in_flight, size_t *done)
+{
+    int rc = 0;
+    if (*in_flight)
+    {
+        rc = dma_wait_transfer_unlocked(dma);
+        if (rc == 0)
+            *done = *in_flight;
+        *in_flight = 0;
+    }
+    return rc;
+}
+
+
+/* Holds the DMA engine for the write.  Returns the FPGA address up to which
+ * data has been successfully written, or an error code if nothing has been
+ * written. */
+static ssize_t run_write_pipeline(
+    struct dma_control *dma, enum dma_priority priority,
+    enum dma_completion_mode mode, struct write_pipeline *pipe)
+{
+    size_t alignment = dma_get_alignment(dma);
+    size_t chunk_size = ALIGN_DOWN(
+        min(dma_buffer_size(dma) / 2, dma_max_transfer(dma)), alignment);
+    void *buffer = dma_get_buffer(dma);
+
+    int rc = dma_memory_lock(dma, priority);
+    if (rc < 0)
+        return rc;
+    dma_set_completion_mode(dma, mode);
+    if (pipe->head_block)
+        rc = read_partial_block(dma, pipe->span_start, pipe->head_block);
+    if (rc == 0  &&  pipe->tail_block)
+        rc = read_partial_block(
+            dma, pipe->span_end - alignment, pipe->tail_block);
+
+    size_t done = pipe->span_start;     // Data written up to here
+    size_t in_flight = 0;               // End of transfer in progress
+    size_t offset = 0;                  // Offset of chunk in DMA buffer
+    for (size_t chunk_start = pipe->span_start;
+         rc == 0  &&  chunk_start < pipe->span_end;
+         chunk_start += chunk_size)
+    {
+        size_t chunk_end = min(chunk_start + chunk_size, pipe->span_end);
+
+        /* Give way to higher priority users between chunks.  The pipeline has
+         * to be drained first, as the DMA buffer will be reused. */
+        if (dma_memory_should_yield(dma))
+        {
+            rc = finish_write_chunk(dma, &in_flight, &done);
+            if (rc < 0)
+                break;
+            rc = dma_memory_yield(dma);
+            if (rc < 0)
+                /* Killed while waiting, so the engine is no longer held. */
+                return done > pipe->start ? done : rc;
+        }
+
+        rc = prepare_chunk(
+            pipe, alignment, buffer + offset, chunk_start, chunk_end);
+
+        /* Only now wait for the previous chunk to complete. */
+        int wait_rc = finish_write_chunk(dma, &in_flight, &done);
+        if (wait_rc < 0)
+            rc = wait_rc;
+
+        if (rc == 0)
+        {
+            ssize_t count = dma_start_buffer_unlocked(
+                dma, chunk_start, offset, chunk_end - chunk_start,
+                DMA_TO_DEVICE);
+            if (count < 0)
+                rc = count;
+            else
+                in_flight = chunk_start + count;
+        }
+        offset = offset ? 0 : chunk_size;
+    }
+
+    int wait_rc = finish_write_chunk(dma, &in_flight, &done);
+    if (wait_rc < 0)
+        rc = wait_rc;
+    dma_memory_unlock(dma);
+
+    if (done > pipe->start)
+        return done;
+    else
+        return rc;
+}
+
+
+static ssize_t write_memory(
     struct file *file, const char __user *buf, size_t count, loff_t *f_pos)
 {
-    ssize_t rc = 0;
     struct memory_context *context = file->private_data;
     /* Constrain write to valid region. */
     loff_t offset = *f_pos;
@@ -70,40 +278,128 @@ static ssize_t amc_pci_dma_write(
     else if (offset > context->length)
         /* Treat seeks off end of memory block as an error. */
         return -EFAULT;
-    if (count > context->length - offset ||
-            count > dma_buffer_size(context->dma))
-        /* Can't write more than the remaining memory or DMA buffer. */
+    if (count > context->length - offset)
+        /* Can't write more than the remaining memory. */
+        return -EINVAL;
+    if (count == 0)
+        return 0;
+
+    size_t alignment = dma_get_alignment(context->dma);
+    struct write_pipeline pipe = {
+        .buf = buf,
+        .start = context->base + offset,
+        .end = context->base + offset + count,
+    };
+    pipe.span_start = ALIGN_DOWN(pipe.start, alignment);
+    pipe.span_end = ALIGN(pipe.end, alignment);
+    if (pipe.span_end > context->base + context->length)
+        /* Can't write the tail without violating alignment. */
         return -EINVAL;
 
+    void *partial = NULL;
+    if (!IS_ALIGNED(pipe.start, alignment)  ||
+        !IS_ALIGNED(pipe.end, alignment))
+    {
+        partial = kmalloc(2 * alignment, GFP_KERNEL);
+        if (!partial)
+            return -ENOMEM;
+        if (!IS_ALIGNED(pipe.start, alignment))
+            pipe.head_block = partial;
+        if (!IS_ALIGNED(pipe.end, alignment))
+            pipe.tail_block = partial + alignment;
+    }
 
-    void *data_buffer = dma_get_buffer(context->dma);
-    ssize_t write_count = count;
     /* Lock, transfer from user space, write data, unlock. */
-    dma_memory_lock(context->dma);
-    write_count -= copy_from_user(data_buffer, buf, count);
-    TEST_OK(write_count > 0, rc = -EFAULT, mem_err, "Failed to copy data");
-    /* Misaligned writes will fail in the following function call */
-    ssize_t dma_write_count = dma_operation_unlocked(
-        context->dma, context->base + offset, count, DMA_TO_DEVICE);
-    TEST_OK(dma_write_count > 0, rc = dma_write_count, mem_err, "DMA failed");
-    dma_memory_unlock(context->dma);
+    ssize_t rc = run_write_pipeline(
+        context->dma, context->priority, context->completion_mode, &pipe);
+    kfree(partial);
+    if (context->cache)
+        dma_cache_invalidate(context->cache, offset, count);
+    if (context->map)
+        memory_map_invalidate(context->map, offset, count);
 
-    *f_pos += dma_write_count;
+    if (rc < 0)
+        return rc;
+    ssize_t write_count = min((size_t) rc, pipe.end) - pipe.start;
+    *f_pos += write_count;
     if (*f_pos >= context->length)
         *f_pos = 0;
+    return write_count;
+}
 
-    return dma_write_count;
-mem_err:
-    dma_memory_unlock(context->dma);
+
+static ssize_t amc_pci_dma_write(
+    struct file *file, const char __user *buf, size_t count, loff_t *f_pos)
+{
+    struct memory_context *context = file->private_data;
+    ssize_t rc = amc_pci_enter(&context->handle);
+    if (rc == 0)
+    {
+        rc = write_memory(file, buf, count, f_pos);
+        amc_pci_leave(&context->handle);
+    }
     return rc;
 }
 
 
-static ssize_t amc_pci_dma_read(
+/* Data is checksummed in pieces small enough to still be in the L1 cache when
+ * copied to user space, so that the checksum costs no extra pass through
+ * memory. */
+#define CHECKSUM_PIECE      4096
+
+/* Returns number of bytes not copied, as for copy_to_user. */
+static size_t copy_with_checksum(
+    struct memory_context *context, char __user *buf, const void *data,
+    size_t count)
+{
+    if (!context->checksum)
+        return copy_to_user(buf, data, count);
+
+    u32 crc = ~0U;
+    for (size_t done = 0; done < count; )
+    {
+        size_t length = min(count - done, (size_t) CHECKSUM_PIECE);
+        crc = crc32c(crc, data + done, length);
+        size_t failed = copy_to_user(buf + done, data + done, length);
+        if (failed)
+            return count - done - (length - failed);
+        done += length;
+    }
+    context->last_checksum = ~crc;
+    return 0;
+}
+
+
+/* Serves a read from the cache, returning -ENOSPC if the cache is full. */
+static ssize_t read_cached(
+    struct memory_context *context, char __user *buf, size_t count,
+    loff_t offset)
+{
+    size_t length;
+    const void *data = dma_cache_get(
+        context->cache, context->priority, offset, &length);
+    if (IS_ERR(data))
+        return PTR_ERR(data);
+
+    ssize_t rc = -EFAULT;
+    if (length > 0)
+    {
+        size_t user_count = min(count, length);
+        user_count -= copy_with_checksum(context, buf, data, user_count);
+        if (user_count > 0)
+            rc = user_count;
+    }
+    dma_cache_put(context->cache);
+    return rc;
+}
+
+
+static ssize_t read_memory(
     struct file *file, char __user *buf, size_t count, loff_t *f_pos)
 {
     ssize_t rc = 0;
     struct memory_context *context = file->private_data;
+
     /* Constrain read to valid region. */
     loff_t offset = *f_pos;
     if (offset == context->length)
@@ -112,6 +408,22 @@ static ssize_t amc_pci_dma_read(
         /* Treat seeks off end of memory block as an error. */
         return -EFAULT;
 
+    if (context->cache)
+    {
+        rc = read_cached(context, buf, count, offset);
+        if (rc != -ENOSPC)
+        {
+            if (rc > 0)
+            {
+                *f_pos += rc;
+                if (*f_pos >= context->length)
+                    *f_pos = 0;
+            }
+            return rc;
+        }
+        rc = 0;
+    }
+
     void *data_buffer = dma_get_buffer(context->dma);
     size_t alignment = dma_get_alignment(context->dma);
     size_t in_offset = offset & (alignment - 1);
@@ -124,13 +436,16 @@ static ssize_t amc_pci_dma_read(
         /* Can't read anything without violating alignment. */
         return -EFAULT;
 
-    /* Lock, read the data, transfer it to user space, unlock. */
-    dma_memory_lock(context->dma);
-    ssize_t dma_read_count = dma_operation_unlocked(
-        context->dma, dma_addr, dma_count, DMA_FROM_DEVICE);
-    TEST_OK(dma_read_count > 0, rc = dma_read_count, mem_err, "DMA failed");
+    /* Lock and read the data, possibly as part of a transfer shared with
+     * other readers, then transfer it to user space and unlock. */
+    size_t buffer_offset;
+    ssize_t dma_read_count = dma_read_shared(
+        context->dma, context->priority, context->completion_mode,
+        dma_addr, dma_count, &buffer_offset);
+    TEST_OK(dma_read_count > 0, rc = dma_read_count, no_dma, "DMA failed");
     ssize_t user_count = min(count, dma_read_count - in_offset);
-    user_count -= copy_to_user(buf, data_buffer + in_offset, user_count);
+    user_count -= copy_with_checksum(
+        context, buf, data_buffer + buffer_offset + in_offset, user_count);
     TEST_OK(user_count > 0, rc = -EFAULT, mem_err, "Failed to copy data");
     dma_memory_unlock(context->dma);
     *f_pos += user_count;
@@ -140,6 +455,233 @@ static ssize_t amc_pci_dma_read(
     return user_count;
 mem_err:
     dma_memory_unlock(context->dma);
+no_dma:
+    return rc;
+}
+
+
+static ssize_t amc_pci_dma_read(
+    struct file *file, char __user *buf, size_t count, loff_t *f_pos)
+{
+    struct memory_context *context = file->private_data;
+    /* Streams only wait for data here, and report revocation themselves. */
+    if (context->stream)
+        return stream_read(
+            context->stream, buf, count, file->f_flags & O_NONBLOCK);
+
+    ssize_t rc = amc_pci_enter(&context->handle);
+    if (rc == 0)
+    {
+        rc = read_memory(file, buf, count, f_pos);
+        amc_pci_leave(&context->handle);
+    }
+    return rc;
+}
+
+
+static unsigned int amc_pci_dma_poll(
+    struct file *file, struct poll_table_struct *poll)
+{
+    struct memory_context *context = file->private_data;
+    if (context->stream)
+        return stream_poll(context->stream, file, poll);
+    else if (amc_pci_revoked(&context->handle))
+        return POLLERR;
+    else
+        return POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM;
+}
+
+
+/* Splicing DMAs directly into freshly allocated pages which are then handed
+ * over to the pipe, so the data is never copied by the CPU.  The pages are
+ * allocated as one block to keep the DMA to a single transfer, and then split
+ * so that the pipe can release them individually. */
+
+static const struct pipe_buf_operations splice_pipe_buf_ops = {
+    .release = generic_pipe_buf_release,
+    .get = generic_pipe_buf_get,
+};
+
+
+static struct page *allocate_splice_pages(size_t *size)
+{
+    for (int order = get_order(*size); order >= 0; order --)
+    {
+        struct page *pages =
+            alloc_pages(GFP_KERNEL | __GFP_NOWARN | __GFP_NORETRY, order);
+        if (pages)
+        {
+            /* Only the pages covering size are used and freed by the
+             * caller, so the rest of the allocation goes straight back. */
+            split_page(pages, order);
+            *size = min(*size, PAGE_SIZE << order);
+            for (size_t i = DIV_ROUND_UP(*size, PAGE_SIZE);
+                 i < (1ul << order); i ++)
+                __free_page(pages + i);
+            return pages;
+        }
+    }
+    return NULL;
+}
+
+
+static ssize_t dma_into_pages(
+    struct memory_context *context, struct page *pages, size_t dma_addr,
+    size_t dma_count)
+{
+    struct device *dev = dma_get_device(context->dma);
+    dma_addr_t pages_dma =
+        dma_map_page(dev, pages, 0, dma_count, DMA_FROM_DEVICE);
+    if (dma_mapping_error(dev, pages_dma))
+        return -EIO;
+
+    ssize_t rc = dma_memory_lock(context->dma, context->priority);
+    if (rc < 0)
+        goto no_lock;
+    dma_set_completion_mode(context->dma, context->completion_mode);
+    for (size_t done = 0; done < dma_count; )
+    {
+        rc = dma_transfer_unlocked(
+            context->dma, dma_addr + done, pages_dma + done,
+            dma_count - done, DMA_FROM_DEVICE);
+        if (rc <= 0)
+        {
+            rc = rc ?: -EIO;
+            break;
+        }
+        done += rc;
+        rc = dma_memory_yield(context->dma);
+        if (rc < 0)
+            goto no_lock;
+    }
+    dma_memory_unlock(context->dma);
+
+no_lock:
+    dma_unmap_page(dev, pages_dma, dma_count, DMA_FROM_DEVICE);
+    return rc < 0 ? rc : dma_count;
+}
+
+
+static ssize_t splice_memory(
+    struct file *file, loff_t *ppos, struct pipe_inode_info *pipe,
+    size_t len, unsigned int flags)
+{
+    struct memory_context *context = file->private_data;
+    if (context->stream)
+        return -EINVAL;
+
+    loff_t offset = *ppos;
+    if (offset == context->length)
+        return 0;
+    else if (offset > context->length)
+        return -EFAULT;
+
+    /* Only fill as many pages as the pipe has room for. */
+    unsigned int slots =
+        pipe->max_usage - pipe_occupancy(pipe->head, pipe->tail);
+    if (slots == 0)
+        return -EAGAIN;
+
+    size_t alignment = dma_get_alignment(context->dma);
+    size_t in_offset = offset & (alignment - 1);
+    size_t dma_addr = context->base + offset - in_offset;
+    size_t dma_count = min3(
+        ALIGN(len + in_offset, alignment),
+        (size_t) slots * PAGE_SIZE, dma_buffer_size(context->dma));
+    dma_count = ALIGN_DOWN(
+        min(dma_count, context->base + context->length - dma_addr),
+        alignment);
+    if (dma_count <= in_offset)
+        return -EFAULT;
+
+    struct page *pages = allocate_splice_pages(&dma_count);
+    if (!pages)
+        return -ENOMEM;
+    unsigned int npages = DIV_ROUND_UP(dma_count, PAGE_SIZE);
+
+    ssize_t rc = dma_into_pages(context, pages, dma_addr, dma_count);
+    size_t count = min(len, dma_count - in_offset);
+    if (rc > 0  &&  context->checksum)
+        context->last_checksum =
+            ~crc32c(~0U, page_address(pages) + in_offset, count);
+
+    /* Hand pages to the pipe, add_to_pipe releases any it can't take. */
+    unsigned int page = 0;
+    size_t spliced = 0;
+    for (; rc > 0  &&  page < npages  &&  spliced < count; page ++)
+    {
+        size_t page_offset = page == 0 ? in_offset : 0;
+        struct pipe_buffer buf = {
+            .page = pages + page,
+            .offset = page_offset,
+            .len = min(PAGE_SIZE - page_offset, count - spliced),
+            .ops = &splice_pipe_buf_ops,
+        };
+        rc = add_to_pipe(pipe, &buf);
+        if (rc > 0)
+            spliced += rc;
+    }
+    for (; page < npages; page ++)
+        __free_page(pages + page);
+
+    if (spliced > 0)
+    {
+        *ppos += spliced;
+        if (*ppos >= context->length)
+            *ppos = 0;
+        return spliced;
+    }
+    else
+        return rc;
+}
+
+
+static ssize_t amc_pci_dma_splice_read(
+    struct file *file, loff_t *ppos, struct pipe_inode_info *pipe,
+    size_t len, unsigned int flags)
+{
+    struct memory_context *context = file->private_data;
+    ssize_t rc = amc_pci_enter(&context->handle);
+    if (rc == 0)
+    {
+        rc = splice_memory(file, ppos, pipe, len, flags);
+        amc_pci_leave(&context->handle);
+    }
+    return rc;
+}
+
+
+/* Only the first mapping creates the page store, which is then shared by all
+ * mappings through this file handle. */
+static int map_memory(struct file *file, struct vm_area_struct *vma)
+{
+    struct memory_context *context = file->private_data;
+    if (!(file->f_mode & FMODE_READ))
+        return -EACCES;
+
+    if (!context->map)
+    {
+        struct memory_map *map = create_memory_map(
+            &context->handle, context->dma, context->priority,
+            context->base, context->length);
+        if (IS_ERR(map))
+            return PTR_ERR(map);
+        if (cmpxchg(&context->map, NULL, map))
+            destroy_memory_map(map);
+    }
+    return memory_map_mmap(context->map, vma);
+}
+
+
+static int amc_pci_dma_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct memory_context *context = file->private_data;
+    int rc = amc_pci_enter(&context->handle);
+    if (rc == 0)
+    {
+        rc = map_memory(file, vma);
+        amc_pci_leave(&context->handle);
+    }
     return rc;
 }
 
@@ -152,7 +694,421 @@ static loff_t amc_pci_dma_llseek(struct file *file, loff_t f_pos, int whence)
 }
 
 
-static long amc_pci_mem_ioctl(
+static long export_dmabuf(
+    struct file *file, struct memory_context *context,
+    const void __user *arg)
+{
+    struct amc_dma_export export;
+    if (copy_from_user(&export, arg, sizeof(export)))
+        return -EFAULT;
+    if (!(file->f_mode & FMODE_READ))
+        return -EACCES;
+    if (export.reserved != 0  ||
+        export.offset > context->length  ||
+        export.length > context->length - export.offset)
+        return -EINVAL;
+    return amc_pci_export_dmabuf(
+        context->dma, context->base + export.offset, export.length,
+        export.flags, context->priority);
+}
+
+
+static long invalidate_map(
+    struct memory_context *context, const void __user *arg)
+{
+    struct amc_dma_range range;
+    if (copy_from_user(&range, arg, sizeof(range)))
+        return -EFAULT;
+    if (range.offset > context->length  ||
+        range.length > context->length - range.offset)
+        return -EINVAL;
+    if (context->map)
+        memory_map_invalidate(context->map, range.offset, range.length);
+    return 0;
+}
+
+
+static long set_completion_mode(
+    struct memory_context *context, unsigned long mode)
+{
+    switch (mode)
+    {
+        case AMC_COMPLETION_AUTO:
+            context->completion_mode = DMA_COMPLETION_AUTO;
+            return 0;
+        case AMC_COMPLETION_INTERRUPT:
+            context->completion_mode = DMA_COMPLETION_INTERRUPT;
+            return 0;
+        case AMC_COMPLETION_POLL:
+            context->completion_mode = DMA_COMPLETION_POLL;
+            return 0;
+        default:
+            return -EINVAL;
+    }
+}
+
+
+static long set_priority(
+    struct memory_context *context, unsigned long priority)
+{
+    switch (priority)
+    {
+        case AMC_PRIORITY_RT:
+            if (!rt_task(current)  &&  !capable(CAP_SYS_NICE))
+                return -EPERM;
+            context->priority = DMA_PRIORITY_RT;
+            return 0;
+        case AMC_PRIORITY_NORMAL:
+            context->priority = DMA_PRIORITY_NORMAL;
+            return 0;
+        case AMC_PRIORITY_BULK:
+            context->priority = DMA_PRIORITY_BULK;
+            return 0;
+        default:
+            return -EINVAL;
+    }
+}
+
+
+static long start_stream(struct file *file, struct memory_context *context)
+{
+    if (!context->write_pointer  ||  !(file->f_mode & FMODE_READ))
+        return -EINVAL;
+    if (context->stream)
+        return -EBUSY;
+
+    struct memory_stream *stream = stream_start(
+        context->dma, context->base, context->length, context->write_pointer,
+        context->priority);
+    if (IS_ERR(stream))
+        return PTR_ERR(stream);
+    /* A concurrent call may have started a stream while we did. */
+    if (cmpxchg(&context->stream, NULL, stream))
+    {
+        stream_stop(stream);
+        return -EBUSY;
+    }
+    return 0;
+}
+
+
+static long arm_capture(
+    struct file *file, struct memory_context *context,
+    const void __user *arg)
+{
+    struct amc_capture_arm arm;
+    if (copy_from_user(&arm, arg, sizeof(arm)))
+        return -EFAULT;
+    if (!(file->f_mode & FMODE_READ))
+        return -EACCES;
+    if (arm.reserved != 0  ||
+        arm.offset > context->length  ||
+        arm.length > context->length - arm.offset)
+        return -EINVAL;
+
+    struct event_capture *capture = arm_event_capture(
+        context->dma, context->interrupts, context->base + arm.offset,
+        arm.length, arm.event, context->priority);
+    if (IS_ERR(capture))
+        return PTR_ERR(capture);
+    spin_lock(&context->capture_lock);
+    swap(context->capture, capture);
+    spin_unlock(&context->capture_lock);
+    if (capture)
+        release_event_capture(capture);
+    return 0;
+}
+
+
+static long read_capture(
+    struct file *file, struct memory_context *context, void __user *arg)
+{
+    struct amc_capture_read result;
+    if (copy_from_user(&result, arg, sizeof(result)))
+        return -EFAULT;
+
+    /* We don't hold off reload or rearming, so hold on to the capture. */
+    spin_lock(&context->capture_lock);
+    struct event_capture *capture = context->capture;
+    if (capture)
+        get_event_capture(capture);
+    spin_unlock(&context->capture_lock);
+    if (!capture)
+        return -EINVAL;
+
+    u64 timestamp = 0;
+    ssize_t rc = read_event_capture(
+        capture, u64_to_user_ptr(result.data), result.length,
+        &timestamp, file->f_flags & O_NONBLOCK);
+    put_event_capture(capture);
+    if (rc >= 0)
+    {
+        result.timestamp = timestamp;
+        if (copy_to_user(arg, &result, sizeof(result)))
+            rc = -EFAULT;
+    }
+    return rc;
+}
+
+
+#define CAPTURE_GROUP_MAX_MEMBERS   64
+
+
+/* Takes a reference to the DMA device file named by the request, which is put
+ * by the caller even on failure.  Checks needing the DMA engine are left until
+ * reload has been held off. */
+static int resolve_capture_member(
+    struct amc_capture_member *request, struct capture_member *member)
+{
+    struct file *file = fget(request->fd);
+    member->file = file;
+    if (!file)
+        return -EBADF;
+    if (file->f_op != &amc_pci_dma_fops  ||  request->reserved)
+        return -EINVAL;
+    if (!(file->f_mode & FMODE_READ))
+        return -EACCES;
+
+    struct memory_context *context = file->private_data;
+    if (request->offset > context->length  ||
+        request->length > context->length - request->offset)
+        return -EINVAL;
+    *member = (struct capture_member) {
+        .file = file,
+        .handle = &context->handle,
+        .dma = context->dma,
+        .priority = context->priority,
+        .start = context->base + request->offset,
+        .length = request->length,
+        .data = u64_to_user_ptr(request->data),
+    };
+    return 0;
+}
+
+
+static long capture_group(const void __user *arg)
+{
+    struct amc_capture_group group;
+    if (copy_from_user(&group, arg, sizeof(group)))
+        return -EFAULT;
+    if (group.reserved != 0  ||
+        group.count == 0  ||  group.count > CAPTURE_GROUP_MAX_MEMBERS)
+        return -EINVAL;
+
+    long rc = 0;
+    struct amc_capture_member *requests = memdup_user(
+        u64_to_user_ptr(group.members),
+        group.count * sizeof(struct amc_capture_member));
+    if (IS_ERR(requests))
+        return PTR_ERR(requests);
+    struct capture_member *members =
+        kcalloc(group.count, sizeof(struct capture_member), GFP_KERNEL);
+    TEST_PTR(members, rc, no_members, "Unable to allocate capture group");
+
+    for (unsigned int i = 0; i < group.count  &&  rc == 0; i ++)
+        rc = resolve_capture_member(&requests[i], &members[i]);
+    if (rc == 0)
+        rc = run_capture_group(members, group.count);
+    if (rc == 0)
+    {
+        for (unsigned int i = 0; i < group.count; i ++)
+            requests[i].timestamp = members[i].timestamp;
+        if (copy_to_user(u64_to_user_ptr(group.members), requests,
+                group.count * sizeof(struct amc_capture_member)))
+            rc = -EFAULT;
+    }
+
+    for (unsigned int i = 0; i < group.count; i ++)
+        if (members[i].file)
+            fput(members[i].file);
+    kfree(members);
+no_members:
+    kfree(requests);
+    return rc;
+}
+
+
+/* Limits on gather reads: the maximum number of regions in one call, and the
+ * largest gap between regions which will be read rather than starting a new
+ * DMA transfer. */
+#define GATHER_MAX_REGIONS  4096
+#define GATHER_MAX_GAP      4096
+
+
+/* Converts a region to an aligned span of FPGA memory, checking that it is not
+ * empty and lies within the DMA area.  An empty region would make an empty
+ * span, which can't be transferred. */
+static int gather_span(
+    struct memory_context *context, struct amc_dma_region *region,
+    size_t *start, size_t *end)
+{
+    size_t alignment = dma_get_alignment(context->dma);
+    if (region->length == 0  ||
+        region->offset > context->length  ||
+        region->length > context->length - region->offset)
+        return -EINVAL;
+    *start = ALIGN_DOWN(context->base + region->offset, alignment);
+    *end = ALIGN(context->base + region->offset + region->length, alignment);
+    if (*end > context->base + context->length)
+        return -EINVAL;
+    return 0;
+}
+
+
+/* Reads a region too large for a single transfer in separate chunks.  The
+ * engine is yielded between chunks, and *held is cleared if we are killed
+ * while waiting to get it back. */
+static ssize_t gather_large_region(
+    struct memory_context *context, struct amc_dma_region *region,
+    size_t start, size_t end, bool *held)
+{
+    void *data_buffer = dma_get_buffer(context->dma);
+    size_t in_offset = context->base + region->offset - start;
+    char __user *data = u64_to_user_ptr(region->data);
+    size_t done = 0;
+    while (done < region->length)
+    {
+        ssize_t count = dma_operation_unlocked(
+            context->dma, start, end - start, DMA_FROM_DEVICE);
+        if (count <= (ssize_t) in_offset)
+            return count < 0 ? count : -EIO;
+        size_t user_count = min(
+            (size_t) count - in_offset, (size_t) region->length - done);
+        if (copy_to_user(data + done, data_buffer + in_offset, user_count))
+            return -EFAULT;
+        done += user_count;
+        start += count;
+        in_offset = 0;
+        if (dma_memory_yield(context->dma) < 0)
+        {
+            *held = false;
+            return -EINTR;
+        }
+    }
+    return done;
+}
+
+
+/* Reads regions [first, last) with a single DMA of the span [start, end). */
+static ssize_t gather_batch(
+    struct memory_context *context, struct amc_dma_region *regions,
+    unsigned int first, unsigned int last, size_t start, size_t end)
+{
+    void *data_buffer = dma_get_buffer(context->dma);
+    ssize_t count = dma_operation_unlocked(
+        context->dma, start, end - start, DMA_FROM_DEVICE);
+    if (count < (ssize_t) (end - start))
+        return count < 0 ? count : -EIO;
+
+    size_t total = 0;
+    for (unsigned int i = first; i < last; i ++)
+    {
+        struct amc_dma_region *region = &regions[i];
+        size_t in_offset = context->base + region->offset - start;
+        if (copy_to_user(u64_to_user_ptr(region->data),
+                data_buffer + in_offset, region->length))
+            return -EFAULT;
+        total += region->length;
+    }
+    return total;
+}
+
+
+static ssize_t gather_regions(
+    struct memory_context *context, struct amc_dma_region *regions,
+    unsigned int count, bool *held)
+{
+    size_t max_transfer = dma_max_transfer(context->dma);
+    ssize_t total = 0;
+    for (unsigned int i = 0; i < count; )
+    {
+        size_t start, end;
+        int rc = gather_span(context, &regions[i], &start, &end);
+        if (rc < 0)
+            return rc;
+
+        ssize_t count_read;
+        if (end - start > max_transfer)
+        {
+            count_read = gather_large_region(
+                context, &regions[i], start, end, held);
+            i += 1;
+        }
+        else
+        {
+            /* Extend the batch for as long as the following regions fit into
+             * a single transfer without reading too much unwanted data. */
+            unsigned int last = i + 1;
+            for (; last < count; last ++)
+            {
+                size_t next_start, next_end;
+                rc = gather_span(
+                    context, &regions[last], &next_start, &next_end);
+                if (rc < 0)
+                    return rc;
+                size_t new_start = min(start, next_start);
+                size_t new_end = max(end, next_end);
+                size_t wanted = (end - start) + (next_end - next_start);
+                if (new_end - new_start > max_transfer  ||
+                    new_end - new_start > wanted + GATHER_MAX_GAP)
+                    break;
+                start = new_start;
+                end = new_end;
+            }
+            count_read = gather_batch(context, regions, i, last, start, end);
+            i = last;
+        }
+        if (count_read < 0)
+            return count_read;
+        total += count_read;
+        if (dma_memory_yield(context->dma) < 0)
+        {
+            *held = false;
+            return -EINTR;
+        }
+    }
+    return total;
+}
+
+
+static long read_gather(
+    struct file *file, struct memory_context *context,
+    const void __user *arg)
+{
+    struct amc_dma_gather gather;
+    if (copy_from_user(&gather, arg, sizeof(gather)))
+        return -EFAULT;
+    if (!(file->f_mode & FMODE_READ))
+        return -EACCES;
+    if (gather.reserved != 0)
+        return -EINVAL;
+    if (gather.count > GATHER_MAX_REGIONS)
+        return -E2BIG;
+
+    struct amc_dma_region *regions = kvmalloc_array(
+        gather.count, sizeof(struct amc_dma_region), GFP_KERNEL);
+    if (!regions)
+        return -ENOMEM;
+    ssize_t rc = 0;
+    if (copy_from_user(regions, u64_to_user_ptr(gather.regions),
+            gather.count * sizeof(struct amc_dma_region)))
+        rc = -EFAULT;
+    else
+        rc = dma_memory_lock(context->dma, context->priority);
+    if (rc == 0)
+    {
+        bool held = true;
+        dma_set_completion_mode(context->dma, context->completion_mode);
+        rc = gather_regions(context, regions, gather.count, &held);
+        if (held)
+            dma_memory_unlock(context->dma);
+    }
+    kvfree(regions);
+    return rc;
+}
+
+
+static long memory_ioctl(
     struct file *file, unsigned int cmd, unsigned long arg)
 {
     struct memory_context *context = file->private_data;
@@ -162,17 +1118,68 @@ static long amc_pci_mem_ioctl(
             return dma_buffer_size(context->dma);
         case AMC_DMA_AREA_SIZE:
             return context->length;
+        case AMC_DMA_EXPORT:
+            return export_dmabuf(file, context, (const void __user *) arg);
+        case AMC_DMA_COMPLETION:
+            return set_completion_mode(context, arg);
+        case AMC_DMA_STREAM:
+            return start_stream(file, context);
+        case AMC_CAPTURE_ARM:
+            return arm_capture(file, context, (const void __user *) arg);
+        case AMC_CAPTURE_READ:
+            return read_capture(file, context, (void __user *) arg);
+        case AMC_DMA_GATHER:
+            return read_gather(file, context, (const void __user *) arg);
+        case AMC_DMA_CHECKSUM:
+            context->checksum = arg;
+            return 0;
+        case AMC_DMA_LAST_CHECKSUM:
+            return put_user(context->last_checksum, (__u32 __user *) arg);
+        case AMC_DMA_PRIORITY:
+            return set_priority(context, arg);
+        case AMC_DMA_CACHE_INVALIDATE:
+            if (!context->cache)
+                return -EINVAL;
+            dma_cache_invalidate(context->cache, 0, context->length);
+            return 0;
+        case AMC_DMA_MAP_INVALIDATE:
+            return invalidate_map(context, (const void __user *) arg);
         default:
             return -EINVAL;
     }
 }
 
 
+static long amc_pci_mem_ioctl(
+    struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct memory_context *context = file->private_data;
+    /* Reading a capture only waits for data, and the capture reports its own
+     * revocation.  A capture group holds off reload on each of its boards
+     * itself, and needn't include this one. */
+    if (cmd == AMC_CAPTURE_READ)
+        return memory_ioctl(file, cmd, arg);
+    else if (cmd == AMC_CAPTURE_GROUP)
+        return capture_group((const void __user *) arg);
+
+    long rc = amc_pci_enter(&context->handle);
+    if (rc == 0)
+    {
+        rc = memory_ioctl(file, cmd, arg);
+        amc_pci_leave(&context->handle);
+    }
+    return rc;
+}
+
+
 struct file_operations amc_pci_dma_fops = {
     .owner = THIS_MODULE,
     .release = amc_pci_dma_release,
     .write = amc_pci_dma_write,
     .read = amc_pci_dma_read,
     .llseek = amc_pci_dma_llseek,
+    .mmap = amc_pci_dma_mmap,
+    .splice_read = amc_pci_dma_splice_read,
+    .poll = amc_pci_dma_poll,
     .unlocked_ioctl = amc_pci_mem_ioctl,
 };
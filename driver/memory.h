@@ -3,10 +3,17 @@
 
 /* Memory device support. */
 
+struct dma_control;
+struct interrupt_control;
+struct dma_cache;
+
 /* Initialises associated memory device.  The base and length of the controlled
- * memory area are passed. */
+ * memory area are passed, together with the FPGA write pointer register if the
+ * area can be streamed and the cache of the area if it is cacheable. */
 int amc_pci_dma_open(
-    struct file *file, struct dma_control *dma, size_t base, size_t length);
+    struct file *file, struct dma_control *dma,
+    struct interrupt_control *interrupts, size_t base, size_t length,
+    void __iomem *write_pointer, struct dma_cache *cache);
 
 /* File operations for memory devices. */
 extern struct file_operations amc_pci_dma_fops;
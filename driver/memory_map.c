@@ -0,0 +1,361 @@
+/* Demand paged mappings of DMA areas.
+ *
+ * Pages are filled from FPGA memory on first access, a block at a time, and are
+ * then kept in an xarray indexed by page offset until they are invalidated or
+ * the file is closed, so only the parts of an area actually touched are ever
+ * transferred.  So that a scan through a large area doesn't pin all of it in
+ * memory, the blocks filled are also recorded in a ring of fixed size, and
+ * once it is full the oldest block is evicted to make room for the next.
+ * Mappings are read only as modified pages can't be written back.
+ *
+ * The fault handler returns each page locked, so the core installs it before
+ * any invalidation can get past the page lock.  Invalidation first removes the
+ * pages from the xarray, then waits on each page lock for faults in flight,
+ * and finally zaps the user mappings.
+ *
+ * A read() or write() on the DMA device holds the DMA engine while copying to
+ * or from user space, and that copy can fault on one of these mappings.  The
+ * engine is therefore always taken before the map lock, a fault in a task
+ * already holding the engine fails with SIGBUS, and where it can a fault drops
+ * the mmap lock rather than wait for the engine while holding it. */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/file.h>
+#include <linux/pci.h>
+#include <linux/mutex.h>
+#include <linux/xarray.h>
+#include <linux/version.h>
+
+#include "error.h"
+#include "amc_pci_core.h"
+#include "dma_control.h"
+
+#include "memory_map.h"
+
+
+/* Size of the block read from FPGA memory on each fault as a power of 2. */
+static int dma_map_block_shift = 16;
+module_param(dma_map_block_shift, int, S_IRUGO);
+
+/* Limit on the memory held by the mappings of a single file handle. */
+static unsigned int dma_map_max_mb = 64;
+module_param(dma_map_max_mb, uint, S_IRUGO);
+
+
+struct memory_map {
+    struct amc_pci_handle *handle;  // File handle owning the mappings
+    struct dma_control *dma;
+    enum dma_priority priority;     // Scheduling class for filling pages
+    size_t base;                    // DMA area in FPGA memory
+    size_t length;
+    size_t block_size;
+
+    struct mutex lock;              // Serialises filling and invalidation
+    struct xarray pages;            // Filled pages by page offset
+    pgoff_t *blocks;                // Ring of first pages of filled blocks
+    unsigned int max_blocks;        // Size of blocks ring
+    unsigned int oldest;            // Index of oldest block in ring
+    unsigned int nblocks;           // Number of blocks in ring
+};
+
+
+struct memory_map *create_memory_map(
+    struct amc_pci_handle *handle, struct dma_control *dma,
+    enum dma_priority priority, size_t base, size_t length)
+{
+    int rc = 0;
+    struct memory_map *map = kzalloc(sizeof(struct memory_map), GFP_KERNEL);
+    TEST_PTR(map, rc, no_map, "Unable to allocate memory map");
+    size_t block_size = min_t(size_t,
+        1ul << max(dma_map_block_shift, PAGE_SHIFT), dma_buffer_size(dma));
+    size_t max_blocks = clamp_t(size_t,
+        ((size_t) dma_map_max_mb << 20) / block_size,
+        1, DIV_ROUND_UP(length, block_size));
+    *map = (struct memory_map) {
+        .handle = handle,
+        .dma = dma,
+        .priority = priority,
+        .base = base,
+        .length = length,
+        .block_size = block_size,
+        .blocks = kvcalloc(max_blocks, sizeof(pgoff_t), GFP_KERNEL),
+        .max_blocks = max_blocks,
+    };
+    TEST_PTR(map->blocks, rc, no_blocks, "Unable to allocate memory map");
+    mutex_init(&map->lock);
+    xa_init(&map->pages);
+    return map;
+
+no_blocks:
+    kfree(map);
+no_map:
+    return ERR_PTR(rc);
+}
+
+
+void destroy_memory_map(struct memory_map *map)
+{
+    struct page *page;
+    unsigned long index;
+    xa_for_each(&map->pages, index, page)
+        put_page(page);
+    xa_destroy(&map->pages);
+    kvfree(map->blocks);
+    kfree(map);
+}
+
+
+/* Removes the pages in the given range from the map, waiting for any fault
+ * still installing them.  Called holding the map lock. */
+static void discard_pages(struct memory_map *map, pgoff_t first, pgoff_t last)
+{
+    struct page *page;
+    unsigned long index;
+    xa_for_each_range(&map->pages, index, page, first, last)
+    {
+        xa_erase(&map->pages, index);
+        lock_page(page);
+        unlock_page(page);
+        put_page(page);
+    }
+}
+
+
+/* Records a newly filled block, first evicting the oldest block if the ring is
+ * full.  A block in the ring may since have been invalidated or refilled, and
+ * evicting it again is harmless.  Called holding the map lock. */
+static void record_block(struct memory_map *map, pgoff_t first)
+{
+    if (map->nblocks == map->max_blocks)
+    {
+        pgoff_t oldest = map->blocks[map->oldest];
+        size_t block_pages = map->block_size >> PAGE_SHIFT;
+        discard_pages(map, oldest, oldest + block_pages - 1);
+        unmap_mapping_range(map->handle->file->f_mapping,
+            (loff_t) oldest << PAGE_SHIFT, map->block_size, 1);
+        map->oldest = (map->oldest + 1) % map->max_blocks;
+        map->nblocks -= 1;
+    }
+    map->blocks[(map->oldest + map->nblocks) % map->max_blocks] = first;
+    map->nblocks += 1;
+}
+
+
+/* Copies data into the block of pages starting at the given offset, skipping
+ * any pages which are already present. */
+static void copy_to_pages(
+    struct page **pages, size_t offset, const void *data, size_t count)
+{
+    while (count > 0)
+    {
+        size_t in_page = offset & ~PAGE_MASK;
+        size_t length = min(count, PAGE_SIZE - in_page);
+        struct page *page = pages[offset >> PAGE_SHIFT];
+        if (page)
+            memcpy(page_address(page) + in_page, data, length);
+        offset += length;
+        data += length;
+        count -= length;
+    }
+}
+
+
+/* Reads the block containing the given page from FPGA memory into those of its
+ * pages which are not yet present.  Called holding the DMA engine and the map
+ * lock. */
+static int fill_block(struct memory_map *map, pgoff_t index)
+{
+    size_t block_pages = map->block_size >> PAGE_SHIFT;
+    pgoff_t first = ALIGN_DOWN(index, block_pages);
+    size_t start = first << PAGE_SHIFT;
+    size_t npages = min(block_pages,
+        (size_t) DIV_ROUND_UP(map->length - start, PAGE_SIZE));
+    /* Any unaligned tail of the area can't be read and is left as zeros. */
+    size_t length = ALIGN_DOWN(
+        min(map->block_size, map->length - start),
+        dma_get_alignment(map->dma));
+
+    int rc = 0;
+    struct page **pages = kcalloc(npages, sizeof(struct page *), GFP_KERNEL);
+    TEST_PTR(pages, rc, no_pages, "Unable to allocate page list");
+    for (size_t i = 0; i < npages; i ++)
+        if (!xa_load(&map->pages, first + i))
+        {
+            pages[i] = alloc_page(GFP_KERNEL | __GFP_ZERO);
+            TEST_PTR(pages[i], rc, no_page, "Unable to allocate page");
+        }
+
+    struct dma_control *dma = map->dma;
+    void *dma_buffer = dma_get_buffer(dma);
+    for (size_t done = 0; done < length; )
+    {
+        ssize_t count = dma_operation_unlocked(
+            dma, map->base + start + done, length - done, DMA_FROM_DEVICE);
+        if (count <= 0)
+        {
+            rc = count ?: -EIO;
+            break;
+        }
+        copy_to_pages(pages, done, dma_buffer, count);
+        done += count;
+    }
+    TEST_RC(rc, no_page, "Unable to read block for mapping");
+
+    record_block(map, first);
+    for (size_t i = 0; i < npages; i ++)
+        if (pages[i])
+        {
+            rc = xa_err(
+                xa_store(&map->pages, first + i, pages[i], GFP_KERNEL));
+            TEST_RC(rc, no_page, "Unable to store page");
+            pages[i] = NULL;
+        }
+
+no_page:
+    for (size_t i = 0; i < npages; i ++)
+        if (pages[i])
+            put_page(pages[i]);
+    kfree(pages);
+no_pages:
+    return rc;
+}
+
+
+/* Returns the given page with a reference and locked, or NULL if it is not
+ * present.  If the caller holds the DMA engine the block is filled first. */
+static struct page *get_locked_page(
+    struct memory_map *map, pgoff_t index, bool fill, int *rc)
+{
+    mutex_lock(&map->lock);
+    struct page *page = xa_load(&map->pages, index);
+    if (!page  &&  fill)
+    {
+        *rc = fill_block(map, index);
+        page = xa_load(&map->pages, index);
+    }
+    if (page)
+    {
+        get_page(page);
+        lock_page(page);
+    }
+    mutex_unlock(&map->lock);
+    return page;
+}
+
+
+/* Called when the engine is busy and the fault can be retried.  A task
+ * holding the engine may be waiting for the mmap lock behind a writer which is
+ * in turn waiting for us, so we fill the block only after dropping the lock.
+ * From then on the vma may go, but our reference to the file keeps the map. */
+static vm_fault_t fill_and_retry(struct memory_map *map, struct vm_fault *vmf)
+{
+    if (vmf->flags & FAULT_FLAG_RETRY_NOWAIT)
+    {
+        amc_pci_leave(map->handle);
+        return VM_FAULT_RETRY;
+    }
+
+    struct file *file = get_file(vmf->vma->vm_file);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    release_fault_lock(vmf);
+#else
+    mmap_read_unlock(vmf->vma->vm_mm);
+#endif
+    if (dma_memory_lock(map->dma, map->priority) == 0)
+    {
+        int rc = 0;
+        struct page *page = get_locked_page(map, vmf->pgoff, true, &rc);
+        dma_memory_unlock(map->dma);
+        if (page)
+        {
+            unlock_page(page);
+            put_page(page);
+        }
+    }
+    amc_pci_leave(map->handle);
+    fput(file);
+    return VM_FAULT_RETRY;
+}
+
+
+static vm_fault_t memory_map_fault(struct vm_fault *vmf)
+{
+    struct memory_map *map = vmf->vma->vm_private_data;
+    if (vmf->pgoff >= DIV_ROUND_UP(map->length, PAGE_SIZE))
+        return VM_FAULT_SIGBUS;
+    /* We may be inside a file operation which is already holding off reload,
+     * so we mustn't wait here for a reload, which will revoke the handle. */
+    if (amc_pci_try_enter(map->handle) < 0)
+        return VM_FAULT_SIGBUS;
+
+    int rc = 0;
+    struct page *page = get_locked_page(map, vmf->pgoff, false, &rc);
+    if (!page)
+    {
+        /* This fails with -EDEADLK if the fault is from a copy to or from
+         * user space made while holding the engine. */
+        rc = dma_memory_trylock(map->dma, map->priority);
+        if (rc == -EBUSY  &&  fault_flag_allow_retry_first(vmf->flags))
+            return fill_and_retry(map, vmf);
+        else if (rc == -EBUSY)
+            rc = dma_memory_lock(map->dma, map->priority);
+        if (rc == 0)
+        {
+            page = get_locked_page(map, vmf->pgoff, true, &rc);
+            dma_memory_unlock(map->dma);
+        }
+    }
+    amc_pci_leave(map->handle);
+
+    if (!page)
+        return rc == -ENOMEM ? VM_FAULT_OOM : VM_FAULT_SIGBUS;
+    vmf->page = page;
+    return VM_FAULT_LOCKED;
+}
+
+
+static const struct vm_operations_struct memory_map_vm_ops = {
+    .fault = memory_map_fault,
+};
+
+
+int memory_map_mmap(struct memory_map *map, struct vm_area_struct *vma)
+{
+    size_t offset = vma->vm_pgoff << PAGE_SHIFT;
+    size_t size = vma->vm_end - vma->vm_start;
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+    if (offset > PAGE_ALIGN(map->length)  ||
+        size > PAGE_ALIGN(map->length) - offset)
+        return -EINVAL;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_mod(vma, VM_DONTEXPAND | VM_DONTDUMP, VM_MAYWRITE);
+#else
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    vma->vm_ops = &memory_map_vm_ops;
+    vma->vm_private_data = map;
+    return 0;
+}
+
+
+void memory_map_invalidate(struct memory_map *map, size_t offset, size_t count)
+{
+    if (count == 0)
+        return;
+
+    mutex_lock(&map->lock);
+    discard_pages(map,
+        offset >> PAGE_SHIFT, (offset + count - 1) >> PAGE_SHIFT);
+    mutex_unlock(&map->lock);
+
+    unmap_mapping_range(map->handle->file->f_mapping,
+        ALIGN_DOWN(offset, PAGE_SIZE),
+        PAGE_ALIGN(offset + count) - ALIGN_DOWN(offset, PAGE_SIZE), 1);
+}
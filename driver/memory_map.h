@@ -0,0 +1,27 @@
+#ifndef MEMORY_MAP_H
+#define MEMORY_MAP_H
+
+/* Demand paged read only mappings of DMA areas. */
+
+struct amc_pci_handle;
+struct dma_control;
+struct memory_map;
+
+/* Creates the page store for mappings of the DMA area at base of the given
+ * length made through the given file handle.  Pages are filled using the
+ * given DMA priority class.  The map must outlive all of its mappings, and so
+ * should be destroyed when the file is released. */
+struct memory_map *create_memory_map(
+    struct amc_pci_handle *handle, struct dma_control *dma,
+    enum dma_priority priority, size_t base, size_t length);
+
+void destroy_memory_map(struct memory_map *map);
+
+/* Sets up vma as a demand paged mapping of the area. */
+int memory_map_mmap(struct memory_map *map, struct vm_area_struct *vma);
+
+/* Discards pages overlapping the given range of the area and removes them from
+ * all mappings, so that the next access reads FPGA memory again. */
+void memory_map_invalidate(struct memory_map *map, size_t offset, size_t count);
+
+#endif
@@ -14,6 +14,7 @@ struct prom_context {
     void __iomem *base;
     u8 buff[PROM_MAX_LENGTH + 1];
     size_t data_len;
+    size_t fetched;         // Number of bytes read from PROM into buff
     size_t nentries;
     size_t dma_nentries;
     size_t nentries_with_minor;
@@ -152,6 +153,21 @@ ssize_t read_prom(struct prom_context *context, char *buff, loff_t off,
 }
 
 
+/* Ensures that the first length bytes of the PROM have been read into our
+ * buffer.  The PROM is read incrementally as it is parsed, so that only the
+ * bytes actually in use are fetched over the bus, but always in aligned 32-bit
+ * words as the PROM may not support narrower reads. */
+static void fetch_prom(struct prom_context *context, size_t length)
+{
+    length = min(ALIGN(length, 4), (size_t) PROM_MAX_LENGTH);
+    for (; context->fetched < length; context->fetched += 4)
+    {
+        u32 rval = ioread32(context->base + context->fetched);
+        memcpy(context->buff + context->fetched, (char *) &rval, 4);
+    }
+}
+
+
 struct prom_context *load_prom(void __iomem *base)
 {
     int rc = 0;
@@ -166,21 +182,22 @@ struct prom_context *load_prom(void __iomem *base)
     {
         printk(KERN_INFO "PROM memory not found, falling back to default");
         memcpy(context->buff, default_prom, sizeof(default_prom));
-    }
-    else
-    {
-        TEST_OK(
-            read_prom(context, context->buff, 0, PROM_MAX_LENGTH)
-                == PROM_MAX_LENGTH,
-            rc = -EIO, io_error, "Could not read PROM");
+        context->fetched = PROM_MAX_LENGTH;
     }
 
+    fetch_prom(context, PROM_FIRST_ENTRY_OFFSET);
     TEST_OK(context->buff[PROM_VERSION_OFFSET] == PROM_VERSION,
         rc = -EIO, no_version, "PROM version is not supported");
 
+    /* Fetch the header of each entry and then its body. */
     int ent_i = PROM_FIRST_ENTRY_OFFSET;
-    while (ent_i < PROM_MAX_LENGTH && context->buff[ent_i] != PROM_END_TAG)
+    while (ent_i < PROM_MAX_LENGTH - 1)
     {
+        fetch_prom(context, ent_i + 2);
+        if (context->buff[ent_i] == PROM_END_TAG)
+            break;
+        fetch_prom(context, ent_i + context->buff[ent_i + 1] + 2);
+
         union prom_entry *entry = (union prom_entry *) &context->buff[ent_i];
         if (entry->tag == PROM_DMA_TAG ||
                 entry->tag == PROM_DMA_EXT_TAG)
@@ -192,14 +209,15 @@ struct prom_context *load_prom(void __iomem *base)
         ent_i += context->buff[ent_i + 1] + 2;
         context->nentries++;
     }
+    TEST_OK(ent_i < PROM_MAX_LENGTH - 1,
+        rc = -EIO, invalid_prom, "PROM end marker not found");
 
     context->data_len = ent_i + context->buff[ent_i + 1] + 2;
+    fetch_prom(context, context->data_len);
 
-    /* At this point we've either run off the end of memory, or we're sitting
-     * on a putative end marker */
+    /* At this point we're sitting on a putative end marker */
     TEST_OK(
         context->data_len < PROM_MAX_LENGTH &&
-        context->buff[ent_i] == PROM_END_TAG &&
         (context->buff[ent_i + 1] == PROM_CHECKSUM_SIZE ||
          context->buff[ent_i + 1] == PROM_CHECKSUM_SIZE + 1),
         rc = -EIO, invalid_prom, "PROM end marker not found");
@@ -210,7 +228,6 @@ struct prom_context *load_prom(void __iomem *base)
 
 invalid_prom:
 no_version:
-io_error:
     kfree(context);
 no_memory:
     return ERR_PTR(rc);
@@ -9,13 +9,17 @@
 #define PROM_DMA_EXT_TAG        3
 #define PROM_DMA_MASK_TAG       4
 #define PROM_DMA_ALIGN_TAG  5
+#define PROM_DMA_STREAM_TAG     6
+#define PROM_REGISTERS_TAG      7
 
 #define PROM_DMA_PERM_WRITE     2
 #define PROM_DMA_PERM_READ      4
+#define PROM_DMA_PERM_CACHE     8
 
 #define PROM_MAX_LENGTH 4096
 #define PROM_PERM_CAN_WRITE(perm) ((perm) & PROM_DMA_PERM_WRITE)
 #define PROM_PERM_CAN_READ(perm) ((perm) & PROM_DMA_PERM_READ)
+#define PROM_PERM_CACHEABLE(perm) ((perm) & PROM_DMA_PERM_CACHE)
 
 struct prom_context;
 
@@ -64,6 +68,23 @@ struct __attribute__((packed)) prom_dma_align {
     u8 shift;
 };
 
+/* Marks the named DMA area as a circular buffer written by the FPGA.  The
+ * register at offset write_pointer in BAR0 holds a free running count of bytes
+ * written, so the area length must be a power of 2. */
+struct __attribute__((packed)) prom_dma_stream {
+    PROM_ENTRY_HEAD;
+    u32 write_pointer;
+    // assumed to be null terminated
+    char name[];
+};
+
+/* Gives the address of the BAR0 registers as seen by the DMA engine, so that
+ * register ranges can be read in bulk by DMA. */
+struct __attribute__((packed)) prom_registers {
+    PROM_ENTRY_HEAD;
+    u64 base;
+};
+
 struct __attribute__((packed)) prom_end_entry {
     PROM_ENTRY_HEAD;
     char checksum[];
@@ -76,6 +97,8 @@ union prom_entry {
     struct prom_dma_ext_entry dma_ext;
     struct prom_dma_mask dma_mask;
     struct prom_dma_align dma_align;
+    struct prom_dma_stream dma_stream;
+    struct prom_registers registers;
     struct prom_end_entry end;
 };
 
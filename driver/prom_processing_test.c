@@ -4,6 +4,8 @@
 #include "test_assets/test_prom2.c"
 #include "test_assets/test_prom3.c"
 #include "test_assets/test_prom4.c"
+#include "test_assets/test_prom5.c"
+#include "test_assets/test_prom6.c"
 
 
 static u64 base_to_u64(u16 *base)
@@ -161,6 +163,36 @@ static void test_prom_with_mask_and_alignment(struct kunit *test)
 }
 
 
+static void test_prom_with_dma_stream(struct kunit *test)
+{
+    struct prom_context *context = load_prom((void *) test_prom5);
+    KUNIT_EXPECT_NOT_ERR_OR_NULL(test, context);
+    KUNIT_EXPECT_EQ(test, test_prom5_nentries, prom_get_nentries(context));
+    KUNIT_EXPECT_EQ(test, (size_t) 2, prom_get_nentries_with_minor(context));
+    KUNIT_EXPECT_EQ(test, (size_t) 1, prom_get_dma_nentries(context));
+    union prom_entry *entry =
+        prom_find_entry_by_tag(context, PROM_DMA_STREAM_TAG);
+    KUNIT_EXPECT_NOT_ERR_OR_NULL(test, entry);
+    KUNIT_EXPECT_EQ(test, (u32) 0x100, entry->dma_stream.write_pointer);
+    KUNIT_EXPECT_EQ(test, 0, strcmp(entry->dma_stream.name, "adc0"));
+    release_prom_context(context);
+}
+
+
+static void test_prom_with_registers(struct kunit *test)
+{
+    struct prom_context *context = load_prom((void *) test_prom6);
+    KUNIT_EXPECT_NOT_ERR_OR_NULL(test, context);
+    KUNIT_EXPECT_EQ(test, test_prom6_nentries, prom_get_nentries(context));
+    KUNIT_EXPECT_EQ(test, (size_t) 2, prom_get_nentries_with_minor(context));
+    union prom_entry *entry =
+        prom_find_entry_by_tag(context, PROM_REGISTERS_TAG);
+    KUNIT_EXPECT_NOT_ERR_OR_NULL(test, entry);
+    KUNIT_EXPECT_EQ(test, (u64) 0x10000000, entry->registers.base);
+    release_prom_context(context);
+}
+
+
 static struct kunit_case prom_processing_test_cases[] = {
     KUNIT_CASE(test_load_prom_validation_ok),
     KUNIT_CASE(test_load_prom_validation_fail),
@@ -172,6 +204,8 @@ static struct kunit_case prom_processing_test_cases[] = {
     KUNIT_CASE(test_prom_with_dma_ext_entry),
     KUNIT_CASE(test_prom_with_dma_ext_entry_and_bigger_length),
     KUNIT_CASE(test_prom_with_mask_and_alignment),
+    KUNIT_CASE(test_prom_with_dma_stream),
+    KUNIT_CASE(test_prom_with_registers),
     {}
 };
 
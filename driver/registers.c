@@ -8,27 +8,52 @@
 #include <linux/cdev.h>
 #include <linux/pci.h>
 #include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/ktime.h>
+#include <linux/capability.h>
+#include <linux/sched/rt.h>
 
 #include "error.h"
 #include "amc_pci_core.h"
 #include "amc_pci_device.h"
+#include "dma_control.h"
 #include "interrupts.h"
+#include "sampler.h"
 #include "registers.h"
 
 
 struct register_context {
+    struct amc_pci_handle handle;   // Revoked on FPGA reload
     unsigned long base_page;
     size_t length;
     struct interrupt_control *interrupts;
     struct register_locking *locking;
+    struct sampler_control *samplers;
+    struct dma_control *dma;        // Set if registers can be read by DMA
+    size_t dma_base;                // Address of registers for DMA
+    enum dma_priority priority;     // Scheduling class for DMA
     int reader_number;
+    /* Recorded by each read for AMC_EVENT_TIMES. */
+    struct amc_event_times times;
 };
 
 
+/* Called on FPGA reload.  Register mappings are torn down so that any further
+ * access faults, and waiting readers are woken to see the revocation. */
+static void revoke_registers(struct amc_pci_handle *handle)
+{
+    struct register_context *context =
+        container_of(handle, struct register_context, handle);
+    unmap_mapping_range(handle->file->f_mapping, 0, 0, 1);
+    wake_up_all(interrupts_wait_queue(context->interrupts));
+}
+
+
 int amc_pci_reg_open(
     struct file *file, struct pci_dev *dev,
     struct interrupt_control *interrupts,
-    struct register_locking *locking)
+    struct register_locking *locking, struct sampler_control *samplers,
+    struct dma_control *dma, size_t dma_base)
 {
     int reader_number;
     int rc = 0;
@@ -44,6 +69,11 @@ int amc_pci_reg_open(
         .length = pci_resource_len(dev, 0),
         .interrupts = interrupts,
         .locking = locking,
+        .samplers = samplers,
+        .dma = dma,
+        .dma_base = dma_base,
+        .priority = rt_task(current) ?
+            DMA_PRIORITY_RT : DMA_PRIORITY_NORMAL,
         .reader_number = reader_number
     };
 
@@ -54,6 +84,7 @@ int amc_pci_reg_open(
     locking->reference_count += 1;
     mutex_unlock(&locking->mutex);
 
+    amc_pci_add_handle(file, &context->handle, revoke_registers);
     file->private_data = context;
     return 0;
 
@@ -72,6 +103,7 @@ static int amc_pci_reg_release(struct inode *inode, struct file *file)
     struct register_context *context = file->private_data;
     struct register_locking *locking = context->locking;
 
+    amc_pci_remove_handle(&context->handle);
     mutex_lock(&locking->mutex);
     if (locking->locked_by == context)
         locking->locked_by = NULL;
@@ -84,7 +116,7 @@ static int amc_pci_reg_release(struct inode *inode, struct file *file)
 }
 
 
-static int amc_pci_reg_mmap(struct file *file, struct vm_area_struct *vma)
+static int map_registers(struct file *file, struct vm_area_struct *vma)
 {
     struct register_context *context = file->private_data;
 
@@ -105,6 +137,21 @@ static int amc_pci_reg_mmap(struct file *file, struct vm_area_struct *vma)
 }
 
 
+/* The mapping is made with reload held off, so that it can't escape being torn
+ * down by revocation. */
+static int amc_pci_reg_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct register_context *context = file->private_data;
+    int rc = amc_pci_enter(&context->handle);
+    if (rc == 0)
+    {
+        rc = map_registers(file, vma);
+        amc_pci_leave(&context->handle);
+    }
+    return rc;
+}
+
+
 static long lock_register(struct register_context *context)
 {
     struct register_locking *locking = context->locking;
@@ -148,10 +195,110 @@ static long unlock_register(struct register_context *context)
 }
 
 
+static long read_event_times(
+    struct register_context *context, struct amc_event_times __user *times)
+{
+    if (copy_to_user(times, &context->times, sizeof(context->times)))
+        return -EFAULT;
+    return 0;
+}
+
+
+static long inject_events(
+    struct register_context *context, unsigned long events)
+{
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+    /* Only the 31 user event lines can be injected. */
+    if (events == 0  ||  events >> 31)
+        return -EINVAL;
+    inject_interrupt_events(context->interrupts, (uint32_t) events);
+    return 0;
+}
+
+
+/* The sampler reads the hardware, so can't be started during a reload. */
+static long sampler_config(
+    struct register_context *context,
+    const struct amc_sampler_config __user *config)
+{
+    long rc = amc_pci_enter(&context->handle);
+    if (rc == 0)
+    {
+        rc = configure_sampler(context->samplers, config);
+        amc_pci_leave(&context->handle);
+    }
+    return rc;
+}
+
+
+/* Reads the region in as few transfers as the DMA buffer allows. */
+static ssize_t dma_read_registers(
+    struct register_context *context, struct amc_dma_region *region)
+{
+    struct dma_control *dma = context->dma;
+    void *data_buffer = dma_get_buffer(dma);
+    char __user *data = u64_to_user_ptr(region->data);
+    size_t done = 0;
+
+    ssize_t rc = dma_memory_lock(dma, context->priority);
+    if (rc < 0)
+        return rc;
+    while (done < region->length)
+    {
+        ssize_t count = dma_operation_unlocked(
+            dma, context->dma_base + region->offset + done,
+            region->length - done, DMA_FROM_DEVICE);
+        if (count <= 0)
+        {
+            rc = count ?: -EIO;
+            break;
+        }
+        if (copy_to_user(data + done, data_buffer, count))
+        {
+            rc = -EFAULT;
+            break;
+        }
+        done += count;
+        if (dma_memory_yield(dma) < 0)
+            return -EINTR;
+    }
+    dma_memory_unlock(dma);
+    return rc ?: done;
+}
+
+
+static long read_registers_dma(
+    struct register_context *context,
+    const struct amc_dma_region __user *arg)
+{
+    struct amc_dma_region region;
+    if (copy_from_user(&region, arg, sizeof(region)))
+        return -EFAULT;
+    if (!context->dma)
+        return -EINVAL;
+    size_t alignment = dma_get_alignment(context->dma);
+    if (region.offset > context->length  ||
+        region.length > context->length - region.offset  ||
+        (region.offset | region.length) & (alignment - 1))
+        return -EINVAL;
+
+    long rc = amc_pci_enter(&context->handle);
+    if (rc == 0)
+    {
+        rc = dma_read_registers(context, &region);
+        amc_pci_leave(&context->handle);
+    }
+    return rc;
+}
+
+
 static long amc_pci_reg_ioctl(
     struct file *file, unsigned int cmd, unsigned long arg)
 {
     struct register_context *context = file->private_data;
+    if (amc_pci_revoked(&context->handle))
+        return -ENODEV;
     switch (cmd)
     {
         case AMC_MAP_SIZE:
@@ -160,6 +307,16 @@ static long amc_pci_reg_ioctl(
             return lock_register(context);
         case AMC_REG_UNLOCK:
             return unlock_register(context);
+        case AMC_EVENT_TIMES:
+            return read_event_times(context, (void __user *) arg);
+        case AMC_EVENT_INJECT:
+            return inject_events(context, arg);
+        case AMC_SAMPLER_CONFIG:
+            return sampler_config(context, (void __user *) arg);
+        case AMC_SAMPLER_OPEN:
+            return open_sampler(context->samplers, arg);
+        case AMC_REG_DMA_READ:
+            return read_registers_dma(context, (void __user *) arg);
         default:
             return -EINVAL;
     }
@@ -172,29 +329,51 @@ static ssize_t amc_pci_reg_read(
 {
     struct register_context *context = file->private_data;
 
-    /* In non blocking mode if we're not ready then say so. */
     bool no_wait = file->f_flags & O_NONBLOCK;
-    if (no_wait  &&  !interrupt_events_ready(
-            context->interrupts, context->reader_number))
-        return -EAGAIN;
 
     /* Ensure we've asked for at least 4 bytes. */
     if (count < sizeof(uint32_t))
         return -EIO;
 
-    uint32_t events;
-    int rc = read_interrupt_events(
-        context->interrupts, no_wait, &events, context->reader_number);
-    if (rc < 0)
-        /* Read was interrupted. */
-        return rc;
-    else if (copy_to_user(buf, &events, sizeof(uint32_t)) > 0)
+    /* A concurrent reader on the same file handle can take the events between
+     * our wakeup and reading them, in which case a blocking read waits again.
+     * We wait here rather than in read_interrupt_events() so that revocation
+     * can also end the wait. */
+    uint32_t events = 0;
+    ktime_t wakeup = 0;
+    while (events == 0)
+    {
+        if (!no_wait)
+        {
+            int rc = wait_event_interruptible(
+                *interrupts_wait_queue(context->interrupts),
+                interrupt_events_ready(
+                    context->interrupts, context->reader_number)  ||
+                amc_pci_revoked(&context->handle));
+            if (rc < 0)
+                /* Read was interrupted. */
+                return rc;
+        }
+        if (amc_pci_revoked(&context->handle))
+            return -ENODEV;
+        wakeup = ktime_get();
+
+        read_interrupt_events(
+            context->interrupts, true, &events, context->reader_number);
+        if (events == 0  &&  no_wait)
+            return -EAGAIN;
+    }
+
+    context->times = (struct amc_event_times) {
+        .interrupt = read_interrupt_event_time(
+            context->interrupts, context->reader_number),
+        .wakeup = ktime_to_ns(wakeup),
+        .events = events,
+        .reserved = 0,
+    };
+    if (copy_to_user(buf, &events, sizeof(uint32_t)) > 0)
         /* Invalid buffer specified by user process, couldn't copy. */
         return -EFAULT;
-    else if (events == 0)
-        /* This can happen if we're fighting with a concurrent reader and
-         * O_NONBLOCK was set. */
-        return -EAGAIN;
     else
         return sizeof(uint32_t);
 }
@@ -206,7 +385,10 @@ static unsigned int amc_pci_reg_poll(
     struct register_context *context = file->private_data;
 
     poll_wait(file, interrupts_wait_queue(context->interrupts), poll);
-    if (interrupt_events_ready(context->interrupts, context->reader_number))
+    if (amc_pci_revoked(&context->handle))
+        return POLLERR;
+    else if (interrupt_events_ready(
+            context->interrupts, context->reader_number))
         return POLLIN | POLLRDNORM;
     else
         return 0;
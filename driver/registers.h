@@ -1,6 +1,8 @@
 /* Interface to register file. */
 
 struct interrupt_control;
+struct sampler_control;
+struct dma_control;
 
 struct register_locking {
     struct mutex mutex;                 // Manages access to this structure
@@ -8,10 +10,13 @@ struct register_locking {
     struct register_context *locked_by; // Set to locking owner if locked
 };
 
-/* Called to open the file. */
+/* Called to open the file.  If the registers can be read by DMA then dma is
+ * passed together with the address of the registers seen by the DMA engine,
+ * otherwise dma is NULL. */
 int amc_pci_reg_open(
     struct file *file, struct pci_dev *dev,
     struct interrupt_control *interrupts,
-    struct register_locking *locking);
+    struct register_locking *locking, struct sampler_control *samplers,
+    struct dma_control *dma, size_t dma_base);
 
 extern struct file_operations amc_pci_reg_fops;
@@ -0,0 +1,489 @@
+/* Periodic register sampler.
+ *
+ * Rather than every monitoring client polling the same BAR0 registers with its
+ * own uncached reads, a soft hrtimer reads a configured list of registers once
+ * per period into a ring of timestamped entries in vmalloc memory.  Clients
+ * either map the ring read only or read() entries through their own file
+ * descriptor, which keeps its own position in the ring.
+ *
+ * Entries are written only by the timer, which publishes each one by advancing
+ * the sequence in the ring header.  Readers copy entries out without locking
+ * and then check the sequence again to see whether the timer has lapped them
+ * in the meantime, in which case the copy is discarded and the loss reported
+ * as a single -EOVERFLOW, as for streams.
+ *
+ * The sampler is reference counted: the board holds a reference while it is
+ * running and each open file holds another, so the ring outlives both the
+ * sampler being replaced and the board being removed.  A stopped sampler never
+ * touches the hardware again. */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/capability.h>
+#include <linux/anon_inodes.h>
+#include <linux/version.h>
+
+#include "error.h"
+#include "amc_pci_device.h"
+#include "interrupts.h"
+
+#include "sampler.h"
+
+
+#define SAMPLER_MAX_REGISTERS   64
+#define SAMPLER_MIN_PERIOD_US   100
+#define SAMPLER_MAX_RING        (16 << 20)
+
+/* Entries start on a fresh cache line after the header. */
+#define SAMPLER_DATA_OFFSET     64
+
+
+struct sampled_register {
+    u32 offset;
+    u32 change_mask;
+    u32 last;                       // Value at last sample
+};
+
+
+struct register_sampler {
+    struct kref kref;
+    void __iomem *regs;
+    struct interrupt_control *interrupts;
+    struct hrtimer timer;
+    ktime_t period;
+    int change_event;               // Event raised on change or -1
+
+    unsigned int count;
+    struct sampled_register *registers;
+
+    /* The ring starts with its header, and only the timer writes to it. */
+    struct amc_sampler_header *header;
+    size_t entry_size;
+    unsigned int entries;
+    u64 sequence;                   // Next entry to be written
+
+    bool stopped;                   // Set once the timer has been cancelled
+    wait_queue_head_t wait;         // Readers waiting for new entries
+};
+
+
+/* Each open sampler file has its own position in the ring. */
+struct sampler_reader {
+    struct register_sampler *sampler;
+    struct mutex mutex;             // Serialises reads through this file
+    u64 position;                   // Next entry to be read
+};
+
+
+static void *sampler_entry(struct register_sampler *sampler, u64 sequence)
+{
+    u32 index;
+    div_u64_rem(sequence, sampler->entries, &index);
+    return (void *) sampler->header + SAMPLER_DATA_OFFSET +
+        index * sampler->entry_size;
+}
+
+
+static enum hrtimer_restart take_sample(struct hrtimer *timer)
+{
+    struct register_sampler *sampler =
+        container_of(timer, struct register_sampler, timer);
+    u64 sequence = sampler->sequence;
+    u64 *entry = sampler_entry(sampler, sequence);
+    u32 *values = (u32 *) (entry + 1);
+
+    bool changed = false;
+    entry[0] = ktime_get_ns();
+    for (unsigned int i = 0; i < sampler->count; i ++)
+    {
+        struct sampled_register *reg = &sampler->registers[i];
+        u32 value = readl(sampler->regs + reg->offset);
+        values[i] = value;
+        changed |= ((value ^ reg->last) & reg->change_mask) != 0;
+        reg->last = value;
+    }
+    sampler->sequence = sequence + 1;
+    smp_store_release(&sampler->header->sequence, sequence + 1);
+    wake_up_all(&sampler->wait);
+
+    /* The first sample has nothing to be compared with. */
+    if (changed  &&  sequence > 0  &&  sampler->change_event >= 0)
+        inject_interrupt_events(
+            sampler->interrupts, 1U << sampler->change_event);
+
+    hrtimer_forward_now(timer, sampler->period);
+    return HRTIMER_RESTART;
+}
+
+
+static void free_sampler(struct kref *kref)
+{
+    struct register_sampler *sampler =
+        container_of(kref, struct register_sampler, kref);
+    vfree(sampler->header);
+    kfree(sampler->registers);
+    kfree(sampler);
+}
+
+
+static struct register_sampler *create_sampler(
+    struct sampler_control *control, const struct amc_sampler_config *config,
+    const struct amc_sampler_register *registers)
+{
+    size_t entry_size = ALIGN(
+        sizeof(u64) + config->count * sizeof(u32), sizeof(u64));
+    if (config->entries < 2  ||
+        config->entries > (SAMPLER_MAX_RING - SAMPLER_DATA_OFFSET) / entry_size)
+        return ERR_PTR(-EINVAL);
+    for (unsigned int i = 0; i < config->count; i ++)
+        if (registers[i].offset % sizeof(u32)  ||
+            registers[i].offset >= control->length)
+            return ERR_PTR(-EINVAL);
+
+    int rc = 0;
+    struct register_sampler *sampler =
+        kzalloc(sizeof(struct register_sampler), GFP_KERNEL);
+    TEST_PTR(sampler, rc, no_sampler, "Unable to allocate sampler");
+    sampler->registers = kcalloc(
+        config->count, sizeof(struct sampled_register), GFP_KERNEL);
+    TEST_PTR(sampler->registers, rc, no_registers,
+        "Unable to allocate sampler registers");
+    /* vmalloc_user() returns zeroed memory suitable for mapping to user
+     * space. */
+    sampler->header = vmalloc_user(PAGE_ALIGN(
+        SAMPLER_DATA_OFFSET + config->entries * entry_size));
+    TEST_PTR(sampler->header, rc, no_ring, "Unable to allocate sampler ring");
+
+    kref_init(&sampler->kref);
+    sampler->regs = control->regs;
+    sampler->interrupts = control->interrupts;
+    sampler->period = us_to_ktime(config->period_us);
+    sampler->change_event = config->change_event;
+    sampler->count = config->count;
+    sampler->entry_size = entry_size;
+    sampler->entries = config->entries;
+    init_waitqueue_head(&sampler->wait);
+    for (unsigned int i = 0; i < config->count; i ++)
+        sampler->registers[i] = (struct sampled_register) {
+            .offset = registers[i].offset,
+            .change_mask = registers[i].change_mask,
+        };
+    *sampler->header = (struct amc_sampler_header) {
+        .count = config->count,
+        .entry_size = entry_size,
+        .entries = config->entries,
+        .data_offset = SAMPLER_DATA_OFFSET,
+    };
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+    hrtimer_setup(&sampler->timer, take_sample,
+        CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+#else
+    hrtimer_init(&sampler->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+    sampler->timer.function = take_sample;
+#endif
+    return sampler;
+
+no_ring:
+    kfree(sampler->registers);
+no_registers:
+    kfree(sampler);
+no_sampler:
+    return ERR_PTR(rc);
+}
+
+
+/* Stops the timer, wakes any readers to see the end, and drops the board's
+ * reference. */
+static void retire_sampler(struct register_sampler *sampler)
+{
+    hrtimer_cancel(&sampler->timer);
+    smp_store_release(&sampler->stopped, true);
+    wake_up_all(&sampler->wait);
+    kref_put(&sampler->kref, free_sampler);
+}
+
+
+void init_sampler_control(
+    struct sampler_control *control, void __iomem *regs, size_t length,
+    struct interrupt_control *interrupts)
+{
+    mutex_init(&control->mutex);
+    control->sampler = NULL;
+    control->regs = regs;
+    control->length = length;
+    control->interrupts = interrupts;
+    control->paused = false;
+}
+
+
+long configure_sampler(
+    struct sampler_control *control,
+    const struct amc_sampler_config __user *arg)
+{
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+    struct amc_sampler_config config;
+    if (copy_from_user(&config, arg, sizeof(config)))
+        return -EFAULT;
+    if (config.count == 0)
+    {
+        stop_sampler(control);
+        return 0;
+    }
+    if (config.count > SAMPLER_MAX_REGISTERS  ||
+        config.period_us < SAMPLER_MIN_PERIOD_US  ||
+        config.change_event < -1  ||  config.change_event > 30)
+        return -EINVAL;
+
+    struct amc_sampler_register *registers = memdup_user(
+        u64_to_user_ptr(config.registers),
+        config.count * sizeof(struct amc_sampler_register));
+    if (IS_ERR(registers))
+        return PTR_ERR(registers);
+    struct register_sampler *sampler =
+        create_sampler(control, &config, registers);
+    kfree(registers);
+    if (IS_ERR(sampler))
+        return PTR_ERR(sampler);
+
+    mutex_lock(&control->mutex);
+    struct register_sampler *old_sampler = control->sampler;
+    control->sampler = sampler;
+    if (!control->paused)
+        hrtimer_start(&sampler->timer, 0, HRTIMER_MODE_REL_SOFT);
+    mutex_unlock(&control->mutex);
+
+    if (old_sampler)
+        retire_sampler(old_sampler);
+    return 0;
+}
+
+
+void stop_sampler(struct sampler_control *control)
+{
+    mutex_lock(&control->mutex);
+    struct register_sampler *sampler = control->sampler;
+    control->sampler = NULL;
+    mutex_unlock(&control->mutex);
+
+    if (sampler)
+        retire_sampler(sampler);
+}
+
+
+void pause_sampler(struct sampler_control *control)
+{
+    mutex_lock(&control->mutex);
+    control->paused = true;
+    if (control->sampler)
+        hrtimer_cancel(&control->sampler->timer);
+    mutex_unlock(&control->mutex);
+}
+
+
+void resume_sampler(struct sampler_control *control)
+{
+    mutex_lock(&control->mutex);
+    control->paused = false;
+    if (control->sampler)
+        hrtimer_start(&control->sampler->timer, 0, HRTIMER_MODE_REL_SOFT);
+    mutex_unlock(&control->mutex);
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Sampler file operations. */
+
+
+static bool sampler_ready(struct sampler_reader *reader)
+{
+    struct register_sampler *sampler = reader->sampler;
+    return READ_ONCE(reader->position) !=
+            smp_load_acquire(&sampler->header->sequence)  ||
+        smp_load_acquire(&sampler->stopped);
+}
+
+
+/* If entries have been overwritten before being read the reader skips to the
+ * oldest entry which is still safe to read.  The slot of the oldest entry in
+ * the ring may already be being overwritten by the timer. */
+static bool check_overrun(struct sampler_reader *reader, u64 sequence)
+{
+    unsigned int entries = reader->sampler->entries;
+    if (sequence - reader->position >= entries)
+    {
+        reader->position = sequence - entries + 1;
+        return true;
+    }
+    else
+        return false;
+}
+
+
+static ssize_t copy_entries(
+    struct sampler_reader *reader, char __user *buf, size_t count)
+{
+    struct register_sampler *sampler = reader->sampler;
+    bool stopped = smp_load_acquire(&sampler->stopped);
+    u64 sequence = smp_load_acquire(&sampler->header->sequence);
+    if (check_overrun(reader, sequence))
+        return -EOVERFLOW;
+    else if (reader->position == sequence)
+        /* Either we've reached the end or a concurrent reader has taken our
+         * data. */
+        return stopped ? 0 : -EAGAIN;
+
+    u64 position = reader->position;
+    size_t wanted = min_t(u64, count, sequence - position);
+    for (size_t done = 0; done < wanted; )
+    {
+        u32 index;
+        div_u64_rem(position + done, sampler->entries, &index);
+        size_t length = min_t(size_t, wanted - done, sampler->entries - index);
+        if (copy_to_user(buf + done * sampler->entry_size,
+                sampler_entry(sampler, position + done),
+                length * sampler->entry_size))
+            return -EFAULT;
+        done += length;
+    }
+
+    /* Check that the timer didn't overwrite anything while we were copying. */
+    smp_rmb();
+    if (check_overrun(reader, READ_ONCE(sampler->header->sequence)))
+        return -EOVERFLOW;
+    reader->position = position + wanted;
+    return wanted * sampler->entry_size;
+}
+
+
+static ssize_t sampler_read(
+    struct file *file, char __user *buf, size_t count, loff_t *f_pos)
+{
+    struct sampler_reader *reader = file->private_data;
+    size_t entry_size = reader->sampler->entry_size;
+    if (count < entry_size)
+        return -EINVAL;
+
+    bool no_wait = file->f_flags & O_NONBLOCK;
+    ssize_t rc;
+    do {
+        if (!no_wait)
+        {
+            rc = wait_event_interruptible(
+                reader->sampler->wait, sampler_ready(reader));
+            if (rc < 0)
+                return rc;
+        }
+
+        rc = mutex_lock_interruptible(&reader->mutex);
+        if (rc < 0)
+            return rc;
+        rc = copy_entries(reader, buf, count / entry_size);
+        mutex_unlock(&reader->mutex);
+        /* A concurrent reader can take our entries between our wakeup and
+         * reading them, in which case a blocking read waits again. */
+    } while (rc == -EAGAIN  &&  !no_wait);
+    return rc;
+}
+
+
+static unsigned int sampler_poll(
+    struct file *file, struct poll_table_struct *poll)
+{
+    struct sampler_reader *reader = file->private_data;
+    struct register_sampler *sampler = reader->sampler;
+
+    poll_wait(file, &sampler->wait, poll);
+    if (READ_ONCE(reader->position) !=
+            smp_load_acquire(&sampler->header->sequence))
+        return POLLIN | POLLRDNORM;
+    else if (smp_load_acquire(&sampler->stopped))
+        return POLLHUP;
+    else
+        return 0;
+}
+
+
+static int sampler_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct sampler_reader *reader = file->private_data;
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    return remap_vmalloc_range(vma, reader->sampler->header, vma->vm_pgoff);
+}
+
+
+static int sampler_release(struct inode *inode, struct file *file)
+{
+    struct sampler_reader *reader = file->private_data;
+    kref_put(&reader->sampler->kref, free_sampler);
+    kfree(reader);
+    return 0;
+}
+
+
+static const struct file_operations sampler_fops = {
+    .owner = THIS_MODULE,
+    .release = sampler_release,
+    .read = sampler_read,
+    .poll = sampler_poll,
+    .mmap = sampler_mmap,
+    .llseek = noop_llseek,
+};
+
+
+long open_sampler(struct sampler_control *control, unsigned long flags)
+{
+    if (flags & ~(unsigned long) (O_CLOEXEC | O_NONBLOCK))
+        return -EINVAL;
+
+    struct sampler_reader *reader =
+        kmalloc(sizeof(struct sampler_reader), GFP_KERNEL);
+    if (!reader)
+        return -ENOMEM;
+
+    mutex_lock(&control->mutex);
+    struct register_sampler *sampler = control->sampler;
+    if (sampler)
+        kref_get(&sampler->kref);
+    mutex_unlock(&control->mutex);
+    if (!sampler)
+    {
+        kfree(reader);
+        return -ENOENT;
+    }
+
+    /* New readers start with the next entry to be written. */
+    *reader = (struct sampler_reader) {
+        .sampler = sampler,
+        .position = smp_load_acquire(&sampler->header->sequence),
+    };
+    mutex_init(&reader->mutex);
+    int rc = anon_inode_getfd(
+        "amc_pci_sampler", &sampler_fops, reader, O_RDONLY | flags);
+    if (rc < 0)
+    {
+        kref_put(&sampler->kref, free_sampler);
+        kfree(reader);
+    }
+    return rc;
+}
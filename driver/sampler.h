@@ -0,0 +1,45 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+/* Periodic sampling of BAR0 registers into a ring shared by all clients. */
+
+struct interrupt_control;
+struct register_sampler;
+struct amc_sampler_config;
+
+/* Each board has at most one sampler running, replaced by each new
+ * configuration. */
+struct sampler_control {
+    struct mutex mutex;                 // Protects sampler
+    struct register_sampler *sampler;   // Running sampler, if any
+    void __iomem *regs;                 // BAR0 registers
+    size_t length;                      // Length of BAR0
+    struct interrupt_control *interrupts;   // For change events
+    bool paused;                        // Timer held off by PCIe recovery
+};
+
+void init_sampler_control(
+    struct sampler_control *control, void __iomem *regs, size_t length,
+    struct interrupt_control *interrupts);
+
+/* Replaces the running sampler with one built from the given configuration,
+ * or just stops it if no registers are given.  The caller must hold off FPGA
+ * reload. */
+long configure_sampler(
+    struct sampler_control *control,
+    const struct amc_sampler_config __user *arg);
+
+/* Returns a new file descriptor reading from the running sampler. */
+long open_sampler(struct sampler_control *control, unsigned long flags);
+
+/* Stops the running sampler, after which it no longer touches the hardware.
+ * Open sampler files see end of file once they have read all entries. */
+void stop_sampler(struct sampler_control *control);
+
+/* Holds the running sampler and any sampler configured in the meantime off
+ * the hardware while the PCIe link is recovered, keeping its configuration and
+ * its readers, until resume_sampler() restarts it. */
+void pause_sampler(struct sampler_control *control);
+void resume_sampler(struct sampler_control *control);
+
+#endif
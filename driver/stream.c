@@ -0,0 +1,446 @@
+/* Continuous streaming from a circular buffer in FPGA memory.
+ *
+ * The FPGA writes into a DMA area as a circular buffer and publishes a free
+ * running count of bytes written in a BAR0 register.  A work item follows this
+ * write pointer, DMAing newly written data directly into a ring of mapped
+ * blocks from which readers consume a continuous byte stream.  If the FPGA
+ * laps us before data can be transferred the gap is reported to the reader as
+ * a single -EOVERFLOW at the point in the stream where data was lost.
+ *
+ * The work item is requeued by an hrtimer rather than as delayed work, as a
+ * poll interval of a millisecond or so is below the resolution of jiffies. */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/fs.h>
+#include <linux/pci.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/version.h>
+#include <linux/log2.h>
+
+#include "error.h"
+#include "dma_control.h"
+
+#include "stream.h"
+
+
+/* Size of stream ring buffer as a power of 2. */
+static int stream_buffer_shift = 24;
+module_param(stream_buffer_shift, int, S_IRUGO);
+
+/* Interval between checks of the FPGA write pointer. */
+static int stream_poll_ms = 1;
+module_param(stream_poll_ms, int, S_IRUGO | S_IWUSR);
+
+
+struct stream_block {
+    struct page *page;
+    dma_addr_t dma;
+};
+
+
+struct memory_stream {
+    struct dma_control *dma;
+    struct device *dev;             // Device for mapping ring blocks
+    size_t base;                    // DMA area in FPGA memory
+    size_t length;                  // Length of area, a power of 2
+    void __iomem *write_pointer;    // Free running FPGA byte count
+    enum dma_priority priority;     // Scheduling class for transfers
+
+    struct work_struct work;        // Follows the write pointer
+    struct hrtimer timer;           // Queues work every stream_poll_ms
+    bool stopped;                   // Stops work being requeued
+    u32 fpga_pointer;               // Next byte to be transferred from FPGA
+
+    /* Ring buffer of DMA mapped blocks. */
+    size_t block_size;
+    unsigned int nblocks;
+    size_t ring_size;
+    struct stream_block *blocks;
+
+    /* The following are protected by lock. */
+    spinlock_t lock;
+    u64 head;                       // Bytes written into ring
+    u64 tail;                       // Bytes consumed by readers
+    bool overrun;                   // Set if data lost at overrun_at
+    u64 overrun_at;
+    int error;                      // Set if streaming failed
+
+    wait_queue_head_t wait_queue;
+    struct mutex read_mutex;        // Serialises concurrent readers
+};
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* FPGA to ring transfer. */
+
+
+static void report_overrun(struct memory_stream *stream, u32 write_pointer)
+{
+    spin_lock(&stream->lock);
+    if (stream->overrun)
+        /* Only one gap is tracked, anything after it is discarded. */
+        stream->head = stream->overrun_at;
+    else
+    {
+        stream->overrun = true;
+        stream->overrun_at = stream->head;
+    }
+    spin_unlock(&stream->lock);
+    stream->fpga_pointer = write_pointer;
+}
+
+
+static u32 read_write_pointer(struct memory_stream *stream)
+{
+    return ALIGN_DOWN(
+        ioread32(stream->write_pointer), dma_get_alignment(stream->dma));
+}
+
+
+/* Transfers as much of the available data as fits into the ring in one pass,
+ * splitting at block boundaries and at the end of the FPGA area. */
+static int transfer_available(struct memory_stream *stream, u32 available)
+{
+    struct device *dev = stream->dev;
+    while (available > 0)
+    {
+        spin_lock(&stream->lock);
+        u64 head = stream->head;
+        size_t space = stream->ring_size - (size_t) (head - stream->tail);
+        spin_unlock(&stream->lock);
+        if (space == 0)
+            break;
+
+        size_t ring_offset = head & (stream->ring_size - 1);
+        struct stream_block *block =
+            &stream->blocks[ring_offset / stream->block_size];
+        size_t block_offset = ring_offset & (stream->block_size - 1);
+        size_t fpga_offset = stream->fpga_pointer & (stream->length - 1);
+        size_t count = min3(
+            (size_t) available, space,
+            min(stream->block_size - block_offset,
+                stream->length - fpga_offset));
+
+        dma_sync_single_range_for_device(
+            dev, block->dma, block_offset, count, DMA_FROM_DEVICE);
+        ssize_t rc = dma_memory_lock(stream->dma, stream->priority);
+        if (rc == 0)
+        {
+            rc = dma_transfer_unlocked(
+                stream->dma, stream->base + fpga_offset,
+                block->dma + block_offset, count, DMA_FROM_DEVICE);
+            dma_memory_unlock(stream->dma);
+        }
+        dma_sync_single_range_for_cpu(
+            dev, block->dma, block_offset, count, DMA_FROM_DEVICE);
+        if (rc <= 0)
+            return rc ?: -EIO;
+
+        /* The FPGA may have lapped us and overwritten the data while it was
+         * being transferred, in which case it is discarded. */
+        u32 write_pointer = ioread32(stream->write_pointer);
+        if (write_pointer - stream->fpga_pointer > stream->length)
+        {
+            report_overrun(stream, read_write_pointer(stream));
+            return 0;
+        }
+
+        stream->fpga_pointer += rc;
+        available -= rc;
+        spin_lock(&stream->lock);
+        stream->head += rc;
+        spin_unlock(&stream->lock);
+        wake_up_interruptible(&stream->wait_queue);
+    }
+    return 0;
+}
+
+
+static void stream_work(struct work_struct *work)
+{
+    struct memory_stream *stream =
+        container_of(work, struct memory_stream, work);
+
+    u32 write_pointer = read_write_pointer(stream);
+    u32 available = write_pointer - stream->fpga_pointer;
+    int rc = 0;
+    /* A full area of new data is still intact, only more than that isn't. */
+    if (available > stream->length)
+        report_overrun(stream, write_pointer);
+    else
+        rc = transfer_available(stream, available);
+
+    if (rc < 0)
+    {
+        printk(KERN_ERR CLASS_NAME ": Streaming DMA failed: %d\n", rc);
+        spin_lock(&stream->lock);
+        stream->error = rc;
+        spin_unlock(&stream->lock);
+    }
+    else if (!READ_ONCE(stream->stopped))
+        hrtimer_start(&stream->timer,
+            ms_to_ktime(stream_poll_ms), HRTIMER_MODE_REL);
+    wake_up_interruptible(&stream->wait_queue);
+}
+
+
+static enum hrtimer_restart stream_poll_timer(struct hrtimer *timer)
+{
+    struct memory_stream *stream =
+        container_of(timer, struct memory_stream, timer);
+    queue_work(system_highpri_wq, &stream->work);
+    return HRTIMER_NORESTART;
+}
+
+
+/* The work and the timer each restart the other, so the work is cancelled
+ * again in case the timer fired while it was first being cancelled. */
+static void stop_polling(struct memory_stream *stream)
+{
+    WRITE_ONCE(stream->stopped, true);
+    cancel_work_sync(&stream->work);
+    hrtimer_cancel(&stream->timer);
+    cancel_work_sync(&stream->work);
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Reading. */
+
+
+static bool stream_ready(struct memory_stream *stream)
+{
+    spin_lock(&stream->lock);
+    bool ready =
+        stream->head != stream->tail  ||  stream->overrun  ||  stream->error;
+    spin_unlock(&stream->lock);
+    return ready;
+}
+
+
+static ssize_t copy_from_ring(
+    struct memory_stream *stream, char __user *buf, u64 tail, size_t count)
+{
+    size_t copied = 0;
+    while (copied < count)
+    {
+        size_t ring_offset = (tail + copied) & (stream->ring_size - 1);
+        struct stream_block *block =
+            &stream->blocks[ring_offset / stream->block_size];
+        size_t block_offset = ring_offset & (stream->block_size - 1);
+        size_t length =
+            min(count - copied, stream->block_size - block_offset);
+        if (copy_to_user(buf + copied,
+                page_address(block->page) + block_offset, length))
+            return -EFAULT;
+        copied += length;
+    }
+    return copied;
+}
+
+
+/* Copies out whatever data is ready, returning EAGAIN if there is none. */
+static ssize_t read_ready_data(
+    struct memory_stream *stream, char __user *buf, size_t count,
+    bool no_wait)
+{
+    ssize_t rc = 0;
+    if (!no_wait)
+    {
+        rc = wait_event_interruptible(
+            stream->wait_queue, stream_ready(stream));
+        if (rc < 0)
+            return rc;
+    }
+
+    rc = mutex_lock_interruptible(&stream->read_mutex);
+    if (rc < 0)
+        return rc;
+
+    spin_lock(&stream->lock);
+    u64 tail = stream->tail;
+    u64 limit = stream->overrun ? stream->overrun_at : stream->head;
+    if (tail == limit  &&  stream->overrun)
+    {
+        stream->overrun = false;
+        rc = -EOVERFLOW;
+    }
+    else if (tail == limit)
+        /* Either a concurrent reader has taken our data or we've failed. */
+        rc = stream->error ?: -EAGAIN;
+    spin_unlock(&stream->lock);
+
+    if (rc == 0)
+    {
+        rc = copy_from_ring(
+            stream, buf, tail, min(count, (size_t) (limit - tail)));
+        if (rc > 0)
+        {
+            spin_lock(&stream->lock);
+            stream->tail += rc;
+            spin_unlock(&stream->lock);
+        }
+    }
+    mutex_unlock(&stream->read_mutex);
+    return rc;
+}
+
+
+ssize_t stream_read(
+    struct memory_stream *stream, char __user *buf, size_t count,
+    bool no_wait)
+{
+    ssize_t rc;
+    do {
+        rc = read_ready_data(stream, buf, count, no_wait);
+        /* A concurrent reader can take our data between our wakeup and
+         * reading it, in which case a blocking read waits again. */
+    } while (rc == -EAGAIN  &&  !no_wait);
+    return rc;
+}
+
+
+unsigned int stream_poll(
+    struct memory_stream *stream, struct file *file,
+    struct poll_table_struct *poll)
+{
+    poll_wait(file, &stream->wait_queue, poll);
+    if (stream_ready(stream))
+        return POLLIN | POLLRDNORM;
+    else
+        return 0;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Initialisation and shutdown. */
+
+
+static void free_blocks(struct memory_stream *stream)
+{
+    struct device *dev = stream->dev;
+    int order = get_order(stream->block_size);
+    for (unsigned int i = 0; i < stream->nblocks; i ++)
+    {
+        struct stream_block *block = &stream->blocks[i];
+        if (block->page)
+        {
+            dma_unmap_page(
+                dev, block->dma, stream->block_size, DMA_FROM_DEVICE);
+            __free_pages(block->page, order);
+        }
+    }
+    kfree(stream->blocks);
+}
+
+
+static int allocate_blocks(struct memory_stream *stream)
+{
+    struct device *dev = stream->dev;
+    int order = get_order(stream->block_size);
+    stream->blocks = kcalloc(
+        stream->nblocks, sizeof(struct stream_block), GFP_KERNEL);
+    if (!stream->blocks)
+        return -ENOMEM;
+
+    for (unsigned int i = 0; i < stream->nblocks; i ++)
+    {
+        struct stream_block *block = &stream->blocks[i];
+        block->page = alloc_pages(GFP_KERNEL, order);
+        if (!block->page)
+            return -ENOMEM;
+        block->dma = dma_map_page(
+            dev, block->page, 0, stream->block_size, DMA_FROM_DEVICE);
+        if (dma_mapping_error(dev, block->dma))
+        {
+            __free_pages(block->page, order);
+            block->page = NULL;
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
+
+struct memory_stream *stream_start(
+    struct dma_control *dma, size_t base, size_t length,
+    void __iomem *write_pointer, enum dma_priority priority)
+{
+    int rc = 0;
+    size_t alignment = dma_get_alignment(dma);
+    TEST_OK(is_power_of_2(length)  &&  length <= (1ul << 31)  &&
+            length >= alignment  &&  IS_ALIGNED(base, alignment),
+        rc = -EINVAL, bad_area, "Invalid area for streaming");
+
+    struct memory_stream *stream =
+        kzalloc(sizeof(struct memory_stream), GFP_KERNEL);
+    TEST_PTR(stream, rc, no_stream, "Unable to allocate stream");
+
+    size_t block_size = dma_buffer_size(dma);
+    size_t ring_size = max(2 * block_size, 1ul << stream_buffer_shift);
+    *stream = (struct memory_stream) {
+        .dma = dma,
+        .dev = dma_get_device(dma),
+        .base = base,
+        .length = length,
+        .write_pointer = write_pointer,
+        .priority = priority,
+        .block_size = block_size,
+        .nblocks = ring_size / block_size,
+        .ring_size = ring_size,
+    };
+    spin_lock_init(&stream->lock);
+    init_waitqueue_head(&stream->wait_queue);
+    mutex_init(&stream->read_mutex);
+    INIT_WORK(&stream->work, stream_work);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+    hrtimer_setup(&stream->timer, stream_poll_timer,
+        CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+    hrtimer_init(&stream->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    stream->timer.function = stream_poll_timer;
+#endif
+
+    rc = allocate_blocks(stream);
+    TEST_RC(rc, no_blocks, "Unable to allocate stream buffer");
+
+    /* Start with data written from now on. */
+    stream->fpga_pointer = read_write_pointer(stream);
+    queue_work(system_highpri_wq, &stream->work);
+    return stream;
+
+no_blocks:
+    if (stream->blocks)
+        free_blocks(stream);
+    kfree(stream);
+no_stream:
+bad_area:
+    return ERR_PTR(rc);
+}
+
+
+/* Stops all DMA, readers see any data already transferred before -ENODEV.  The
+ * ring is only freed when the stream is stopped. */
+void stream_revoke(struct memory_stream *stream)
+{
+    stop_polling(stream);
+    spin_lock(&stream->lock);
+    stream->error = -ENODEV;
+    spin_unlock(&stream->lock);
+    wake_up_interruptible(&stream->wait_queue);
+}
+
+
+void stream_stop(struct memory_stream *stream)
+{
+    stop_polling(stream);
+    free_blocks(stream);
+    kfree(stream);
+}
@@ -0,0 +1,33 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+/* Continuous streaming from a circular buffer in FPGA memory. */
+
+struct dma_control;
+struct memory_stream;
+
+/* Starts streaming from the DMA area at base of the given length, following
+ * the FPGA write pointer register, with transfers made at the given DMA
+ * priority.  Streaming starts with the data written after this call. */
+struct memory_stream *stream_start(
+    struct dma_control *dma, size_t base, size_t length,
+    void __iomem *write_pointer, enum dma_priority priority);
+
+/* Stops all further DMA, called when the board is about to be reloaded.  The
+ * stream must still be stopped to release its resources. */
+void stream_revoke(struct memory_stream *stream);
+
+/* Stops streaming and releases all resources. */
+void stream_stop(struct memory_stream *stream);
+
+/* Returns the next block of streamed data.  If data has been lost since the
+ * last read -EOVERFLOW is returned once before streaming continues. */
+ssize_t stream_read(
+    struct memory_stream *stream, char __user *buf, size_t count,
+    bool no_wait);
+
+unsigned int stream_poll(
+    struct memory_stream *stream, struct file *file,
+    struct poll_table_struct *poll);
+
+#endif
@@ -0,0 +1,93 @@
+/* Fake DMA engine for tests of the DMA controller, included by each test file
+ * which needs it. */
+
+#include <linux/version.h>
+#include <linux/pci.h>
+#include <linux/hrtimer.h>
+
+#include "../dma_control.h"
+
+
+/* Bits of the Xilinx AXI CDMA registers (PG034) seen by the fake engine. */
+#define CDMACR_Reset        (1 << 2)
+#define CDMASR_Idle         (1 << 1)
+
+/* A fake CDMA engine which completes every transfer instantly, so that only
+ * the driver software is exercised.  The hardware clears the reset bit once
+ * reset is done, here a timer does this. */
+struct fake_cdma {
+    struct {
+        uint32_t cdmacr;        // 00 CDMA control
+        uint32_t cdmasr;        // 04 CDMA status
+        uint32_t unused[8];     // 08 Pointers and addresses
+        uint32_t btt;           // 28 Bytes to transfer
+    } regs;
+    struct hrtimer reset_timer;
+    struct pci_dev pdev;
+};
+
+
+static enum hrtimer_restart fake_cdma_reset(struct hrtimer *timer)
+{
+    struct fake_cdma *fake =
+        container_of(timer, struct fake_cdma, reset_timer);
+    uint32_t cdmacr = READ_ONCE(fake->regs.cdmacr);
+    if (cdmacr & CDMACR_Reset)
+    {
+        WRITE_ONCE(fake->regs.cdmacr, cdmacr & ~CDMACR_Reset);
+        return HRTIMER_NORESTART;
+    }
+    hrtimer_forward_now(timer, us_to_ktime(10));
+    return HRTIMER_RESTART;
+}
+
+
+static void release_fake_pdev(struct device *dev)
+{
+    kfree(container_of(to_pci_dev(dev), struct fake_cdma, pdev));
+}
+
+
+/* Creates a DMA controller driving a fake engine on a fake PCI device. */
+static struct dma_control *create_fake_dma(struct kunit *test)
+{
+    struct fake_cdma *fake = kzalloc(sizeof(struct fake_cdma), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, fake);
+    fake->regs.cdmasr = CDMASR_Idle;
+
+    struct device *dev = &fake->pdev.dev;
+    device_initialize(dev);
+    dev->release = release_fake_pdev;
+    dev->dma_mask = &dev->coherent_dma_mask;
+    dev_set_name(dev, "amc_pci_fake");
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+    hrtimer_setup(&fake->reset_timer, fake_cdma_reset,
+        CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+    hrtimer_init(&fake->reset_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    fake->reset_timer.function = fake_cdma_reset;
+#endif
+    hrtimer_start(&fake->reset_timer, us_to_ktime(10), HRTIMER_MODE_REL);
+
+    struct dma_control *dma;
+    int rc = initialise_dma_control(
+        &fake->pdev, (void __force __iomem *) &fake->regs, &dma,
+        DMA_DEFAULT_MASK, DMA_DEFAULT_ALIGNMENT_SHIFT);
+    hrtimer_cancel(&fake->reset_timer);
+    if (rc < 0)
+    {
+        put_device(dev);
+        KUNIT_FAIL(test, "Unable to initialise DMA control: %d", rc);
+        return NULL;
+    }
+    return dma;
+}
+
+
+static void destroy_fake_dma(struct dma_control *dma)
+{
+    struct device *dev = dma_get_device(dma);
+    terminate_dma_control(dma);
+    put_device(dev);
+}
@@ -0,0 +1,16 @@
+/*
+Version: 1
+Name: test-stream
+DMA: adc0 R 0 10000
+Stream: adc0 100
+*/
+size_t test_prom5_size = 52;
+size_t test_prom5_nentries = 3;
+const char test_prom5[4096] = {
+  0x44, 0x49, 0x41, 0x47, 0x01, 0x01, 0x0c, 0x74, 0x65, 0x73,
+  0x74, 0x2d, 0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x00, 0x02,
+  0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01,
+  0x00, 0x04, 0x61, 0x64, 0x63, 0x30, 0x00, 0x06, 0x09, 0x00,
+  0x01, 0x00, 0x00, 0x61, 0x64, 0x63, 0x30, 0x00, 0x00, 0x02,
+  0xd8, 0xa9
+};
@@ -0,0 +1,16 @@
+/*
+Version: 1
+Name: test-registers
+DMA: ddr0 R 0 10000
+Registers: 1000_0000
+*/
+size_t test_prom6_size = 54;
+size_t test_prom6_nentries = 3;
+const char test_prom6[4096] = {
+  0x44, 0x49, 0x41, 0x47, 0x01, 0x01, 0x0f, 0x74, 0x65, 0x73,
+  0x74, 0x2d, 0x72, 0x65, 0x67, 0x69, 0x73, 0x74, 0x65, 0x72,
+  0x73, 0x00, 0x02, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x01, 0x00, 0x04, 0x64, 0x64, 0x72, 0x30, 0x00,
+  0x07, 0x08, 0x00, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x02, 0xc7, 0xa2
+};
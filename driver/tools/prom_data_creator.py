@@ -15,9 +15,12 @@ DMA_TAG = 2
 DMA_EXT_TAG = 3
 DMA_MASK_TAG = 4
 DMA_ALIGNMENT_TAG = 5
+DMA_STREAM_TAG = 6
+REGISTERS_TAG = 7
 
 READ_PERM = 4
 WRITE_PERM = 2
+CACHE_PERM = 8
 
 
 def int_hex(number):
@@ -82,6 +85,16 @@ def dump_dma_alignment_shift(shift):
     return struct.pack("BBB", DMA_ALIGNMENT_TAG, 1, shift)
 
 
+def dump_dma_stream(name, write_pointer):
+    return struct.pack(
+        "<BBI", DMA_STREAM_TAG, len(name) + 5, write_pointer) + \
+        name.encode() + b"\x00"
+
+
+def dump_registers(base):
+    return struct.pack("<BBQ", REGISTERS_TAG, 8, base)
+
+
 def check_checksum(prom_data):
     return checksum(prom_data) == 0
 
@@ -92,6 +105,8 @@ def perm_flag(arg):
         result += 4
     if "w" in arg or "W" in arg:
         result += 2
+    if "c" in arg or "C" in arg:
+        result += 8
     return result if result else int(arg)
 
 
@@ -149,6 +164,11 @@ def process_config_file(path):
                 bin_data.extend(dump_dma_mask(int(value)))
             elif field == "align_shift":
                 bin_data.extend(dump_dma_alignment_shift(int(value)))
+            elif field == "stream":
+                name, write_pointer = value.split()
+                bin_data.extend(dump_dma_stream(name, int_hex(write_pointer)))
+            elif field == "registers":
+                bin_data.extend(dump_registers(int_hex(value)))
             else:
                 raise ValueError("Unknown field: {}".format(field))
 
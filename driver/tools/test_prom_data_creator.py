@@ -2,9 +2,9 @@
 import logging
 from prom_data_creator import check_checksum, dump_coe, dump_header, \
     dump_device_description, dump_memory_description, dump_dma_mask, \
-    dump_dma_alignment_shift
+    dump_dma_alignment_shift, dump_dma_stream, dump_registers, perm_flag
 
-from prom_data_creator import DMA_TAG, READ_PERM, WRITE_PERM
+from prom_data_creator import DMA_TAG, READ_PERM, WRITE_PERM, CACHE_PERM
 log = logging.getLogger(__name__)
 
 
@@ -68,6 +68,23 @@ def test_dump_dma_alignment():
     assert dump_dma_alignment_shift(0x6) == b"\x05\x01\x06"
 
 
+def test_dump_dma_stream():
+    assert dump_dma_stream("ddr0", 0x1234) == \
+        b"\x06\x09\x34\x12\x00\x00ddr0\x00"
+
+
+def test_dump_registers():
+    assert dump_registers(0x10000000) == \
+        b"\x07\x08\x00\x00\x00\x10\x00\x00\x00\x00"
+
+
+def test_perm_flag():
+    assert perm_flag("R") == READ_PERM
+    assert perm_flag("RW") == READ_PERM | WRITE_PERM
+    assert perm_flag("RC") == READ_PERM | CACHE_PERM
+    assert perm_flag("12") == READ_PERM | CACHE_PERM
+
+
 def test_check_checksum():
     assert check_checksum(
         b"DIAG\x01\x01\x0bamc525_mbf\x00\x02\x10\x00\x00\x00\x00\x00\x80\x00"
@@ -0,0 +1,471 @@
+/* Captures a DMA area to disk at high rate.
+ *
+ * Several DMA reads from the memory node are kept in flight through io_uring,
+ * and each completed block is written to the output file with O_DIRECT from
+ * the same registered buffer, so data never passes through the page cache.
+ * The kernel runs the blocking device reads on its own workers, so the DMA
+ * engine is kept busy while earlier blocks are being written to disk. */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+
+/* Output writes with O_DIRECT must be aligned to the logical block size of the
+ * target device, we use a page to be safe. */
+#define DIRECT_ALIGNMENT    4096
+
+#define READ_PHASE      0
+#define WRITE_PHASE     1
+
+
+static size_t start_offset = 0;
+static size_t capture_length = 0;   // Default to rest of DMA area
+static size_t block_size = 4 << 20;
+static unsigned int queue_depth = 8;
+static bool sync_output = false;
+static const char *device_name;
+static const char *output_name;
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Minimal io_uring support using the raw system calls. */
+
+
+struct uring {
+    int fd;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned int to_submit;
+};
+
+
+static int uring_setup(struct uring *ring, unsigned int entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+        return -1;
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        return -1;
+    char *cq = sq;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+            return -1;
+    }
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        return -1;
+
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    ring->to_submit = 0;
+    return 0;
+}
+
+
+static int uring_register_buffers(
+    struct uring *ring, const struct iovec *iovecs, unsigned int count)
+{
+    return (int) syscall(__NR_io_uring_register,
+        ring->fd, IORING_REGISTER_BUFFERS, iovecs, count);
+}
+
+
+/* Queues a fixed buffer read or write.  The ring is sized so that there is
+ * always room for one request per buffer. */
+static void uring_queue(
+    struct uring *ring, int opcode, int fd, void *addr, size_t length,
+    uint64_t offset, unsigned int buffer, uint64_t user_data)
+{
+    unsigned int tail = *ring->sq_tail;
+    unsigned int index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (uint8_t) opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) addr;
+    sqe->len = (uint32_t) length;
+    sqe->off = offset;
+    sqe->buf_index = (uint16_t) buffer;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit += 1;
+}
+
+
+/* Submits all queued requests and waits for at least one completion. */
+static int uring_submit_and_wait(struct uring *ring)
+{
+    int rc = (int) syscall(__NR_io_uring_enter, ring->fd,
+        ring->to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (rc >= 0)
+        ring->to_submit -= (unsigned int) rc;
+    return rc < 0  &&  errno != EINTR ? -1 : 0;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Capture. */
+
+
+struct capture_buffer {
+    void *data;
+    size_t offset;          // Offset of this block into the capture
+    size_t length;          // Number of bytes of capture in this block
+    size_t done;            // Bytes read or written so far in current phase
+};
+
+
+struct capture {
+    struct uring ring;
+    int device;
+    int output;
+    struct capture_buffer *buffers;
+    size_t next_offset;     // Next block of the capture to be read
+    size_t written;         // Total bytes written to disk
+    unsigned int active;    // Number of buffers with a request in flight
+};
+
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+
+static void queue_read(struct capture *capture, unsigned int i)
+{
+    struct capture_buffer *buffer = &capture->buffers[i];
+    uring_queue(&capture->ring, IORING_OP_READ_FIXED, capture->device,
+        (char *) buffer->data + buffer->done, buffer->length - buffer->done,
+        start_offset + buffer->offset + buffer->done, i,
+        (uint64_t) i << 1 | READ_PHASE);
+}
+
+
+/* The last block may be short, so it is padded out for O_DIRECT and the file
+ * is truncated to the correct length at the end. */
+static void queue_write(struct capture *capture, unsigned int i)
+{
+    struct capture_buffer *buffer = &capture->buffers[i];
+    size_t length = (buffer->length + DIRECT_ALIGNMENT - 1) &
+        ~(size_t) (DIRECT_ALIGNMENT - 1);
+    uring_queue(&capture->ring, IORING_OP_WRITE_FIXED, capture->output,
+        (char *) buffer->data + buffer->done, length - buffer->done,
+        buffer->offset + buffer->done, i,
+        (uint64_t) i << 1 | WRITE_PHASE);
+}
+
+
+/* Starts reading the next block of the capture into the given buffer if there
+ * is anything left to read. */
+static void start_block(struct capture *capture, unsigned int i)
+{
+    size_t remaining = capture_length - capture->next_offset;
+    if (remaining > 0)
+    {
+        struct capture_buffer *buffer = &capture->buffers[i];
+        buffer->offset = capture->next_offset;
+        buffer->length = remaining < block_size ? remaining : block_size;
+        buffer->done = 0;
+        if (buffer->length < block_size)
+            memset(buffer->data, 0, block_size);
+        capture->next_offset += buffer->length;
+        capture->active += 1;
+        queue_read(capture, i);
+    }
+}
+
+
+static int complete_request(struct capture *capture, struct io_uring_cqe *cqe)
+{
+    unsigned int i = (unsigned int) (cqe->user_data >> 1);
+    unsigned int phase = (unsigned int) (cqe->user_data & 1);
+    struct capture_buffer *buffer = &capture->buffers[i];
+    int res = cqe->res;
+
+    if (res == -EAGAIN  ||  res == -EINTR)
+        res = 0;
+    else if (res <= 0)
+    {
+        fprintf(stderr, "%s failed at offset %zu: %s\n",
+            phase == READ_PHASE ? "Read" : "Write",
+            buffer->offset + buffer->done,
+            res == 0 ? "unexpected end of file" : strerror(-res));
+        return -1;
+    }
+
+    /* Both the DMA device and the disk can complete requests short, in which
+     * case we just carry on from where we got to. */
+    buffer->done += (size_t) res;
+    if (phase == READ_PHASE)
+    {
+        if (buffer->done < buffer->length)
+            queue_read(capture, i);
+        else
+        {
+            buffer->done = 0;
+            queue_write(capture, i);
+        }
+    }
+    else if (buffer->done < buffer->length)
+        queue_write(capture, i);
+    else
+    {
+        capture->written += buffer->length;
+        capture->active -= 1;
+        start_block(capture, i);
+    }
+    return 0;
+}
+
+
+static void report_progress(
+    struct capture *capture, double start, double *last, size_t *last_written)
+{
+    double t = now();
+    if (t - *last >= 1.0)
+    {
+        printf("%6.1f s  %10.1f MB  %8.1f MB/s\n",
+            t - start, 1e-6 * (double) capture->written,
+            1e-6 * (double) (capture->written - *last_written) / (t - *last));
+        fflush(stdout);
+        *last = t;
+        *last_written = capture->written;
+    }
+}
+
+
+static int run_capture(struct capture *capture)
+{
+    for (unsigned int i = 0; i < queue_depth; i ++)
+        start_block(capture, i);
+
+    double start = now();
+    double last = start;
+    size_t last_written = 0;
+    while (capture->active > 0)
+    {
+        if (uring_submit_and_wait(&capture->ring) < 0)
+        {
+            perror("io_uring_enter");
+            return -1;
+        }
+
+        struct uring *ring = &capture->ring;
+        unsigned int head = *ring->cq_head;
+        unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head ++)
+            if (complete_request(
+                    capture, &ring->cqes[head & *ring->cq_mask]) < 0)
+                return -1;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        report_progress(capture, start, &last, &last_written);
+    }
+
+    if (ftruncate(capture->output, (off_t) capture_length) < 0  ||
+        (sync_output  &&  fsync(capture->output) < 0))
+    {
+        perror(output_name);
+        return -1;
+    }
+
+    double elapsed = now() - start;
+    printf("Captured %zu bytes in %.3f s: %.1f MB/s\n",
+        capture_length, elapsed, 1e-6 * (double) capture_length / elapsed);
+    return 0;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Setup. */
+
+
+static int open_files(struct capture *capture)
+{
+    capture->device = open(device_name, O_RDONLY);
+    if (capture->device < 0)
+    {
+        perror(device_name);
+        return -1;
+    }
+
+    off_t area_length = lseek(capture->device, 0, SEEK_END);
+    if (area_length < 0)
+    {
+        perror("Unable to determine DMA area size");
+        return -1;
+    }
+    if (start_offset > (size_t) area_length)
+    {
+        fprintf(stderr, "Start offset beyond end of DMA area\n");
+        return -1;
+    }
+    if (capture_length == 0)
+        capture_length = (size_t) area_length - start_offset;
+    if (capture_length > (size_t) area_length - start_offset)
+    {
+        fprintf(stderr, "Capture extends beyond end of DMA area\n");
+        return -1;
+    }
+
+    capture->output = open(output_name,
+        O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    if (capture->output < 0)
+    {
+        perror(output_name);
+        return -1;
+    }
+    return 0;
+}
+
+
+static int allocate_buffers(struct capture *capture)
+{
+    struct iovec iovecs[queue_depth];
+    capture->buffers = calloc(queue_depth, sizeof(struct capture_buffer));
+    if (!capture->buffers)
+        return -1;
+    for (unsigned int i = 0; i < queue_depth; i ++)
+    {
+        void *data = mmap(NULL, block_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (data == MAP_FAILED)
+        {
+            perror("Unable to allocate buffer");
+            return -1;
+        }
+        capture->buffers[i].data = data;
+        iovecs[i] = (struct iovec) { .iov_base = data, .iov_len = block_size };
+    }
+
+    if (uring_setup(&capture->ring, queue_depth) < 0)
+    {
+        perror("io_uring_setup");
+        return -1;
+    }
+    if (uring_register_buffers(&capture->ring, iovecs, queue_depth) < 0)
+    {
+        perror("Unable to register buffers");
+        return -1;
+    }
+    return 0;
+}
+
+
+static bool parse_size(const char *arg, size_t *result)
+{
+    char *end;
+    unsigned long long value = strtoull(arg, &end, 0);
+    switch (*end)
+    {
+        case 'G':   value <<= 10;   /* fall through */
+        case 'M':   value <<= 10;   /* fall through */
+        case 'K':   value <<= 10;   end += 1;   break;
+        default:    break;
+    }
+    *result = (size_t) value;
+    return end != arg  &&  *end == '\0';
+}
+
+
+static void usage(const char *argv0)
+{
+    printf(
+"Usage: %s [options] device output\n"
+"Captures a DMA area to a file, writing with O_DIRECT through io_uring.\n"
+"Sizes can be given with a K, M or G suffix.  Options:\n"
+"   -s: Offset into DMA area of start of capture (default 0)\n"
+"   -l: Length of capture (default rest of DMA area)\n"
+"   -b: Size of each transfer (default %zuM)\n"
+"   -q: Number of transfers kept in flight (default %u)\n"
+"   -S  Sync output file before reporting completion\n"
+        , argv0, block_size >> 20, queue_depth);
+}
+
+
+static bool parse_args(int argc, char **argv)
+{
+    bool ok = true;
+    int opt;
+    while (ok  &&  (opt = getopt(argc, argv, "s:l:b:q:Sh")) != -1)
+    {
+        switch (opt)
+        {
+            case 's':   ok = parse_size(optarg, &start_offset);     break;
+            case 'l':   ok = parse_size(optarg, &capture_length);   break;
+            case 'b':   ok = parse_size(optarg, &block_size);       break;
+            case 'q':   queue_depth = strtoul(optarg, NULL, 0);     break;
+            case 'S':   sync_output = true;                         break;
+            case 'h':   usage(argv[0]);                             exit(0);
+            default:    ok = false;                                 break;
+        }
+    }
+    ok = ok  &&  argc - optind == 2  &&
+        queue_depth > 0  &&  queue_depth <= 64  &&
+        block_size > 0  &&  block_size % DIRECT_ALIGNMENT == 0  &&
+        block_size <= (1U << 30);
+    if (!ok)
+    {
+        fprintf(stderr, "Invalid arguments.  Try -h for help\n");
+        return false;
+    }
+    device_name = argv[optind];
+    output_name = argv[optind + 1];
+    return true;
+}
+
+
+int main(int argc, char **argv)
+{
+    struct capture capture = { .device = -1, .output = -1 };
+    bool ok =
+        parse_args(argc, argv)  &&
+        open_files(&capture) == 0  &&
+        allocate_buffers(&capture) == 0  &&
+        run_capture(&capture) == 0;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,463 @@
+/* Measures the latency from an FPGA event to the user space reader.
+ *
+ * A trigger thread raises one event at a time, either by writing a loopback
+ * register in BAR0 which the FPGA turns into an interrupt, or by asking the
+ * driver to inject the event.  A reader thread, pinned and scheduled as
+ * requested, waits for each event on the register device and collects the
+ * interrupt handler entry and reader wakeup times recorded by the driver.
+ * Each combination of reader CPU and priority is run in turn and the latency
+ * percentiles are reported for each. */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "amc_pci_device.h"
+
+
+#define MAX_SETTINGS    64
+#define HISTOGRAM_BINS  32
+
+/* Latencies are measured from the interrupt to the reader wakeup in the kernel
+ * and to the return from read() in user space. */
+#define KERNEL_STAGE    0
+#define USER_STAGE      1
+#define STAGES          2
+
+static const char *stage_names[STAGES] = { "wakeup", "user" };
+
+
+static unsigned int event_count = 10000;
+static unsigned int interval_us = 1000;
+static unsigned int event_bit = 0;
+static bool loopback = false;
+static size_t loopback_offset;
+static uint32_t loopback_value;
+static bool show_histogram = false;
+static int cpus[MAX_SETTINGS] = { -1 };
+static unsigned int cpu_count = 1;
+static int priorities[MAX_SETTINGS] = { 0 };
+static unsigned int priority_count = 1;
+static const char *device_name;
+
+
+struct run {
+    int device;
+    volatile uint32_t *registers;   // Only mapped for loopback
+    int cpu;                        // Reader CPU or -1 for no pinning
+    int priority;                   // SCHED_FIFO priority or 0 for normal
+
+    volatile bool stopping;
+    unsigned int received;          // Updated by reader, polled by trigger
+    unsigned int unknown;           // Events with no interrupt time
+    uint64_t *latency[STAGES];      // Latencies in ns for each event
+};
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Event generation and collection. */
+
+
+static int trigger_event(struct run *run)
+{
+    if (loopback)
+    {
+        run->registers[loopback_offset / sizeof(uint32_t)] = loopback_value;
+        return 0;
+    }
+    else
+        return ioctl(run->device, AMC_EVENT_INJECT, 1U << event_bit);
+}
+
+
+/* Waits for the next event, giving up periodically to check for the end of the
+ * run.  Returns 1 when an event of interest has been read. */
+static int read_event(struct run *run, struct amc_event_times *times)
+{
+    struct pollfd pollfd = { .fd = run->device, .events = POLLIN };
+    int rc = poll(&pollfd, 1, 100);
+    if (rc <= 0)
+        return rc;
+
+    uint32_t events;
+    if (read(run->device, &events, sizeof(events)) < 0)
+        return errno == EAGAIN ? 0 : -1;
+    if (ioctl(run->device, AMC_EVENT_TIMES, times) < 0)
+        return -1;
+    return (events >> event_bit) & 1;
+}
+
+
+static void *reader_thread(void *context)
+{
+    struct run *run = context;
+    while (!run->stopping  &&  run->received < event_count)
+    {
+        struct amc_event_times times;
+        int rc = read_event(run, &times);
+        uint64_t user = now_ns();
+        if (rc < 0)
+        {
+            perror("Unable to read event");
+            break;
+        }
+        else if (rc > 0)
+        {
+            unsigned int n = run->received;
+            if (times.interrupt == 0)
+                run->unknown += 1;
+            else
+            {
+                run->latency[KERNEL_STAGE][n - run->unknown] =
+                    times.wakeup - times.interrupt;
+                run->latency[USER_STAGE][n - run->unknown] =
+                    user - times.interrupt;
+            }
+            __atomic_store_n(&run->received, n + 1, __ATOMIC_RELEASE);
+        }
+    }
+    return NULL;
+}
+
+
+/* Raises each event once the previous one has been collected, or after a
+ * second if it appears to have been lost. */
+static int trigger_events(struct run *run)
+{
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (unsigned int sent = 0;
+         __atomic_load_n(&run->received, __ATOMIC_ACQUIRE) < event_count;
+         sent ++)
+    {
+        next.tv_nsec += (long) interval_us * 1000;
+        while (next.tv_nsec >= 1000000000)
+        {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec += 1;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+        if (trigger_event(run) < 0)
+        {
+            perror("Unable to trigger event");
+            return -1;
+        }
+        uint64_t deadline = now_ns() + 1000000000;
+        while (__atomic_load_n(&run->received, __ATOMIC_ACQUIRE) <= sent  &&
+               now_ns() < deadline)
+            sched_yield();
+        if (now_ns() >= deadline)
+        {
+            fprintf(stderr, "Event lost, is the reader running?\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+static int start_reader(struct run *run, pthread_t *thread)
+{
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (run->cpu >= 0)
+    {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(run->cpu, &cpuset);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+    }
+    if (run->priority > 0)
+    {
+        struct sched_param param = { .sched_priority = run->priority };
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &param);
+    }
+    int rc = pthread_create(thread, &attr, reader_thread, run);
+    pthread_attr_destroy(&attr);
+    if (rc != 0)
+    {
+        errno = rc;
+        perror("Unable to start reader thread");
+        return -1;
+    }
+    return 0;
+}
+
+
+static int run_events(struct run *run)
+{
+    pthread_t thread;
+    if (start_reader(run, &thread) < 0)
+        return -1;
+    int rc = trigger_events(run);
+    run->stopping = true;
+    pthread_join(thread, NULL);
+    return rc;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Reporting. */
+
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+
+static double percentile(const uint64_t *sorted, unsigned int count, double p)
+{
+    unsigned int index = (unsigned int) (p * (count - 1) / 100 + 0.5);
+    return 1e-3 * (double) sorted[index];
+}
+
+
+/* Prints the number of events in each power of two bin of latency. */
+static void print_histogram(const uint64_t *sorted, unsigned int count)
+{
+    unsigned int bins[HISTOGRAM_BINS] = { 0 };
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        unsigned int bin = 0;
+        while (bin < HISTOGRAM_BINS - 1  &&  sorted[i] >> (bin + 1))
+            bin += 1;
+        bins[bin] += 1;
+    }
+    for (unsigned int bin = 0; bin < HISTOGRAM_BINS; bin ++)
+        if (bins[bin])
+            printf("    >= %10llu ns: %8u  %6.2f%%\n",
+                bin > 0 ? 1ULL << bin : 0, bins[bin],
+                100.0 * bins[bin] / count);
+}
+
+
+static void report_run(struct run *run)
+{
+    char cpu[16];
+    if (run->cpu < 0)
+        snprintf(cpu, sizeof(cpu), "any");
+    else
+        snprintf(cpu, sizeof(cpu), "%d", run->cpu);
+
+    unsigned int count = run->received - run->unknown;
+    for (int stage = 0; stage < STAGES; stage ++)
+    {
+        uint64_t *latency = run->latency[stage];
+        qsort(latency, count, sizeof(uint64_t), compare_u64);
+        if (count == 0)
+            printf("%-4s %4d %-7s no events timed\n",
+                cpu, run->priority, stage_names[stage]);
+        else
+            printf("%-4s %4d %-7s %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f\n",
+                cpu, run->priority, stage_names[stage],
+                1e-3 * (double) latency[0],
+                percentile(latency, count, 50),
+                percentile(latency, count, 90),
+                percentile(latency, count, 99),
+                percentile(latency, count, 99.9),
+                1e-3 * (double) latency[count - 1]);
+        if (show_histogram  &&  count > 0)
+            print_histogram(latency, count);
+    }
+    if (run->unknown)
+        printf("%-4s %4d %u events arrived during a read and were not timed\n",
+            cpu, run->priority, run->unknown);
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Setup. */
+
+
+static int open_device(struct run *run)
+{
+    run->device = open(device_name, O_RDWR);
+    if (run->device < 0)
+    {
+        perror(device_name);
+        return -1;
+    }
+
+    if (loopback)
+    {
+        long map_size = ioctl(run->device, AMC_MAP_SIZE);
+        if (map_size < 0)
+        {
+            perror("Unable to read register area size");
+            return -1;
+        }
+        if (loopback_offset % sizeof(uint32_t)  ||
+            loopback_offset >= (size_t) map_size)
+        {
+            fprintf(stderr, "Invalid loopback register offset\n");
+            return -1;
+        }
+        run->registers = mmap(NULL, (size_t) map_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, run->device, 0);
+        if (run->registers == MAP_FAILED)
+        {
+            perror("Unable to map registers");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+static int run_all(struct run *run)
+{
+    for (int stage = 0; stage < STAGES; stage ++)
+    {
+        run->latency[stage] = calloc(event_count, sizeof(uint64_t));
+        if (!run->latency[stage])
+        {
+            perror("Unable to allocate buffers");
+            return -1;
+        }
+    }
+    /* Keep page faults out of the measurements. */
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+        perror("Warning: unable to lock memory");
+
+    printf("Latency in us from interrupt for %u events, interval %u us\n",
+        event_count, interval_us);
+    printf("%-4s %4s %-7s %8s %8s %8s %8s %8s %8s\n",
+        "cpu", "prio", "stage", "min", "50%", "90%", "99%", "99.9%", "max");
+    for (unsigned int c = 0; c < cpu_count; c ++)
+        for (unsigned int p = 0; p < priority_count; p ++)
+        {
+            run->cpu = cpus[c];
+            run->priority = priorities[p];
+            run->stopping = false;
+            run->received = 0;
+            run->unknown = 0;
+            if (run_events(run) < 0)
+                return -1;
+            report_run(run);
+        }
+    return 0;
+}
+
+
+/* Parses a comma separated list of integers of at least the given minimum. */
+static bool parse_list(
+    const char *arg, int *list, unsigned int *count, int minimum)
+{
+    *count = 0;
+    char *end;
+    do {
+        if (*count >= MAX_SETTINGS)
+            return false;
+        long value = strtol(arg, &end, 0);
+        if (end == arg  ||  value < minimum)
+            return false;
+        list[(*count)++] = (int) value;
+        arg = end + 1;
+    } while (*end == ',');
+    return *end == '\0';
+}
+
+
+static bool parse_loopback(const char *arg)
+{
+    char *end;
+    loopback = true;
+    loopback_offset = strtoul(arg, &end, 0);
+    if (end == arg  ||  *end != '=')
+        return false;
+    arg = end + 1;
+    loopback_value = (uint32_t) strtoul(arg, &end, 0);
+    return end != arg  &&  *end == '\0';
+}
+
+
+static void usage(const char *argv0)
+{
+    printf(
+"Usage: %s [options] device\n"
+"Measures the latency from event interrupt to wakeup of a reader of the given\n"
+"register device.  Events are injected through the driver, which requires\n"
+"CAP_SYS_ADMIN, unless a loopback register is given.  Options:\n"
+"   -n: Number of events measured for each setting (default %u)\n"
+"   -i: Interval between events in us (default %u)\n"
+"   -e: Event bit to raise and wait for (default %u)\n"
+"   -l: Raise events by writing offset=value to a BAR0 register\n"
+"   -c: Comma separated list of reader CPUs, -1 for no pinning (default -1)\n"
+"   -p: Comma separated list of reader SCHED_FIFO priorities, 0 for normal\n"
+"       scheduling (default 0)\n"
+"   -H  Print histogram of latencies for each setting\n"
+        , argv0, event_count, interval_us, event_bit);
+}
+
+
+static bool parse_args(int argc, char **argv)
+{
+    bool ok = true;
+    int opt;
+    while (ok  &&  (opt = getopt(argc, argv, "n:i:e:l:c:p:Hh")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':   event_count = strtoul(optarg, NULL, 0);     break;
+            case 'i':   interval_us = strtoul(optarg, NULL, 0);     break;
+            case 'e':   event_bit = strtoul(optarg, NULL, 0);       break;
+            case 'l':   ok = parse_loopback(optarg);                break;
+            case 'c':
+                ok = parse_list(optarg, cpus, &cpu_count, -1);
+                break;
+            case 'p':
+                ok = parse_list(optarg, priorities, &priority_count, 0);
+                break;
+            case 'H':   show_histogram = true;                      break;
+            case 'h':   usage(argv[0]);                             exit(0);
+            default:    ok = false;                                 break;
+        }
+    }
+    ok = ok  &&  argc - optind == 1  &&
+        event_count > 0  &&  event_bit < 31;
+    if (!ok)
+    {
+        fprintf(stderr, "Invalid arguments.  Try -h for help\n");
+        return false;
+    }
+    device_name = argv[optind];
+    return true;
+}
+
+
+int main(int argc, char **argv)
+{
+    struct run run = { .device = -1 };
+    bool ok =
+        parse_args(argc, argv)  &&
+        open_device(&run) == 0  &&
+        run_all(&run) == 0;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,492 @@
+/* Sample unpacking with run time selection of SIMD kernels. */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <immintrin.h>
+
+#include "amc_unpack.h"
+
+
+#define TARGET_AVX2     __attribute__((target("avx2")))
+#define TARGET_AVX512   __attribute__((target("avx2,avx512f,avx512bw")))
+
+
+/* Each instruction set provides the following set of kernels.  Every kernel
+ * processes the complete request, finishing off any tail with scalar code. */
+struct unpack_kernels {
+    enum amc_unpack_isa isa;
+    void (*deinterleave2)(
+        const int16_t *in, int16_t *const out[], size_t frames);
+    void (*deinterleave4)(
+        const int16_t *in, int16_t *const out[], size_t frames);
+    void (*sign_extend)(
+        const int16_t *in, int16_t *out, size_t count, unsigned int bits);
+    void (*unpack12)(const uint8_t *in, int16_t *out, size_t count);
+    void (*to_float)(
+        const int16_t *in, float *out, size_t count, float scale);
+};
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Scalar implementation. */
+
+
+static void deinterleave_scalar(
+    const int16_t *in, int16_t *const out[], size_t channels, size_t frames)
+{
+    for (size_t i = 0; i < frames; i ++)
+        for (size_t c = 0; c < channels; c ++)
+            out[c][i] = in[i * channels + c];
+}
+
+
+static void deinterleave2_scalar(
+    const int16_t *in, int16_t *const out[], size_t frames)
+{
+    deinterleave_scalar(in, out, 2, frames);
+}
+
+
+static void deinterleave4_scalar(
+    const int16_t *in, int16_t *const out[], size_t frames)
+{
+    deinterleave_scalar(in, out, 4, frames);
+}
+
+
+static int16_t sign_extend(uint32_t value, unsigned int bits)
+{
+    return (int16_t) ((int32_t) (value << (32 - bits)) >> (32 - bits));
+}
+
+
+static void sign_extend_scalar(
+    const int16_t *in, int16_t *out, size_t count, unsigned int bits)
+{
+    for (size_t i = 0; i < count; i ++)
+        out[i] = sign_extend((uint16_t) in[i], bits);
+}
+
+
+static void unpack_bits_scalar(
+    const uint8_t *in, int16_t *out, size_t count, unsigned int bits)
+{
+    uint64_t buffer = 0;
+    unsigned int buffered = 0;
+    for (size_t i = 0; i < count; i ++)
+    {
+        while (buffered < bits)
+        {
+            buffer |= (uint64_t) *in++ << buffered;
+            buffered += 8;
+        }
+        out[i] = sign_extend((uint32_t) buffer & ((1U << bits) - 1), bits);
+        buffer >>= bits;
+        buffered -= bits;
+    }
+}
+
+
+static void unpack12_scalar(const uint8_t *in, int16_t *out, size_t count)
+{
+    unpack_bits_scalar(in, out, count, 12);
+}
+
+
+static void to_float_scalar(
+    const int16_t *in, float *out, size_t count, float scale)
+{
+    for (size_t i = 0; i < count; i ++)
+        out[i] = (float) in[i] * scale;
+}
+
+
+static const struct unpack_kernels scalar_kernels = {
+    .isa = AMC_UNPACK_SCALAR,
+    .deinterleave2 = deinterleave2_scalar,
+    .deinterleave4 = deinterleave4_scalar,
+    .sign_extend = sign_extend_scalar,
+    .unpack12 = unpack12_scalar,
+    .to_float = to_float_scalar,
+};
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* AVX2 implementation. */
+
+
+/* Separates the even and odd samples of the 32 samples in a and b. */
+TARGET_AVX2 static inline void split_avx2(
+    __m256i a, __m256i b, __m256i *even, __m256i *odd)
+{
+    /* Gather evens and odds into separate 64-bit halves of each lane, and then
+     * gather the halves together. */
+    const __m256i shuffle = _mm256_setr_epi8(
+        0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15,
+        0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15);
+    a = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(a, shuffle), 0xD8);
+    b = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(b, shuffle), 0xD8);
+    *even = _mm256_permute2x128_si256(a, b, 0x20);
+    *odd = _mm256_permute2x128_si256(a, b, 0x31);
+}
+
+
+TARGET_AVX2 static void deinterleave2_avx2(
+    const int16_t *in, int16_t *const out[], size_t frames)
+{
+    size_t i = 0;
+    for (; i + 16 <= frames; i += 16)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *) &in[2 * i]);
+        __m256i b = _mm256_loadu_si256((const __m256i *) &in[2 * i + 16]);
+        __m256i ch0, ch1;
+        split_avx2(a, b, &ch0, &ch1);
+        _mm256_storeu_si256((__m256i *) &out[0][i], ch0);
+        _mm256_storeu_si256((__m256i *) &out[1][i], ch1);
+    }
+    int16_t *const tail[] = { out[0] + i, out[1] + i };
+    deinterleave_scalar(in + 2 * i, tail, 2, frames - i);
+}
+
+
+TARGET_AVX2 static void deinterleave4_avx2(
+    const int16_t *in, int16_t *const out[], size_t frames)
+{
+    size_t i = 0;
+    for (; i + 16 <= frames; i += 16)
+    {
+        const __m256i *p = (const __m256i *) &in[4 * i];
+        __m256i even01, odd01, even23, odd23;
+        split_avx2(
+            _mm256_loadu_si256(p), _mm256_loadu_si256(p + 1),
+            &even01, &odd01);
+        split_avx2(
+            _mm256_loadu_si256(p + 2), _mm256_loadu_si256(p + 3),
+            &even23, &odd23);
+        __m256i ch0, ch1, ch2, ch3;
+        split_avx2(even01, even23, &ch0, &ch2);
+        split_avx2(odd01, odd23, &ch1, &ch3);
+        _mm256_storeu_si256((__m256i *) &out[0][i], ch0);
+        _mm256_storeu_si256((__m256i *) &out[1][i], ch1);
+        _mm256_storeu_si256((__m256i *) &out[2][i], ch2);
+        _mm256_storeu_si256((__m256i *) &out[3][i], ch3);
+    }
+    int16_t *const tail[] = { out[0] + i, out[1] + i, out[2] + i, out[3] + i };
+    deinterleave_scalar(in + 4 * i, tail, 4, frames - i);
+}
+
+
+TARGET_AVX2 static void sign_extend_avx2(
+    const int16_t *in, int16_t *out, size_t count, unsigned int bits)
+{
+    __m128i shift = _mm_cvtsi32_si128((int) (16 - bits));
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256i value = _mm256_loadu_si256((const __m256i *) &in[i]);
+        value = _mm256_sra_epi16(_mm256_sll_epi16(value, shift), shift);
+        _mm256_storeu_si256((__m256i *) &out[i], value);
+    }
+    sign_extend_scalar(in + i, out + i, count - i, bits);
+}
+
+
+/* Each lane unpacks eight 12-bit samples from 12 bytes.  The two bytes holding
+ * each sample are moved into place, even samples are shifted to the top of
+ * their word by multiplying by 16, and an arithmetic shift right by 4 then
+ * leaves every sample sign extended. */
+TARGET_AVX2 static void unpack12_avx2(
+    const uint8_t *in, int16_t *out, size_t count)
+{
+    const __m256i shuffle = _mm256_setr_epi8(
+        0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11,
+        0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11);
+    const __m256i multiplier = _mm256_setr_epi16(
+        16, 1, 16, 1, 16, 1, 16, 1, 16, 1, 16, 1, 16, 1, 16, 1);
+
+    /* Each step reads 16 bytes from offset 12, so stop early enough to avoid
+     * reading beyond the end of the input. */
+    size_t in_length = (count * 12 + 7) / 8;
+    size_t i = 0;
+    for (; i + 16 <= count  &&  i / 16 * 24 + 28 <= in_length; i += 16)
+    {
+        const uint8_t *p = in + i / 16 * 24;
+        __m256i value = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) p)),
+            _mm_loadu_si128((const __m128i *) (p + 12)), 1);
+        value = _mm256_shuffle_epi8(value, shuffle);
+        value = _mm256_srai_epi16(_mm256_mullo_epi16(value, multiplier), 4);
+        _mm256_storeu_si256((__m256i *) &out[i], value);
+    }
+    unpack_bits_scalar(in + i / 16 * 24, out + i, count - i, 12);
+}
+
+
+TARGET_AVX2 static void to_float_avx2(
+    const int16_t *in, float *out, size_t count, float scale)
+{
+    __m256 scale8 = _mm256_set1_ps(scale);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i value = _mm256_cvtepi16_epi32(
+            _mm_loadu_si128((const __m128i *) &in[i]));
+        _mm256_storeu_ps(
+            &out[i], _mm256_mul_ps(_mm256_cvtepi32_ps(value), scale8));
+    }
+    to_float_scalar(in + i, out + i, count - i, scale);
+}
+
+
+static const struct unpack_kernels avx2_kernels = {
+    .isa = AMC_UNPACK_AVX2,
+    .deinterleave2 = deinterleave2_avx2,
+    .deinterleave4 = deinterleave4_avx2,
+    .sign_extend = sign_extend_avx2,
+    .unpack12 = unpack12_avx2,
+    .to_float = to_float_avx2,
+};
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* AVX-512 implementation. */
+
+
+static const int16_t split_even_index[32] = {
+     0,  2,  4,  6,  8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30,
+    32, 34, 36, 38, 40, 42, 44, 46, 48, 50, 52, 54, 56, 58, 60, 62,
+};
+static const int16_t split_odd_index[32] = {
+     1,  3,  5,  7,  9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29, 31,
+    33, 35, 37, 39, 41, 43, 45, 47, 49, 51, 53, 55, 57, 59, 61, 63,
+};
+
+
+/* Separates the even and odd samples of the 64 samples in a and b. */
+TARGET_AVX512 static inline void split_avx512(
+    __m512i a, __m512i b, __m512i *even, __m512i *odd)
+{
+    *even = _mm512_permutex2var_epi16(
+        a, _mm512_loadu_si512(split_even_index), b);
+    *odd = _mm512_permutex2var_epi16(
+        a, _mm512_loadu_si512(split_odd_index), b);
+}
+
+
+TARGET_AVX512 static void deinterleave2_avx512(
+    const int16_t *in, int16_t *const out[], size_t frames)
+{
+    size_t i = 0;
+    for (; i + 32 <= frames; i += 32)
+    {
+        __m512i ch0, ch1;
+        split_avx512(
+            _mm512_loadu_si512(&in[2 * i]), _mm512_loadu_si512(&in[2 * i + 32]),
+            &ch0, &ch1);
+        _mm512_storeu_si512(&out[0][i], ch0);
+        _mm512_storeu_si512(&out[1][i], ch1);
+    }
+    int16_t *const tail[] = { out[0] + i, out[1] + i };
+    deinterleave_scalar(in + 2 * i, tail, 2, frames - i);
+}
+
+
+TARGET_AVX512 static void deinterleave4_avx512(
+    const int16_t *in, int16_t *const out[], size_t frames)
+{
+    size_t i = 0;
+    for (; i + 32 <= frames; i += 32)
+    {
+        const int16_t *p = &in[4 * i];
+        __m512i even01, odd01, even23, odd23;
+        split_avx512(
+            _mm512_loadu_si512(p), _mm512_loadu_si512(p + 32),
+            &even01, &odd01);
+        split_avx512(
+            _mm512_loadu_si512(p + 64), _mm512_loadu_si512(p + 96),
+            &even23, &odd23);
+        __m512i ch0, ch1, ch2, ch3;
+        split_avx512(even01, even23, &ch0, &ch2);
+        split_avx512(odd01, odd23, &ch1, &ch3);
+        _mm512_storeu_si512(&out[0][i], ch0);
+        _mm512_storeu_si512(&out[1][i], ch1);
+        _mm512_storeu_si512(&out[2][i], ch2);
+        _mm512_storeu_si512(&out[3][i], ch3);
+    }
+    int16_t *const tail[] = { out[0] + i, out[1] + i, out[2] + i, out[3] + i };
+    deinterleave_scalar(in + 4 * i, tail, 4, frames - i);
+}
+
+
+TARGET_AVX512 static void sign_extend_avx512(
+    const int16_t *in, int16_t *out, size_t count, unsigned int bits)
+{
+    __m128i shift = _mm_cvtsi32_si128((int) (16 - bits));
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m512i value = _mm512_loadu_si512(&in[i]);
+        value = _mm512_sra_epi16(_mm512_sll_epi16(value, shift), shift);
+        _mm512_storeu_si512(&out[i], value);
+    }
+    sign_extend_scalar(in + i, out + i, count - i, bits);
+}
+
+
+TARGET_AVX512 static void to_float_avx512(
+    const int16_t *in, float *out, size_t count, float scale)
+{
+    __m512 scale16 = _mm512_set1_ps(scale);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m512i value = _mm512_cvtepi16_epi32(
+            _mm256_loadu_si256((const __m256i *) &in[i]));
+        _mm512_storeu_ps(
+            &out[i], _mm512_mul_ps(_mm512_cvtepi32_ps(value), scale16));
+    }
+    to_float_scalar(in + i, out + i, count - i, scale);
+}
+
+
+/* The AVX2 bit unpacking is already limited by memory bandwidth, so it is
+ * shared with the AVX-512 set. */
+static const struct unpack_kernels avx512_kernels = {
+    .isa = AMC_UNPACK_AVX512,
+    .deinterleave2 = deinterleave2_avx512,
+    .deinterleave4 = deinterleave4_avx512,
+    .sign_extend = sign_extend_avx512,
+    .unpack12 = unpack12_avx2,
+    .to_float = to_float_avx512,
+};
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Run time selection. */
+
+
+static const struct unpack_kernels *selected_kernels;
+
+
+static const struct unpack_kernels *kernels_for_isa(enum amc_unpack_isa isa)
+{
+    __builtin_cpu_init();
+    switch (isa)
+    {
+        case AMC_UNPACK_AVX512:
+            if (__builtin_cpu_supports("avx512f")  &&
+                __builtin_cpu_supports("avx512bw"))
+                return &avx512_kernels;
+            return NULL;
+        case AMC_UNPACK_AVX2:
+            if (__builtin_cpu_supports("avx2"))
+                return &avx2_kernels;
+            return NULL;
+        case AMC_UNPACK_SCALAR:
+            return &scalar_kernels;
+        default:
+            return NULL;
+    }
+}
+
+
+static const struct unpack_kernels *get_kernels(void)
+{
+    const struct unpack_kernels *kernels =
+        __atomic_load_n(&selected_kernels, __ATOMIC_ACQUIRE);
+    if (!kernels)
+    {
+        kernels = kernels_for_isa(AMC_UNPACK_AVX512);
+        if (!kernels)
+            kernels = kernels_for_isa(AMC_UNPACK_AVX2);
+        if (!kernels)
+            kernels = &scalar_kernels;
+        __atomic_store_n(&selected_kernels, kernels, __ATOMIC_RELEASE);
+    }
+    return kernels;
+}
+
+
+enum amc_unpack_isa amc_unpack_get_isa(void)
+{
+    return get_kernels()->isa;
+}
+
+
+int amc_unpack_set_isa(enum amc_unpack_isa isa)
+{
+    const struct unpack_kernels *kernels = kernels_for_isa(isa);
+    if (!kernels)
+        return -1;
+    __atomic_store_n(&selected_kernels, kernels, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+const char *amc_unpack_isa_name(enum amc_unpack_isa isa)
+{
+    switch (isa)
+    {
+        case AMC_UNPACK_SCALAR:     return "scalar";
+        case AMC_UNPACK_AVX2:       return "avx2";
+        case AMC_UNPACK_AVX512:     return "avx512";
+        default:                    return "unknown";
+    }
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Public interface. */
+
+
+void amc_deinterleave_i16(
+    const int16_t *in, int16_t *const out[], size_t channels, size_t frames)
+{
+    switch (channels)
+    {
+        case 1:
+            for (size_t i = 0; i < frames; i ++)
+                out[0][i] = in[i];
+            break;
+        case 2:
+            get_kernels()->deinterleave2(in, out, frames);
+            break;
+        case 4:
+            get_kernels()->deinterleave4(in, out, frames);
+            break;
+        default:
+            deinterleave_scalar(in, out, channels, frames);
+            break;
+    }
+}
+
+
+void amc_sign_extend_i16(
+    const int16_t *in, int16_t *out, size_t count, unsigned int bits)
+{
+    if (bits >= 16)
+    {
+        if (in != out)
+            for (size_t i = 0; i < count; i ++)
+                out[i] = in[i];
+    }
+    else if (bits > 0)
+        get_kernels()->sign_extend(in, out, count, bits);
+}
+
+
+void amc_unpack_bits(
+    const void *in, int16_t *out, size_t count, unsigned int bits)
+{
+    if (bits == 12)
+        get_kernels()->unpack12(in, out, count);
+    else if (0 < bits  &&  bits <= 16)
+        unpack_bits_scalar(in, out, count, bits);
+}
+
+
+void amc_i16_to_float(
+    const int16_t *in, float *out, size_t count, float scale)
+{
+    get_kernels()->to_float(in, out, count, scale);
+}
@@ -0,0 +1,61 @@
+/* Sample unpacking for data captured from the DMA areas.
+ *
+ * These functions convert raw data read from a DMA device, either with read()
+ * or from a mapped region, into separate channels of samples.  Each function is
+ * implemented with AVX-512 and AVX2 kernels where the processor supports them,
+ * with a scalar fallback, and the best implementation is selected at run time.
+ * Input and output buffers need no particular alignment. */
+
+#ifndef AMC_UNPACK_H
+#define AMC_UNPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum amc_unpack_isa {
+    AMC_UNPACK_SCALAR,
+    AMC_UNPACK_AVX2,
+    AMC_UNPACK_AVX512,
+};
+
+/* Returns the instruction set currently in use. */
+enum amc_unpack_isa amc_unpack_get_isa(void);
+
+/* Forces the use of a particular instruction set, mainly for testing.  Returns
+ * -1 if the processor doesn't support the requested instruction set. */
+int amc_unpack_set_isa(enum amc_unpack_isa isa);
+
+/* Returns a printable name for the given instruction set. */
+const char *amc_unpack_isa_name(enum amc_unpack_isa isa);
+
+
+/* Separates frames of interleaved int16 samples into one array per channel, so
+ * that sample i of channel c is copied from in[i * channels + c] to out[c][i].
+ * Two and four channels are vectorised, other channel counts are handled by the
+ * scalar code. */
+void amc_deinterleave_i16(
+    const int16_t *in, int16_t *const out[], size_t channels, size_t frames);
+
+/* Sign extends samples held in the bottom bits of each int16. */
+void amc_sign_extend_i16(
+    const int16_t *in, int16_t *out, size_t count, unsigned int bits);
+
+/* Unpacks a stream of signed samples each bits wide (1 to 16), packed least
+ * significant bit first, into sign extended int16 samples.  Twelve bit samples
+ * are vectorised. */
+void amc_unpack_bits(
+    const void *in, int16_t *out, size_t count, unsigned int bits);
+
+/* Converts int16 samples to float, multiplying each by scale. */
+void amc_i16_to_float(
+    const int16_t *in, float *out, size_t count, float scale);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,283 @@
+/* Checks and benchmarks the sample unpacking kernels.
+ *
+ * Every instruction set supported by this processor is checked against the
+ * scalar implementation and its throughput reported.  By default random data
+ * is used, but data can be read from a file or DMA device instead. */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "amc_unpack.h"
+
+
+#define MAX_CHANNELS    4
+
+
+static size_t frames = 1 << 20;
+static unsigned int channels = 4;
+static unsigned int repeats = 20;
+static const char *input_file;
+
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+
+static void *allocate(size_t size)
+{
+    void *result = malloc(size);
+    if (!result)
+    {
+        fprintf(stderr, "Unable to allocate %zu bytes\n", size);
+        exit(1);
+    }
+    return result;
+}
+
+
+static void read_input(void *buffer, size_t size)
+{
+    if (input_file)
+    {
+        int file = open(input_file, O_RDONLY);
+        if (file < 0)
+        {
+            perror(input_file);
+            exit(1);
+        }
+        size_t done = 0;
+        while (done < size)
+        {
+            ssize_t rx = read(file, (char *) buffer + done, size - done);
+            if (rx <= 0)
+            {
+                fprintf(stderr, "Unable to read %zu bytes from %s\n",
+                    size, input_file);
+                exit(1);
+            }
+            done += (size_t) rx;
+        }
+        close(file);
+    }
+    else
+    {
+        uint8_t *bytes = buffer;
+        for (size_t i = 0; i < size; i ++)
+            bytes[i] = (uint8_t) random();
+    }
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Individual tests. */
+
+
+struct test_data {
+    int16_t *input;                 // Interleaved raw samples
+    size_t samples;                 // Number of samples in input
+    int16_t *channel[MAX_CHANNELS]; // Deinterleaved output
+    int16_t *samples_out;           // Output from sign extend and unpack
+    float *floats;                  // Output from float conversion
+};
+
+
+static void run_deinterleave(struct test_data *data)
+{
+    amc_deinterleave_i16(data->input, data->channel, channels, frames);
+}
+
+static void run_sign_extend(struct test_data *data)
+{
+    amc_sign_extend_i16(data->input, data->samples_out, data->samples, 14);
+}
+
+static void run_unpack12(struct test_data *data)
+{
+    /* Input holds enough 12-bit samples to fill the output. */
+    amc_unpack_bits(data->input, data->samples_out, data->samples, 12);
+}
+
+static void run_to_float(struct test_data *data)
+{
+    amc_i16_to_float(data->input, data->floats, data->samples, 1.0f / 32768);
+}
+
+
+struct test {
+    const char *name;
+    void (*run)(struct test_data *data);
+    /* Returns the number of output arrays and the length of each. */
+    unsigned int (*output)(
+        struct test_data *data, void *outputs[], size_t *length);
+};
+
+
+static unsigned int deinterleave_output(
+    struct test_data *data, void *outputs[], size_t *length)
+{
+    for (unsigned int c = 0; c < channels; c ++)
+        outputs[c] = data->channel[c];
+    *length = frames * sizeof(int16_t);
+    return channels;
+}
+
+static unsigned int samples_output(
+    struct test_data *data, void *outputs[], size_t *length)
+{
+    outputs[0] = data->samples_out;
+    *length = data->samples * sizeof(int16_t);
+    return 1;
+}
+
+static unsigned int floats_output(
+    struct test_data *data, void *outputs[], size_t *length)
+{
+    outputs[0] = data->floats;
+    *length = data->samples * sizeof(float);
+    return 1;
+}
+
+
+static const struct test tests[] = {
+    { "deinterleave", run_deinterleave, deinterleave_output },
+    { "sign_extend", run_sign_extend, samples_output },
+    { "unpack12", run_unpack12, samples_output },
+    { "to_float", run_to_float, floats_output },
+};
+#define TEST_COUNT  (sizeof(tests) / sizeof(tests[0]))
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+static void clear_outputs(struct test_data *data)
+{
+    for (unsigned int c = 0; c < channels; c ++)
+        memset(data->channel[c], 0, frames * sizeof(int16_t));
+    memset(data->samples_out, 0, data->samples * sizeof(int16_t));
+    memset(data->floats, 0, data->samples * sizeof(float));
+}
+
+
+/* Runs the given test with the current instruction set, returning false if
+ * the result differs from the expected result. */
+static bool run_test(
+    const struct test *test, struct test_data *data, void *expected[],
+    bool check)
+{
+    void *outputs[MAX_CHANNELS];
+    size_t length;
+    unsigned int count = test->output(data, outputs, &length);
+
+    clear_outputs(data);
+    test->run(data);
+    if (!check)
+        for (unsigned int i = 0; i < count; i ++)
+            memcpy(expected[i], outputs[i], length);
+    else
+        for (unsigned int i = 0; i < count; i ++)
+            if (memcmp(expected[i], outputs[i], length) != 0)
+                return false;
+
+    double start = now();
+    for (unsigned int i = 0; i < repeats; i ++)
+        test->run(data);
+    double elapsed = (now() - start) / repeats;
+    printf("  %-14s %8.1f Msamples/s\n",
+        test->name, 1e-6 * (double) data->samples / elapsed);
+    return true;
+}
+
+
+static void usage(const char *argv0)
+{
+    printf(
+"Usage: %s [options]\n"
+"Checks the sample unpacking kernels against the scalar implementation and\n"
+"reports their throughput.  Options:\n"
+"   -n: Number of frames to process (default %zu)\n"
+"   -c: Number of interleaved channels (default %u)\n"
+"   -r: Number of repeats for timing (default %u)\n"
+"   -f: Read test data from this file or device instead of random data\n"
+        , argv0, frames, channels, repeats);
+}
+
+
+static bool parse_args(int argc, char **argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c:r:f:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':   frames = strtoul(optarg, NULL, 0);      break;
+            case 'c':   channels = strtoul(optarg, NULL, 0);    break;
+            case 'r':   repeats = strtoul(optarg, NULL, 0);     break;
+            case 'f':   input_file = optarg;                    break;
+            case 'h':   usage(argv[0]);                         exit(0);
+            default:
+                return false;
+        }
+    }
+    if (channels == 0  ||  channels > MAX_CHANNELS  ||  frames == 0  ||
+        repeats == 0  ||  optind != argc)
+    {
+        fprintf(stderr, "Invalid arguments.  Try -h for help\n");
+        return false;
+    }
+    return true;
+}
+
+
+int main(int argc, char **argv)
+{
+    if (!parse_args(argc, argv))
+        return 1;
+
+    struct test_data data = { .samples = frames * channels };
+    size_t sample_bytes = data.samples * sizeof(int16_t);
+    data.input = allocate(sample_bytes);
+    read_input(data.input, sample_bytes);
+    for (unsigned int c = 0; c < channels; c ++)
+        data.channel[c] = allocate(frames * sizeof(int16_t));
+    data.samples_out = allocate(sample_bytes);
+    data.floats = allocate(data.samples * sizeof(float));
+
+    /* Expected results for each test as computed by the scalar code. */
+    void *expected[TEST_COUNT][MAX_CHANNELS];
+    for (unsigned int t = 0; t < TEST_COUNT; t ++)
+        for (unsigned int c = 0; c < MAX_CHANNELS; c ++)
+            expected[t][c] = allocate(data.samples * sizeof(float));
+
+    bool ok = true;
+    for (enum amc_unpack_isa isa = AMC_UNPACK_SCALAR;
+         isa <= AMC_UNPACK_AVX512; isa ++)
+    {
+        if (amc_unpack_set_isa(isa) < 0)
+        {
+            printf("%s: not supported\n", amc_unpack_isa_name(isa));
+            continue;
+        }
+        printf("%s:\n", amc_unpack_isa_name(isa));
+        for (unsigned int t = 0; t < TEST_COUNT; t ++)
+            if (!run_test(&tests[t], &data, expected[t],
+                    isa != AMC_UNPACK_SCALAR))
+            {
+                printf("  %-14s MISMATCH\n", tests[t].name);
+                ok = false;
+            }
+    }
+    return ok ? 0 : 1;
+}